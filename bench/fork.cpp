@@ -0,0 +1,100 @@
+#include "assembler.hpp"
+#include "executor.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Loads a program next to a table of a million words once, then compares
+// assembling a virtual machine for every instance against forking them off
+// the loaded one. Every fork runs the program, which reads part of the table
+// and stores its sum, and the pages it had to copy are counted.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/fork.cpp -o fork -pthread
+
+constexpr std::string_view program = R"(
+       LD R1, TABLE
+       LD R2, COUNT
+       AND R0, R0, 0
+LOOP:  LDR R3, R1, 0
+       ADD R0, R0, R3
+       ADD R1, R1, 1
+       SUB R2, R2, 1
+       BRp LOOP
+       STI R0, RESULT
+       HALT
+TABLE: .WORD 0x100000
+COUNT: .WORD 1000
+RESULT: .WORD 0x200000
+)";
+
+constexpr std::uint32_t table = 0x100000, tableWords = 1 << 20;
+constexpr std::size_t instances = 10000, assembled = 100;
+
+template <typename Clock = std::chrono::steady_clock>
+std::int64_t us_since(typename Clock::time_point start)
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+int main()
+{
+   fs::path directory = fs::temp_directory_path() / "vm32bit_fork";
+   fs::create_directories(directory);
+   fs::path path = directory / "table.asx";
+   std::ofstream (path) << program;
+
+   // Assembling every instance on its own, the table is left out of it
+   auto start = std::chrono::steady_clock::now();
+   for (std::size_t index = 0; index < assembled; ++index)
+   {
+      auto vm = std::make_unique<VmContext>();
+      Catcher catcher;
+      assemble(catcher, *vm, path);
+   }
+   std::int64_t assembling = us_since(start);
+
+   auto parent = std::make_unique<VmContext>();
+   Catcher catcher;
+   bool loaded = assemble(catcher, *parent, path);
+   fs::remove_all(directory);
+
+   if (!loaded)
+   {
+      catcher.display();
+      return 1;
+   }
+
+   std::vector<std::int32_t> words (tableWords);
+   for (std::uint32_t index = 0; index < tableWords; ++index)
+      words.at(index) = index;
+   parent->memory.write(table, words.data(), words.size());
+
+   start = std::chrono::steady_clock::now();
+   std::vector<std::unique_ptr<VmContext>> children;
+   for (std::size_t index = 0; index < instances; ++index)
+      children.push_back(parent->fork());
+   std::int64_t forking = us_since(start);
+
+   std::size_t copied = 0;
+   for (auto& child : children)
+   {
+      Executor (*child, Engine::threaded).execute();
+      if (child->reg.at(R_R0) != 499500 || child->memory[0x200000] != 499500)
+      {
+         std::cerr << "Fork computed " << child->reg.at(R_R0) << " instead of 499500\n";
+         return 1;
+      }
+      copied += child->memory.resident() - child->memory.shared();
+   }
+
+   std::size_t resident = parent->memory.resident();
+   std::cout << "Assembled: " << static_cast<double>(assembling) / assembled << "us per instance\n";
+   std::cout << "Forked:    " << static_cast<double>(forking) / instances << "us per instance, ";
+   std::cout << instances << " in " << forking << "us\n";
+   std::cout << "Pages:     " << resident << " loaded, " << static_cast<double>(copied) / instances;
+   std::cout << " copied per instance (" << copied * sizeof(Memory::Page) / instances / 1024 << "KB of ";
+   std::cout << resident * sizeof(Memory::Page) / 1024 << "KB)\n";
+   return 0;
+}
@@ -0,0 +1,71 @@
+#include "assembler.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// Assembles programs made of more and more included files and prints the
+// time per include, which stays flat as long as the translation is linear,
+// both serially and with the included files lexed on every core.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/includes.cpp -o includes -pthread
+
+// Write a program that includes the given number of small files, each of
+// them with a label of its own
+fs::path generate(const fs::path& directory, std::size_t includes)
+{
+   fs::create_directories(directory);
+   std::ofstream main (directory / "main.asx");
+
+   for (std::size_t index = 0; index < includes; ++index)
+   {
+      fs::path path = directory / ("lib"s + std::to_string(index) + ".asx"s);
+      std::ofstream file (path);
+      file << "L" << index << ": ADD R1, R1, 1\n   BRp L" << index << "\n";
+      main << ".INCLUDE \"" << path.string() << "\"\n";
+   }
+
+   main << "START: ADD R0, R0, 1\n   BRz START\n   HALT\n";
+   return directory / "main.asx";
+}
+
+int main()
+{
+   fs::path directory = fs::temp_directory_path() / "vm32bit_includes";
+
+   std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+   for (std::size_t includes : {1250, 2500, 5000, 10000})
+   {
+      fs::path path = generate(directory, includes);
+
+      // Serially and with the included files lexed on every core
+      for (std::size_t threads : {std::size_t(1), cores})
+      {
+         auto vm = std::make_unique<VmContext>();
+         vm->threads = threads;
+         Catcher catcher;
+
+         auto start = std::chrono::steady_clock::now();
+         bool assembled = assemble(catcher, *vm, path);
+         auto elapsed = std::chrono::steady_clock::now() - start;
+
+         if (!assembled)
+         {
+            catcher.display();
+            return 1;
+         }
+
+         auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+         std::cout << includes << " includes on " << threads << " thread" << (threads == 1 ? "" : "s") << ": ";
+         std::cout << us << "us, " << us * 1000 / includes << "ns per include\n";
+
+         if (cores == 1)
+            break;
+      }
+   }
+
+   fs::remove_all(directory);
+   return 0;
+}
@@ -0,0 +1,108 @@
+#include "assembler.hpp"
+#include "executor.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+// Assembles a loop full of redundant instructions with and without the
+// optimizer, then prints how many instructions each version executes and
+// how long the threaded engine takes to run it.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/optimizer.cpp -o optimizer -pthread
+
+// Loop of constants, copies, double negations, dead stores and branches to
+// branches, the way generated or hand unrolled code tends to look
+constexpr std::string_view program = R"(
+      AND R1, R1, 0
+      ADD R1, R1, 15
+      LD R7, COUNT
+LOOP: AND R2, R2, 0
+      ADD R3, R2, 4
+      MUL R4, R3, R3
+      ADD R5, R4, R1
+      NOT R6, R5
+      NOT R6, R6
+      NEG R0, R0
+      NEG R0, R0
+      ADD R0, R0, R6
+      ADD R2, R0, 0
+      AND R3, R3, 0
+      XOR R4, R4, R4
+      OR R8, R0, 0
+      SUB R7, R7, 1
+      BRp NEXT
+      BRnzp DONE
+NEXT: BRnzp LOOP
+DONE: HALT
+COUNT: .WORD 1000000
+)";
+
+struct Measure
+{
+   std::size_t instructions = 0;
+   std::size_t executed = 0;
+   std::int64_t us = 0;
+   std::int32_t result = 0;
+};
+
+// Assemble the program and run it twice, once counting the instructions and
+// once timing them
+bool measure(const fs::path& path, bool optimize, Measure& measure)
+{
+   auto vm = std::make_unique<VmContext>();
+   OptimizerReport report;
+   if (optimize)
+      vm->optimizer = &report;
+
+   Catcher catcher;
+   if (!assemble(catcher, *vm, path))
+   {
+      catcher.display();
+      return false;
+   }
+   if (optimize)
+      report.display();
+   measure.instructions = (optimize ? report.after : report.before);
+
+   vm->clear_registers();
+   vm->reg.at(R_PC) = vm->pcStart;
+   while (vm->memory[vm->reg.at(R_PC)] != 63)
+   {
+      std::uint32_t instr = vm->memory[vm->reg.at(R_PC)];
+      opcode_table[instr & 0b111111](*vm, instr);
+      ++vm->reg.at(R_PC);
+      ++measure.executed;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   Executor (*vm, Engine::threaded).execute();
+   measure.us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+   measure.result = vm->reg.at(R_R0);
+   return true;
+}
+
+int main()
+{
+   fs::path directory = fs::temp_directory_path() / "vm32bit_optimizer";
+   fs::create_directories(directory);
+   fs::path path = directory / "redundant.asx";
+   std::ofstream (path) << program;
+
+   Measure plain, optimized;
+   bool measured = measure(path, false, plain) && measure(path, true, optimized);
+   fs::remove_all(directory);
+   if (!measured)
+      return 1;
+
+   if (plain.result != optimized.result)
+   {
+      std::cout << "The optimized program computed " << optimized.result << " instead of " << plain.result << "\n";
+      return 1;
+   }
+
+   std::cout << "Without the optimizer: " << plain.executed << " instructions executed in " << plain.us << "us\n";
+   std::cout << "With the optimizer:    " << optimized.executed << " instructions executed in " << optimized.us << "us\n";
+   std::cout << "Saved " << 100 - optimized.executed * 100 / std::max<std::size_t>(plain.executed, 1) << "% of the executed instructions\n";
+   return 0;
+}
@@ -0,0 +1,94 @@
+#include "assembler.hpp"
+#include "pipeline.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Assembles a generated program of about 100 MB with the buffered and with
+// the streaming pipeline and prints the time and the peak resident memory
+// of both. Every pipeline runs in a process of its own, so the peaks don't
+// mix.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/streaming.cpp -o streaming -pthread
+
+// Write a program of blocks that each start over at the same address, full
+// of labels used both before and after they are defined
+fs::path generate(const fs::path& directory, std::size_t bytes)
+{
+   fs::create_directories(directory);
+   fs::path path = directory / "large.asx";
+   std::ofstream file (path);
+
+   for (std::size_t block = 0; static_cast<std::size_t>(file.tellp()) < bytes; ++block)
+   {
+      file << ".ORG 0x3000\n";
+
+      for (std::size_t line = 0; line < 20000; ++line)
+      {
+         std::string label = "B"s + std::to_string(block) + "_"s;
+
+         if (line % 16 == 0)
+            file << label << line / 16 << ": ADD R1, R1, 1\n";
+         else if (line % 16 == 5)
+            file << "   BRp " << label << (line / 16 + 1) % 1250 << "\n";
+         else if (line % 16 == 9)
+            file << "   LD R2, " << label << line / 16 << "\n";
+         else
+            file << "   ADD R" << line % 12 << ", R" << (line + 3) % 12 << ", " << line % 97 << "\n";
+      }
+   }
+   return path;
+}
+
+// Assemble the file and print how long it took and the most memory the
+// process ever held
+int measure(const fs::path& path, bool streaming)
+{
+   auto vm = std::make_unique<VmContext>();
+   Catcher catcher;
+
+   auto start = std::chrono::steady_clock::now();
+   bool assembled = (streaming ? assemble_streaming(catcher, *vm, path) : assemble(catcher, *vm, path));
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   if (!assembled)
+   {
+      catcher.display();
+      return 1;
+   }
+
+   rusage usage {};
+   getrusage(RUSAGE_SELF, &usage);
+
+   std::cout << (streaming ? "streaming: " : "buffered:  ");
+   std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms, ";
+   std::cout << usage.ru_maxrss / 1024 << " MB peak RSS" << std::endl;
+   return 0;
+}
+
+int main()
+{
+   fs::path directory = fs::temp_directory_path() / "vm32bit_streaming";
+   fs::path path = generate(directory, 100'000'000);
+   std::cout << "Source: " << fs::file_size(path) / 1'000'000 << " MB\n" << std::flush;
+
+   int status = 0;
+   for (bool streaming : {false, true})
+   {
+      pid_t child = fork();
+
+      if (child == 0)
+         _exit(measure(path, streaming));
+
+      int result = 1;
+      waitpid(child, &result, 0);
+      status |= result;
+   }
+
+   fs::remove_all(directory);
+   return status;
+}
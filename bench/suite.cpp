@@ -0,0 +1,543 @@
+#include "assembler.hpp"
+#include "executor.hpp"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+
+// Benchmarks every opcode handler, the lexer, translator and parser on
+// generated programs of growing size and a few guest kernels on every
+// engine. Results are printed as CSV, one measurement per line, the best of
+// a few runs each:
+//
+//    group,name,case,value,unit
+//
+// Given the CSV of an earlier run, every line also gets the value it had
+// then and the change since, so two commits can be compared directly:
+//
+//    ./suite > before.csv
+//    ./suite before.csv
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/suite.cpp -o suite -pthread
+
+using Clock = std::chrono::steady_clock;
+
+// Keep the compiler from dropping or merging the work done on the machine
+inline void clobber(VmContext& vm)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   asm volatile ("" : : "r"(&vm) : "memory");
+#else
+   static VmContext* volatile sink;
+   sink = &vm;
+#endif
+}
+
+// Best time of the runs, in nanoseconds
+double best_of(std::size_t runs, const std::function<void()>& run)
+{
+   double best = 0;
+
+   for (std::size_t index = 0; index < runs; ++index)
+   {
+      auto start = Clock::now();
+      run();
+      double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+      if (index == 0 || ns < best)
+         best = ns;
+   }
+   return best;
+}
+
+// Prints the measurements, next to the ones of an earlier run when there is
+// one
+class Report
+{
+public:
+   // Constructors
+   explicit Report(const fs::path& baseline)
+   {
+      std::ifstream file (baseline);
+
+      for (std::string line; std::getline(file, line);)
+      {
+         // Key is everything up to the value, the value is the field after
+         std::size_t third = line.find(',', line.find(',', line.find(',') + 1) + 1);
+         if (third == line.npos)
+            continue;
+
+         std::size_t fourth = line.find(',', third + 1);
+         try
+         {
+            previous[line.substr(0, third)] = std::stod(line.substr(third + 1, fourth - third - 1));
+         }
+         catch (const std::exception&)
+         {
+         }
+      }
+
+      std::cout << "group,name,case,value,unit" << (previous.empty() ? "" : ",baseline,change") << "\n";
+   }
+
+   void add(const std::string& group, const std::string& name, const std::string& test, double value, const std::string& unit)
+   {
+      std::string key = group + ","s + name + ","s + test;
+      std::cout << key << "," << value << "," << unit;
+
+      if (!previous.empty())
+      {
+         auto found = previous.find(key);
+         if (found == previous.end())
+            std::cout << ",,";
+         else
+            std::cout << "," << found->second << "," << (value - found->second) * 100 / found->second << "%";
+      }
+      std::cout << std::endl;
+   }
+
+private:
+   std::map<std::string, double> previous;
+};
+
+// Assemble the text into the machine without going through a file
+bool assemble_text(Catcher& catcher, VmContext& vm, std::string_view text)
+{
+   Lexer lexer (catcher, "bench.asx", text);
+   TokenStream stream {nullptr, text, std::move(lexer.tokenize()), std::move(lexer.get_names())};
+
+   if (catcher.any_errors())
+      return false;
+
+   auto tokens = Translator(catcher, vm, stream).translate();
+   if (catcher.any_errors())
+      return false;
+
+   Parser(catcher, vm, tokens).parse();
+   return !catcher.any_errors();
+}
+
+// Handler called over and over on the same instruction. Registers hold small
+// numbers and addresses close by, so loads, stores and jumps stay in place.
+template <auto Handler>
+double opcode_ns(std::string_view line, std::size_t iterations)
+{
+   auto vm = std::make_unique<VmContext>();
+   Catcher catcher;
+
+   if (!assemble_text(catcher, *vm, line))
+   {
+      catcher.display();
+      std::exit(1);
+   }
+   std::uint32_t instr = vm->memory[defaultPcStart];
+
+   double ns = best_of(3, [&]
+   {
+      vm->reg.fill(0);
+      vm->reg.at(R_R1) = 7;
+      vm->reg.at(R_R2) = 3;
+      vm->reg.at(R_R3) = 0x4000;
+      vm->reg.at(R_R15) = defaultPcStart;
+
+      for (std::size_t index = 0; index < iterations; ++index)
+      {
+         vm->reg.at(R_PC) = defaultPcStart;
+         Handler(*vm, instr);
+         clobber(*vm);
+      }
+   });
+   return ns / iterations;
+}
+
+void bench_opcodes(Report& report)
+{
+   constexpr std::size_t iterations = 10'000'000;
+
+   report.add("opcode", "ADD", "reg", opcode_ns<opcode_add>("ADD R1, R1, R2", iterations), "ns");
+   report.add("opcode", "ADD", "imm", opcode_ns<opcode_add>("ADD R1, R1, 5", iterations), "ns");
+   report.add("opcode", "SUB", "reg", opcode_ns<opcode_sub>("SUB R1, R1, R2", iterations), "ns");
+   report.add("opcode", "SUB", "imm", opcode_ns<opcode_sub>("SUB R1, R1, 5", iterations), "ns");
+   report.add("opcode", "MUL", "reg", opcode_ns<opcode_mul>("MUL R4, R1, R2", iterations), "ns");
+   report.add("opcode", "MUL", "imm", opcode_ns<opcode_mul>("MUL R4, R1, 5", iterations), "ns");
+   report.add("opcode", "DIV", "reg", opcode_ns<opcode_div>("DIV R4, R1, R2", iterations), "ns");
+   report.add("opcode", "DIV", "imm", opcode_ns<opcode_div>("DIV R4, R1, 5", iterations), "ns");
+   report.add("opcode", "REM", "reg", opcode_ns<opcode_rem>("REM R4, R1, R2", iterations), "ns");
+   report.add("opcode", "REM", "imm", opcode_ns<opcode_rem>("REM R4, R1, 5", iterations), "ns");
+   report.add("opcode", "AND", "reg", opcode_ns<opcode_and>("AND R4, R1, R2", iterations), "ns");
+   report.add("opcode", "AND", "imm", opcode_ns<opcode_and>("AND R4, R1, 5", iterations), "ns");
+   report.add("opcode", "OR",  "reg", opcode_ns<opcode_or>("OR R4, R1, R2", iterations), "ns");
+   report.add("opcode", "OR",  "imm", opcode_ns<opcode_or>("OR R4, R1, 5", iterations), "ns");
+   report.add("opcode", "XOR", "reg", opcode_ns<opcode_xor>("XOR R4, R1, R2", iterations), "ns");
+   report.add("opcode", "XOR", "imm", opcode_ns<opcode_xor>("XOR R4, R1, 5", iterations), "ns");
+   report.add("opcode", "NOT", "reg", opcode_ns<opcode_not>("NOT R4, R1", iterations), "ns");
+   report.add("opcode", "NEG", "reg", opcode_ns<opcode_neg>("NEG R4, R1", iterations), "ns");
+   report.add("opcode", "BR",  "taken", opcode_ns<opcode_br>("BRnzp 0", iterations), "ns");
+   report.add("opcode", "BR",  "not taken", opcode_ns<opcode_br>("BRn 0", iterations), "ns");
+   report.add("opcode", "JMP", "reg", opcode_ns<opcode_jmp>("JMP R3", iterations), "ns");
+   report.add("opcode", "RET", "reg", opcode_ns<opcode_jmp>("RET", iterations), "ns");
+   report.add("opcode", "JSR", "label", opcode_ns<opcode_jsr>("JSR 0", iterations), "ns");
+   report.add("opcode", "JSRR", "reg", opcode_ns<opcode_jsr>("JSRR R3", iterations), "ns");
+   report.add("opcode", "LD",  "label", opcode_ns<opcode_ld>("LD R4, 5", iterations), "ns");
+   report.add("opcode", "LDI", "label", opcode_ns<opcode_ldi>("LDI R4, 5", iterations), "ns");
+   report.add("opcode", "LDR", "reg", opcode_ns<opcode_ldr>("LDR R4, R3, 2", iterations), "ns");
+   report.add("opcode", "LEA", "label", opcode_ns<opcode_lea>("LEA R4, 5", iterations), "ns");
+   report.add("opcode", "ST",  "label", opcode_ns<opcode_st>("ST R1, 5", iterations), "ns");
+   report.add("opcode", "STI", "label", opcode_ns<opcode_sti>("STI R1, 5", iterations), "ns");
+   report.add("opcode", "STR", "reg", opcode_ns<opcode_str>("STR R1, R3, 2", iterations), "ns");
+}
+
+// Program of labels, branches, loads and arithmetic, every block of it
+// starting over at the same address
+std::string generate(std::size_t bytes)
+{
+   std::string text;
+
+   for (std::size_t line = 0; text.size() < bytes; ++line)
+   {
+      std::string label = "L"s + std::to_string(line / 16);
+
+      if (line % 16 == 0)
+         text += ".ORG 0x3000\n"s;
+      else if (line % 16 == 1)
+         text += label + ": ADD R1, R1, 1\n"s;
+      else if (line % 16 == 5)
+         text += "   BRp "s + label + "\n"s;
+      else if (line % 16 == 9)
+         text += "   LD R2, "s + label + "\n"s;
+      else
+         text += "   ADD R"s + std::to_string(line % 12) + ", R"s + std::to_string((line + 3) % 12) + ", "s + std::to_string(line % 97) + "\n"s;
+   }
+   return text;
+}
+
+void bench_assembler(Report& report)
+{
+   for (std::size_t bytes : {std::size_t(64) << 10, std::size_t(1) << 20, std::size_t(16) << 20})
+   {
+      std::string text = generate(bytes);
+      std::string size = (bytes < (1 << 20) ? std::to_string(bytes >> 10) + "KB"s : std::to_string(bytes >> 20) + "MB"s);
+      std::size_t count = 0;
+      Catcher catcher;
+
+      double lex = best_of(3, [&]
+      {
+         Lexer lexer (catcher, "generated.asx", text);
+         count = lexer.tokenize().size();
+      });
+
+      Lexer lexer (catcher, "generated.asx", text);
+      TokenStream stream {nullptr, text, std::move(lexer.tokenize()), std::move(lexer.get_names())};
+      std::vector<Token> tokens;
+
+      double translate = best_of(3, [&]
+      {
+         auto vm = std::make_unique<VmContext>();
+         tokens = Translator(catcher, *vm, stream).translate();
+      });
+
+      double parse = best_of(3, [&]
+      {
+         auto vm = std::make_unique<VmContext>();
+         Parser(catcher, *vm, tokens).parse();
+      });
+
+      if (catcher.display())
+         std::exit(1);
+
+      report.add("lexer", "tokenize", size, text.size() * 1000.0 / lex, "MB/s");
+      report.add("lexer", "tokenize", size, count * 1000.0 / lex, "Mtokens/s");
+      report.add("translator", "translate", size, count * 1000.0 / translate, "Mtokens/s");
+      report.add("parser", "parse", size, tokens.size() * 1000.0 / parse, "Mtokens/s");
+   }
+}
+
+// Guest programs, each leaving a result in R0 to check every engine against
+struct Kernel
+{
+   const char* name;
+   std::string_view text;
+   std::int32_t result;
+};
+
+// Primes below 30000
+constexpr std::string_view sieve = R"(
+       LD R1, SIEVE
+       LD R2, LIMIT
+       AND R8, R8, 0
+       ADD R8, R8, 1
+       AND R3, R3, 0
+CLEAR: ADD R4, R1, R3
+       AND R5, R5, 0
+       STR R5, R4, 0
+       ADD R3, R3, 1
+       SUB R6, R3, R2
+       BRn CLEAR
+       AND R3, R3, 2
+       ADD R3, R3, 2
+       AND R0, R0, 0
+NEXT:  SUB R6, R3, R2
+       BRzp DONE
+       ADD R4, R1, R3
+       LDR R5, R4, 0
+       BRp SKIP
+       ADD R0, R0, 1
+       MUL R6, R3, R3
+MARK:  SUB R7, R6, R2
+       BRzp SKIP
+       ADD R4, R1, R6
+       STR R8, R4, 0
+       ADD R6, R6, R3
+       BRnzp MARK
+SKIP:  ADD R3, R3, 1
+       BRnzp NEXT
+DONE:  HALT
+SIEVE: .WORD 0x5000
+LIMIT: .WORD 30000
+)";
+
+// Insertion sort of 1000 pseudo random numbers, R0 counts the pairs left
+// out of order
+constexpr std::string_view sort = R"(
+       LD R1, ARRAY
+       LD R2, COUNT
+       AND R3, R3, 0
+       AND R4, R4, 0
+       ADD R4, R4, 1
+FILL:  MUL R4, R4, 75
+       ADD R4, R4, 74
+       REM R4, R4, 65521
+       ADD R5, R1, R3
+       STR R4, R5, 0
+       ADD R3, R3, 1
+       SUB R6, R3, R2
+       BRn FILL
+       AND R3, R3, 0
+       ADD R3, R3, 1
+OUTER: SUB R6, R3, R2
+       BRzp CHECK
+       ADD R5, R1, R3
+       LDR R7, R5, 0
+       ADD R8, R3, -1
+INNER: BRn PLACE
+       ADD R9, R1, R8
+       LDR R10, R9, 0
+       SUB R11, R10, R7
+       BRnz PLACE
+       STR R10, R9, 1
+       ADD R8, R8, -1
+       BRnzp INNER
+PLACE: ADD R9, R1, R8
+       STR R7, R9, 1
+       ADD R3, R3, 1
+       BRnzp OUTER
+CHECK: AND R0, R0, 0
+       AND R3, R3, 0
+       ADD R3, R3, 1
+LOOP:  SUB R6, R3, R2
+       BRzp DONE
+       ADD R5, R1, R3
+       LDR R7, R5, 0
+       ADD R5, R5, -1
+       LDR R10, R5, 0
+       SUB R11, R7, R10
+       BRzp ORDER
+       ADD R0, R0, 1
+ORDER: ADD R3, R3, 1
+       BRnzp LOOP
+DONE:  HALT
+ARRAY: .WORD 0x5000
+COUNT: .WORD 1000
+)";
+
+// Product of two 48x48 matrices, R0 sums the result
+constexpr std::string_view matrix = R"(
+       LD R1, MATA
+       LD R2, MATB
+       LD R3, MATC
+       AND R4, R4, 0
+FILL:  DIV R5, R4, 48
+       REM R6, R4, 48
+       ADD R7, R5, R6
+       ADD R8, R1, R4
+       STR R7, R8, 0
+       SUB R7, R5, R6
+       ADD R8, R2, R4
+       STR R7, R8, 0
+       ADD R4, R4, 1
+       SUB R9, R4, 2304
+       BRn FILL
+       AND R0, R0, 0
+       AND R4, R4, 0
+ILOOP: AND R5, R5, 0
+JLOOP: AND R6, R6, 0
+       AND R7, R7, 0
+       MUL R8, R4, 48
+       ADD R8, R8, R1
+       ADD R9, R2, R5
+KLOOP: LDR R10, R8, 0
+       LDR R11, R9, 0
+       MUL R10, R10, R11
+       ADD R6, R6, R10
+       ADD R8, R8, 1
+       ADD R9, R9, 48
+       ADD R7, R7, 1
+       SUB R12, R7, 48
+       BRn KLOOP
+       MUL R12, R4, 48
+       ADD R12, R12, R5
+       ADD R12, R12, R3
+       STR R6, R12, 0
+       ADD R0, R0, R6
+       ADD R5, R5, 1
+       SUB R12, R5, 48
+       BRn JLOOP
+       ADD R4, R4, 1
+       SUB R12, R4, 48
+       BRn ILOOP
+       HALT
+MATA:  .WORD 0x5000
+MATB:  .WORD 0x6000
+MATC:  .WORD 0x7000
+)";
+
+// Recursive fib(24) through JSR and RET, with the return address and the
+// argument saved on a stack in R14
+constexpr std::string_view fib = R"(
+         LD R14, STACK
+         LD R0, N
+         JSR FIB
+         ADD R0, R1, 0
+         HALT
+FIB:     ADD R2, R0, -2
+         BRzp RECURSE
+         ADD R1, R0, 0
+         RET
+RECURSE: ADD R14, R14, -3
+         STR R15, R14, 0
+         STR R0, R14, 1
+         ADD R0, R0, -1
+         JSR FIB
+         STR R1, R14, 2
+         LDR R0, R14, 1
+         ADD R0, R0, -2
+         JSR FIB
+         LDR R2, R14, 2
+         ADD R1, R1, R2
+         LDR R0, R14, 1
+         LDR R15, R14, 0
+         ADD R14, R14, 3
+         RET
+STACK:   .WORD 0xF000
+N:       .WORD 24
+)";
+
+// Hash of the numbers up to 300000, nothing but arithmetic and logic between
+// the branches
+constexpr std::string_view hash = R"(
+       LD R1, COUNT
+       AND R0, R0, 0
+       AND R2, R2, 0
+LOOP:  XOR R0, R0, R2
+       MUL R0, R0, 31
+       ADD R0, R0, 7
+       AND R0, R0, 65535
+       NOT R3, R0
+       NEG R3, R3
+       OR R4, R3, R2
+       AND R4, R4, 255
+       SUB R0, R0, R4
+       ADD R2, R2, 1
+       SUB R5, R2, R1
+       BRn LOOP
+       HALT
+COUNT: .WORD 300000
+)";
+
+// Sum of the product of the matrices the matrix kernel fills in
+std::int32_t matrix_result()
+{
+   std::int32_t sum = 0;
+
+   for (std::int32_t i = 0; i < 48; ++i)
+      for (std::int32_t j = 0; j < 48; ++j)
+         for (std::int32_t k = 0; k < 48; ++k)
+            sum += (i + k) * (k - j);
+   return sum;
+}
+
+// Hash the hash kernel computes
+std::int32_t hash_result()
+{
+   std::int32_t h = 0;
+
+   for (std::int32_t i = 0; i < 300000; ++i)
+   {
+      h = (((h ^ i) * 31 + 7) & 65535);
+      h -= ((h + 1) | i) & 255;
+   }
+   return h;
+}
+
+void bench_kernels(Report& report)
+{
+   const Kernel kernels[] {
+      {"sieve", sieve, 3245},
+      {"sort", sort, 0},
+      {"matrix", matrix, matrix_result()},
+      {"fib", fib, 46368},
+      {"hash", hash, hash_result()},
+   };
+
+   const std::pair<Engine, const char*> engines[] {
+      {Engine::legacy, "legacy"}, {Engine::threaded, "threaded"}, {Engine::predecoded, "predecoded"},
+      {Engine::fused, "fused"}, {Engine::jit, "jit"}, {Engine::tiered, "tiered"},
+   };
+
+   for (const auto& kernel : kernels)
+   {
+      auto vm = std::make_unique<VmContext>();
+      Catcher catcher;
+
+      if (!assemble_text(catcher, *vm, kernel.text))
+      {
+         catcher.display();
+         std::exit(1);
+      }
+
+      // Count the instructions once with the profiler
+      Profile profile;
+      vm->profiler = &profile;
+      Executor(*vm).execute();
+      vm->profiler = nullptr;
+
+      std::uint64_t instructions = 0;
+      for (const auto& opcode : profile.opcodes)
+         instructions += opcode.count;
+
+      for (const auto& [engine, name] : engines)
+      {
+         double ns = best_of(3, [&] { Executor(*vm, engine).execute(); });
+
+         if (vm->reg.at(R_R0) != kernel.result)
+         {
+            std::cerr << "Kernel " << kernel.name << " computed " << vm->reg.at(R_R0) << " on the " << name;
+            std::cerr << " engine instead of " << kernel.result << "\n";
+            std::exit(1);
+         }
+         report.add("kernel"s, kernel.name, name, instructions * 1000.0 / ns, "MIPS");
+      }
+   }
+}
+
+int main(int argc, char** argv)
+{
+   Report report (argc > 1 ? argv[1] : "");
+
+   bench_opcodes(report);
+   bench_assembler(report);
+   bench_kernels(report);
+   return 0;
+}
@@ -0,0 +1,82 @@
+#include "assembler.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+// Lexes a generated program of about 20 MB and prints the tokens per second
+// and the bytes every token takes, counting the names interned along with
+// them, then assembles the same program from disk for the time of the whole
+// buffered pipeline.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/tokens.cpp -o tokens -pthread
+
+// Program of labels, branches, loads and arithmetic, every block of it
+// starting over at the same address
+std::string generate(std::size_t bytes)
+{
+   std::string text;
+
+   for (std::size_t line = 0; text.size() < bytes; ++line)
+   {
+      std::string label = "L"s + std::to_string(line / 16);
+
+      if (line % 16 == 0)
+         text += ".ORG 0x3000\n"s;
+      else if (line % 16 == 1)
+         text += label + ": ADD R1, R1, 1\n"s;
+      else if (line % 16 == 5)
+         text += "   BRp "s + label + "\n"s;
+      else if (line % 16 == 9)
+         text += "   LD R2, "s + label + "\n"s;
+      else
+         text += "   ADD R"s + std::to_string(line % 12) + ", R"s + std::to_string((line + 3) % 12) + ", "s + std::to_string(line % 97) + "\n"s;
+   }
+   return text;
+}
+
+int main()
+{
+   std::string text = generate(20'000'000);
+   std::cout << "Source: " << text.size() / 1'000'000 << " MB\n";
+
+   Catcher catcher;
+   Lexer lexer (catcher, "generated.asx", text);
+
+   auto start = std::chrono::steady_clock::now();
+   const auto& tokens = lexer.tokenize();
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   if (catcher.display())
+      return 1;
+
+   auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+   std::size_t bytes = tokens.size() * sizeof(Token) + lexer.get_names().bytes();
+
+   std::cout << "Lexed " << tokens.size() << " tokens in " << us << "us, ";
+   std::cout << tokens.size() * 1'000'000 / std::max<std::int64_t>(us, 1) << " tokens/s\n";
+   std::cout << sizeof(Token) << " bytes per token, " << static_cast<double>(bytes) / tokens.size();
+   std::cout << " with the " << lexer.get_names().size() << " interned names\n";
+
+   // Lex, translate and parse the same program from a file
+   fs::path directory = fs::temp_directory_path() / "vm32bit_tokens";
+   fs::create_directories(directory);
+   fs::path path = directory / "generated.asx";
+   std::ofstream (path) << text;
+
+   auto vm = std::make_unique<VmContext>();
+   start = std::chrono::steady_clock::now();
+   bool assembled = assemble(catcher, *vm, path);
+   elapsed = std::chrono::steady_clock::now() - start;
+
+   fs::remove_all(directory);
+   if (!assembled)
+   {
+      catcher.display();
+      return 1;
+   }
+
+   us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+   std::cout << "Assembled in " << us << "us, " << tokens.size() * 1'000'000 / std::max<std::int64_t>(us, 1) << " tokens/s\n";
+   return 0;
+}
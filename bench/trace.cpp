@@ -0,0 +1,66 @@
+#include "assembler.hpp"
+#include "executor.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+// Runs a tight arithmetic loop on the threaded engine with and without the
+// trace ring and prints the best time of a few runs of each, along with the
+// cost of the trace for every instruction.
+//
+// Build from the root of the repository:
+//    g++ -std=c++20 -O2 -Iinclude bench/trace.cpp -o trace -pthread
+
+constexpr std::string_view program = R"(
+      LD R7, COUNT
+LOOP: ADD R1, R1, 3
+      MUL R2, R1, 5
+      XOR R3, R2, R1
+      SUB R7, R7, 1
+      BRp LOOP
+      HALT
+COUNT: .WORD 20000000
+)";
+
+constexpr std::size_t instructions = 5 * 20'000'000 + 2;
+
+int main()
+{
+   fs::path directory = fs::temp_directory_path() / "vm32bit_trace";
+   fs::create_directories(directory);
+   fs::path path = directory / "loop.asx";
+   std::ofstream (path) << program;
+
+   auto vm = std::make_unique<VmContext>();
+   Catcher catcher;
+   bool assembled = assemble(catcher, *vm, path);
+   fs::remove_all(directory);
+
+   if (!assembled)
+   {
+      catcher.display();
+      return 1;
+   }
+
+   TraceBuffer trace;
+   std::int64_t best[2] {};
+
+   for (std::size_t run = 0; run < 10; ++run)
+   {
+      bool traced = (run % 2 == 1);
+      vm->trace = (traced ? &trace : nullptr);
+      trace.clear();
+
+      auto start = std::chrono::steady_clock::now();
+      Executor (*vm, Engine::threaded).execute();
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+      if (best[traced] == 0 || us < best[traced])
+         best[traced] = us;
+   }
+
+   std::cout << "Untraced: " << best[0] << "us\n";
+   std::cout << "Traced:   " << best[1] << "us, " << trace.recorded() << " instructions recorded\n";
+   std::cout << "Cost: " << static_cast<double>(best[1] - best[0]) * 1000 / instructions << "ns per instruction\n";
+   return 0;
+}
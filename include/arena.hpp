@@ -0,0 +1,113 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Bump allocator for many small strings that all die together. Memory is
+// taken in large blocks and only given back, all at once, when the arena is
+// destroyed.
+class Arena
+{
+public:
+   // Constructors
+   Arena() = default;
+   ~Arena() = default;
+
+   Arena(Arena&&) = default;
+   Arena& operator=(Arena&&) = default;
+
+   // Copy the text into the arena, the view stays valid as long as the
+   // arena does, even after it gets moved
+   std::string_view store(std::string_view text)
+   {
+      if (text.size() > remaining)
+      {
+         std::size_t size = std::max(blockSize, text.size());
+         blocks.push_back(std::make_unique<char[]>(size));
+         position = blocks.back().get();
+         remaining = size;
+      }
+
+      if (!text.empty())
+         std::memcpy(position, text.data(), text.size());
+      std::string_view stored (position, text.size());
+
+      position += text.size();
+      remaining -= text.size();
+      used += text.size();
+      return stored;
+   }
+
+   // Bytes of the stored strings
+   std::size_t size() const
+   {
+      return used;
+   }
+
+private:
+   static constexpr std::size_t blockSize = 64 * 1024;
+
+   std::vector<std::unique_ptr<char[]>> blocks;
+   char* position = nullptr;
+   std::size_t remaining = 0;
+   std::size_t used = 0;
+};
+
+// Names of a single file, every one of them stored once in an arena and
+// known by its id, in the order they first appeared
+class Interner
+{
+public:
+   // Constructors
+   Interner() = default;
+   ~Interner() = default;
+
+   Interner(Interner&&) = default;
+   Interner& operator=(Interner&&) = default;
+
+   // Id of the name, added when it's new
+   std::uint32_t intern(std::string_view name)
+   {
+      auto found = index.find(name);
+      if (found != index.end())
+         return found->second;
+
+      std::string_view stored = arena.store(name);
+      std::uint32_t id = static_cast<std::uint32_t>(names.size());
+
+      index.emplace(stored, id);
+      names.push_back(stored);
+      return id;
+   }
+
+   std::string_view name(std::uint32_t id) const
+   {
+      return names.at(id);
+   }
+
+   // Number of names
+   std::size_t size() const
+   {
+      return names.size();
+   }
+
+   // Bytes taken by the names and the tables, roughly
+   std::size_t bytes() const
+   {
+      return arena.size() + names.capacity() * sizeof(std::string_view) +
+             index.size() * (sizeof(std::string_view) + sizeof(std::uint32_t) + 2 * sizeof(void*));
+   }
+
+private:
+   Arena arena;
+   std::vector<std::string_view> names;
+   std::unordered_map<std::string_view, std::uint32_t> index;
+};
+
+#endif // ARENA_HPP
@@ -0,0 +1,44 @@
+#ifndef ASSEMBLER_HPP
+#define ASSEMBLER_HPP
+
+#include "context.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "translator.hpp"
+
+// Tokenize, translate and parse the file into the memory of the virtual
+// machine. Stops at the first stage that fails and leaves its errors in the
+// catcher.
+inline bool assemble(Catcher& catcher, VmContext& vm, const fs::path& path)
+{
+   catcher.specify(path.string());
+
+   // Tokenize the file contents
+   auto stream = tokenize_file(catcher, vm, path);
+
+   if (!stream)
+      return false;
+
+   // Lex the included files ahead of time on all of the threads
+   tokenize_includes(vm, *stream);
+
+   // Replace labels with memory addresses and handle includes
+   Translator translator (catcher, vm, *stream);
+   auto tokens = translator.translate();
+
+   if (catcher.any_errors())
+      return false;
+   catcher.specify(""s);
+
+   // Simplify the instructions while all of them are still tokens
+   if (vm.optimizer)
+      tokens = Optimizer(vm, tokens, *vm.optimizer).optimize();
+
+   // Parse tokens into instructions and place them in memory
+   Parser parser (catcher, vm, tokens);
+   parser.parse();
+
+   return !catcher.any_errors();
+}
+
+#endif // ASSEMBLER_HPP
@@ -0,0 +1,187 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "assembler.hpp"
+#include "executor.hpp"
+#include "thread_pool.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Most threads a batch can be spread over
+inline constexpr std::size_t maxThreads = 1024;
+
+// Outcome of a single program of a batch
+struct JobResult
+{
+   std::string file;
+   Registers registers {};           // Registers the program halted with
+   GuestFault fault;                 // Access that stopped the program, if any
+   std::vector<std::string> errors;  // Errors of the assembler, if any
+};
+
+// Outcome of a whole batch, in the order of the manifest
+struct BatchReport
+{
+   std::vector<JobResult> jobs;
+   std::size_t threads = 0;
+   std::chrono::nanoseconds elapsed {};
+
+   // Display the first registers or the errors of every job along with the
+   // fault that stopped it, followed by the throughput of the batch. Jobs
+   // that faulted count as failed.
+   void display() const
+   {
+      using std::chrono::duration, std::chrono::duration_cast, std::chrono::microseconds;
+      std::size_t failed = 0;
+
+      for (const auto& job : jobs)
+      {
+         std::cout << job.file << ":";
+
+         if (!job.errors.empty())
+         {
+            ++failed;
+            std::cout << " " << job.errors.size() << " error" << (job.errors.size() == 1 ? "" : "s") << "\n";
+
+            for (const auto& error : job.errors)
+               std::cout << "   " << error << "\n";
+            continue;
+         }
+
+         for (std::uint8_t r = R_R0; r <= R_R4; ++r)
+            std::cout << " " << job.registers.at(r);
+         std::cout << "\n";
+
+         if (job.fault)
+         {
+            ++failed;
+            std::cout << "   ";
+            job.fault.display();
+         }
+      }
+
+      double seconds = duration<double>(elapsed).count();
+      std::cout << jobs.size() << " job" << (jobs.size() == 1 ? "" : "s") << ", " << failed << " failed, on ";
+      std::cout << threads << " thread" << (threads == 1 ? "" : "s") << " in ";
+      std::cout << duration_cast<microseconds>(elapsed).count() << "us (";
+      std::cout << static_cast<std::size_t>(seconds > 0 ? jobs.size() / seconds : 0) << " jobs/s).\n";
+   }
+};
+
+// Read the programs listed in the manifest, one path per line. Empty lines
+// and lines starting with ';' are skipped.
+inline std::vector<std::string> read_manifest(Catcher& catcher, const fs::path& path)
+{
+   std::vector<std::string> files;
+   std::ifstream file (path);
+
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to open manifest '"s + path.string() + "'."s);
+      return files;
+   }
+
+   std::string line;
+   while (std::getline(file, line))
+   {
+      std::size_t first = line.find_first_not_of(" \t\r");
+      std::size_t last = line.find_last_not_of(" \t\r");
+
+      if (first == line.npos || line.at(first) == ';')
+         continue;
+      files.push_back(line.substr(first, last - first + 1));
+   }
+   return files;
+}
+
+// Assemble every program of the batch once and execute each of its jobs on
+// a virtual machine of its own, forked off the assembled one, spread over the
+// threads of a work-stealing pool. The programs share the token cache, if
+// there is one.
+inline BatchReport run_batch(const std::vector<std::string>& files, Engine engine,
+                             std::uint32_t threshold, std::size_t threads, TokenCache* cache = nullptr)
+{
+   BatchReport report;
+   report.jobs.resize(files.size());
+
+   // Jobs of every program, in the order the programs first appear
+   std::vector<std::vector<std::size_t>> programs;
+   std::unordered_map<std::string, std::size_t> program_of;
+
+   for (std::size_t index = 0; index < files.size(); ++index)
+   {
+      auto [it, inserted] = program_of.try_emplace(files.at(index), programs.size());
+      if (inserted)
+         programs.emplace_back();
+      programs.at(it->second).push_back(index);
+      report.jobs.at(index).file = files.at(index);
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   {
+      ThreadPool pool (threads);
+      report.threads = pool.size();
+
+      for (const auto& jobs : programs)
+      {
+         pool.submit([&]
+         {
+            auto vm = std::make_unique<VmContext>();
+            vm->cache = cache;
+            Catcher catcher;
+
+            // A malformed program must not take the rest of the batch down
+            bool assembled = false;
+            try
+            {
+               assembled = assemble(catcher, *vm, report.jobs.at(jobs.front()).file);
+            }
+            catch (const std::exception& exception)
+            {
+               catcher.insert("Job failed: "s + exception.what());
+            }
+
+            if (!assembled)
+            {
+               for (std::size_t index : jobs)
+                  report.jobs.at(index).errors = catcher.get_errors();
+               return;
+            }
+
+            // Forked on this thread only, the children keep the pages they
+            // share alive once the assembled one is gone
+            for (std::size_t index : jobs)
+            {
+               pool.submit([&, index, child = std::shared_ptr<VmContext>(vm->fork())]
+               {
+                  JobResult& job = report.jobs.at(index);
+                  Catcher catcher;
+
+                  try
+                  {
+                     Executor executor (*child, engine, threshold);
+                     executor.execute();
+                     job.registers = child->reg;
+                     job.fault = child->fault;
+                  }
+                  catch (const std::exception& exception)
+                  {
+                     catcher.insert("Job failed: "s + exception.what());
+                  }
+                  job.errors = catcher.get_errors();
+               });
+            }
+         });
+      }
+      pool.wait();
+   }
+   report.elapsed = std::chrono::steady_clock::now() - start;
+   return report;
+}
+
+#endif // BATCH_HPP
@@ -34,6 +34,11 @@ public:
    {
       return errors.size() > 0;
    }
+
+   const std::vector<std::string>& get_errors() const
+   {
+      return errors;
+   }
    
    // Display all errors if there are any
    bool display()
@@ -0,0 +1,213 @@
+#ifndef CONTEXT_HPP
+#define CONTEXT_HPP
+
+#include "fault.hpp"
+#include "memory.hpp"
+#include "register.hpp"
+#include "token.hpp"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct VmContext;
+struct Decoded;
+class TokenCache;
+struct TokenStream;
+struct ObjectModule;
+struct OptimizerReport;
+struct Profile;
+class TraceBuffer;
+
+// Result the condition codes are derived from before any instruction set
+// them, none of the codes are set for it
+inline constexpr std::int64_t noCondition = std::int64_t(1) << 32;
+
+// Condition codes of the last result that set them
+inline std::int32_t condition_codes(std::int64_t result)
+{
+   return (result < 0 ? static_cast<std::int32_t>(Flag::FL_N) : 0) |
+          (result == 0 ? static_cast<std::int32_t>(Flag::FL_Z) : 0) |
+          (result > 0 && result <= INT32_MAX ? static_cast<std::int32_t>(Flag::FL_P) : 0);
+}
+
+// Results a branch is taken for, from lo up to lo + span, for every
+// combination of its nzp flags. Only np isn't a single range, it leaves out
+// the zero in the middle.
+struct BranchRange
+{
+   std::int64_t lo;
+   std::uint64_t span;
+   std::int64_t excluded;
+};
+
+// Result no instruction leaves behind
+inline constexpr std::int64_t neverResult = noCondition + 1;
+
+inline constexpr std::array<BranchRange, 8> branch_ranges
+{{
+   {neverResult, 0,             neverResult}, // none
+   {INT32_MIN,   INT32_MAX,     neverResult}, // n
+   {0,           0,             neverResult}, // z
+   {INT32_MIN,   0x80000000,    neverResult}, // nz
+   {1,           INT32_MAX - 1, neverResult}, // p
+   {INT32_MIN,   0xffffffff,    0},           // np
+   {0,           INT32_MAX,     neverResult}, // zp
+   {INT32_MIN,   0xffffffff,    neverResult}, // nzp
+}};
+
+// Whether a branch with the nzp flags is taken after the result. Works the
+// condition codes out without branching on the result itself.
+inline bool branch_taken(std::uint8_t nzp, std::int64_t result)
+{
+   const BranchRange& range = branch_ranges[nzp & 0b111];
+   return (static_cast<std::uint64_t>(result - range.lo) <= range.span) & (result != range.excluded);
+}
+
+// Region of the memory the parser placed words into
+struct Segment
+{
+   std::uint16_t start;
+   std::uint32_t size;
+};
+
+// Handler of an already decoded instruction. Gets the address of the
+// instruction and returns the address of the next one to execute.
+using DecodedHandler = std::int32_t(*)(VmContext&, const Decoded&, std::int32_t);
+
+// Instruction with all of its fields extracted ahead of time. Offsets are
+// already sign extended and, because every entry belongs to a single memory
+// address, PC relative offsets are stored as the absolute address they
+// point to.
+struct Decoded
+{
+   DecodedHandler handler;
+   std::int32_t imm;  // Immediate value, absolute address or branch target
+   std::uint8_t dr;   // Destination or source register of stores
+   std::uint8_t sr1;  // First source register, base register or nzp flags
+   std::uint8_t sr2;  // Second source register
+};
+
+// State of a single virtual machine. It owns the registers, the memory and
+// the entry point along with everything the assembler and the engines keep
+// next to them, so separate instances can run on separate threads without
+// sharing anything. Forked instances only share the pages of their memory
+// they haven't written to.
+struct VmContext
+{
+   Registers reg {};
+
+   // Last result that set the condition codes. Only branches read them, so
+   // they're worked out from it when needed and R_COND is only written once
+   // the program stops.
+   std::int64_t cond = noCondition;
+
+   Memory memory {};
+
+   // Start of the program counter
+   std::uint16_t pcStart = defaultPcStart;
+
+   // Store translated files to avoid infinite include loops
+   std::unordered_set<std::string> translated_files;
+
+   // Source texts the tokens of the assembled files point into
+   SourceMap sources;
+
+   // Token streams shared between runs, if any
+   TokenCache* cache = nullptr;
+
+   // Threads the assembler lexes included files on, and the token streams
+   // it lexed ahead of the translation by the file name they are included as
+   std::size_t threads = 1;
+   std::unordered_map<std::string, std::shared_ptr<const TokenStream>> prefetched;
+
+   // Module the assembler records symbols and relocations into when the
+   // program is assembled into an object file, if any
+   ObjectModule* object = nullptr;
+
+   // Report of the optimizations the assembler applies to the program
+   // before parsing it, the program is only optimized when there is one
+   OptimizerReport* optimizer = nullptr;
+
+   // Profile the executor fills in while it runs the program, if any. The
+   // parser records where every instruction came from into it as well.
+   Profile* profiler = nullptr;
+
+   // Ring the executor records the last instructions it ran into, if any
+   TraceBuffer* trace = nullptr;
+
+   // Access outside of the memory that stopped the last execution, if any
+   GuestFault fault;
+
+   // Regions written by the parser, one for the start and every .ORG
+   std::vector<Segment> segments;
+
+   // Decoded instructions, one for every address of the memory once the
+   // memory gets decoded
+   std::vector<Decoded> decoded;
+
+   // Addresses whose decoded entries were rewritten by an optimization that
+   // depends on the instructions around them, like fused instructions
+   std::vector<bool> optimized;
+
+   // Write the value to the address, throws when it's outside of the memory
+   void writeMemory(std::size_t address, std::int32_t value)
+   {
+      memory.at(address) = value;
+   }
+
+   // Read a value from the memory, throws when it's outside of the memory
+   std::int32_t readMemory(std::size_t address) const
+   {
+      return memory.at(address);
+   }
+
+   // Record the fault of the instruction at the program counter. Returns the
+   // address to continue at, past the last one code runs from, which stops
+   // every engine.
+   std::int32_t raise_fault(Fault kind, std::int32_t pc, std::int64_t address)
+   {
+      fault = {kind, static_cast<std::uint16_t>(pc), address};
+      return maxMemory;
+   }
+
+   // Update condition flags from the register. Register numbers come out of
+   // 4 bit fields or are one of the named registers, so they're never out of
+   // range.
+   void update_flags(std::uint8_t r)
+   {
+      cond = reg[r];
+   }
+
+   // Condition codes set by the last instruction that set them
+   std::int32_t condition_codes() const
+   {
+      return ::condition_codes(cond);
+   }
+
+   // Virtual machine running the same program, sharing the pages of the
+   // memory copy-on-write. It gets the registers, the entry point and the
+   // segments, but none of the assembler state, profiler or trace. This one
+   // must not be running while it's forked.
+   std::unique_ptr<VmContext> fork()
+   {
+      auto child = std::make_unique<VmContext>();
+      child->reg = reg;
+      child->cond = cond;
+      child->memory.share(memory);
+      child->pcStart = pcStart;
+      child->cache = cache;
+      child->segments = segments;
+      return child;
+   }
+
+   // Clear all registers
+   void clear_registers()
+   {
+      reg.fill(0);
+      cond = noCondition;
+   }
+};
+
+#endif // CONTEXT_HPP
@@ -0,0 +1,304 @@
+#ifndef DECODER_HPP
+#define DECODER_HPP
+
+#include "context.hpp"
+#include <cstdint>
+
+inline Decoded decode_instruction(std::uint32_t instr, std::uint16_t address);
+
+// Handlers of the decoded instructions. They have the same semantics as the
+// opcodes in opcodes.hpp, only without extracting the fields. Handlers that
+// set the condition codes can skip it when the next instruction overwrites
+// them anyway.
+inline std::int32_t decoded_halt(VmContext&, const Decoded&, std::int32_t pc)
+{
+   return pc;
+}
+
+inline std::int32_t decoded_nop(VmContext&, const Decoded&, std::int32_t pc)
+{
+   return pc + 1;
+}
+
+// Entry got overwritten by a store. Decode it again and return the same
+// address, so the loop runs the fresh entry on its next iteration.
+inline std::int32_t decoded_stale(VmContext& vm, const Decoded&, std::int32_t pc)
+{
+   vm.decoded[pc] = decode_instruction(vm.memory[pc], pc);
+   return pc;
+}
+
+// Load or store of an address outside of the memory found while decoding. The
+// address is in imm and the kind of the access in sr2.
+inline std::int32_t decoded_fault(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   return vm.raise_fault(static_cast<Fault>(d.sr2), pc, d.imm);
+}
+
+// Mark the whole optimized region around the address as stale, so all of
+// its entries are decoded again in their plain form
+inline void restore_region(VmContext& vm, std::uint16_t address)
+{
+   std::size_t first = address, last = address;
+
+   while (first > 0 && vm.optimized[first - 1]) --first;
+   while (last + 1 < maxMemory && vm.optimized[last + 1]) ++last;
+
+   for (std::size_t index = first; index <= last; ++index)
+   {
+      vm.decoded[index].handler = decoded_stale;
+      vm.optimized[index] = false;
+   }
+}
+
+// Invalidate the decoded instruction at the address after it was written to,
+// only the addresses code runs from are decoded
+inline void invalidate_decoded(VmContext& vm, std::uint32_t address)
+{
+   if (address >= maxMemory)
+      return;
+
+   vm.decoded[address].handler = decoded_stale;
+
+   if (vm.optimized[address])
+      restore_region(vm, address);
+}
+
+#define DECODED_BINARY(name, expr)                                                            \
+   template <bool Flags = true>                                                               \
+   inline std::int32_t decoded_##name##_imm(VmContext& vm, const Decoded& d, std::int32_t pc) \
+   {                                                                                          \
+      std::int32_t a = vm.reg[d.sr1], b = d.imm;                                              \
+      vm.reg[d.dr] = (expr);                                                                  \
+      if constexpr (Flags) vm.update_flags(d.dr);                                             \
+      return pc + 1;                                                                          \
+   }                                                                                          \
+   template <bool Flags = true>                                                               \
+   inline std::int32_t decoded_##name##_reg(VmContext& vm, const Decoded& d, std::int32_t pc) \
+   {                                                                                          \
+      std::int32_t a = vm.reg[d.sr1], b = vm.reg[d.sr2];                                      \
+      vm.reg[d.dr] = (expr);                                                                  \
+      if constexpr (Flags) vm.update_flags(d.dr);                                             \
+      return pc + 1;                                                                          \
+   }
+
+DECODED_BINARY(add, a + b)
+DECODED_BINARY(sub, a - b)
+DECODED_BINARY(mul, a * b)
+DECODED_BINARY(div, (b == 0 ? 0 : a / b))
+DECODED_BINARY(rem, (b == 0 ? 0 : a % b))
+DECODED_BINARY(and, a & b)
+DECODED_BINARY(or,  a | b)
+DECODED_BINARY(xor, a ^ b)
+
+#undef DECODED_BINARY
+
+template <bool Flags = true>
+inline std::int32_t decoded_not(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[d.dr] = ~vm.reg[d.sr1];
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+template <bool Flags = true>
+inline std::int32_t decoded_neg(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[d.dr] = static_cast<std::int32_t>(0u - static_cast<std::uint32_t>(vm.reg[d.sr1]));
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+// Addresses known at decode time were checked by the decoder, only the ones
+// off a base register are checked by the handlers. Pointers loaded out of the
+// memory always point back into it.
+
+// Branch and jump targets are stored the same way the opcodes leave the
+// program counter, so the increment done by the executor is added here
+inline std::int32_t decoded_br(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   return branch_taken(d.sr1, vm.cond) ? d.imm + 1 : pc + 1;
+}
+
+inline std::int32_t decoded_jmp(VmContext& vm, const Decoded& d, std::int32_t)
+{
+   return vm.reg[d.sr1];
+}
+
+inline std::int32_t decoded_ret(VmContext& vm, const Decoded&, std::int32_t)
+{
+   return vm.reg[R_R15] + 1;
+}
+
+inline std::int32_t decoded_jsr(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[R_R15] = pc;
+   return d.imm + 1;
+}
+
+inline std::int32_t decoded_jsrr(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[R_R15] = pc;
+   return vm.reg[d.sr1];
+}
+
+template <bool Flags = true>
+inline std::int32_t decoded_ld(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[d.dr] = vm.memory[d.imm];
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+template <bool Flags = true>
+inline std::int32_t decoded_ldi(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   std::uint32_t pointer = vm.memory[d.imm];
+   vm.reg[d.dr] = vm.memory[pointer];
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+template <bool Flags = true>
+inline std::int32_t decoded_ldr(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   std::int64_t address = base_address(vm.reg[d.sr1], d.imm);
+   if (!in_memory(address))
+      return vm.raise_fault(Fault::load, pc, address);
+
+   vm.reg[d.dr] = vm.memory[address];
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+template <bool Flags = true>
+inline std::int32_t decoded_lea(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.reg[d.dr] = d.imm;
+   if constexpr (Flags) vm.update_flags(d.dr);
+   return pc + 1;
+}
+
+inline std::int32_t decoded_st(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   vm.memory.store(d.imm, vm.reg[d.dr]);
+   invalidate_decoded(vm, d.imm);
+   return pc + 1;
+}
+
+inline std::int32_t decoded_sti(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   std::uint32_t address = vm.memory[d.imm];
+   vm.memory.store(address, vm.reg[d.dr]);
+   invalidate_decoded(vm, address);
+   return pc + 1;
+}
+
+inline std::int32_t decoded_str(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   std::int64_t address = base_address(vm.reg[d.sr1], d.imm);
+   if (!in_memory(address))
+      return vm.raise_fault(Fault::store, pc, address);
+
+   vm.memory.store(address, vm.reg[d.dr]);
+   invalidate_decoded(vm, address);
+   return pc + 1;
+}
+
+// Decode a single instruction located at the address. The bit layouts are
+// documented next to the opcodes in opcodes.hpp.
+inline Decoded decode_instruction(std::uint32_t instr, std::uint16_t address)
+{
+   Decoded d {decoded_nop, 0, 0, 0, 0};
+
+   if (stops(instr))
+   {
+      d.handler = decoded_halt;
+      return d;
+   }
+
+   std::uint8_t opcode = instr & 0b111111;
+   bool imm_flag = (instr >> 6) & 0b1;
+
+   // Arithmetic and logic instructions share the same layout
+   static constexpr DecodedHandler binary[][2] =
+   {
+      {decoded_add_reg<>, decoded_add_imm<>}, {decoded_sub_reg<>, decoded_sub_imm<>},
+      {decoded_mul_reg<>, decoded_mul_imm<>}, {decoded_div_reg<>, decoded_div_imm<>},
+      {decoded_rem_reg<>, decoded_rem_imm<>}, {decoded_and_reg<>, decoded_and_imm<>},
+      {decoded_or_reg<>,  decoded_or_imm<>},  {decoded_xor_reg<>, decoded_xor_imm<>}
+   };
+
+   switch (opcode)
+   {
+      case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
+         d.handler = binary[opcode - 1][imm_flag];
+         d.dr  = (instr >> 7)  & 0b1111;
+         d.sr1 = (instr >> 11) & 0b1111;
+         d.sr2 = (instr >> 15) & 0b1111;
+         d.imm = sext((instr >> 15) & 0b11111111111111111, 17);
+         break;
+      case 9: case 10:
+         d.handler = (opcode == 9 ? decoded_not<> : decoded_neg<>);
+         d.dr  = (instr >> 6)  & 0b1111;
+         d.sr1 = (instr >> 10) & 0b1111;
+         break;
+      case 11:
+         d.handler = decoded_br;
+         d.sr1 = (instr >> 6) & 0b111;
+         d.imm = address + sext((instr >> 9) & 0b11111111111111111111111, 23);
+         break;
+      case 12:
+         d.sr1 = (instr >> 6) & 0b1111;
+         d.handler = (d.sr1 == 15 ? decoded_ret : decoded_jmp);
+         break;
+      case 13:
+         d.handler = (imm_flag ? decoded_jsrr : decoded_jsr);
+         d.sr1 = (instr >> 7) & 0b1111;
+         d.imm = address + sext((instr >> 7) & 0b1111111111111111111111111, 25);
+         break;
+      case 14: case 15: case 17: case 18: case 19:
+      {
+         static constexpr DecodedHandler pc_relative[] =
+         {
+            decoded_ld<>, decoded_ldi<>, nullptr, decoded_lea<>, decoded_st, decoded_sti
+         };
+         d.handler = pc_relative[opcode - 14];
+         d.dr  = (instr >> 6) & 0b1111;
+         d.imm = address + sext((instr >> 10) & 0b1111111111111111111111, 22);
+
+         // LEA only computes the address, the rest fault on running
+         if (opcode != 17 && !in_memory(d.imm))
+         {
+            d.handler = decoded_fault;
+            d.sr2 = static_cast<std::uint8_t>(opcode == 18 ? Fault::store : Fault::load);
+         }
+         break;
+      }
+      case 16:
+         d.handler = decoded_ldr<>;
+         d.dr  = (instr >> 6)  & 0b1111;
+         d.sr1 = (instr >> 10) & 0b1111;
+         d.imm = sext((instr >> 14) & 0b11111111111111, 14);
+         break;
+      case 20:
+         d.handler = decoded_str;
+         d.dr  = (instr >> 6)  & 0b1111;
+         d.sr1 = (instr >> 10) & 0b1111;
+         d.imm = sext((instr >> 14) & 0b111111111111111111, 18);
+         break;
+   }
+   return d;
+}
+
+// Decode the whole memory, done once after the parser has loaded it
+inline void decode_memory(VmContext& vm)
+{
+   vm.decoded.resize(maxMemory);
+   vm.optimized.assign(maxMemory, false);
+
+   for (std::size_t address = 0; address < maxMemory; ++address)
+      vm.decoded[address] = decode_instruction(vm.memory[address], address);
+}
+
+#endif // DECODER_HPP
@@ -0,0 +1,70 @@
+#ifndef DISASSEMBLER_HPP
+#define DISASSEMBLER_HPP
+
+#include "memory.hpp"
+#include "register.hpp"
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+using namespace std::string_literals;
+
+// Address as the assembler reads it back, like 0x3000
+inline std::string hex_address(std::int64_t address)
+{
+   std::ostringstream oss;
+   oss << "0x" << std::hex << std::setw(4) << std::setfill('0') << static_cast<std::uint32_t>(address);
+   return oss.str();
+}
+
+// Turn the instruction at the address back into assembly. Operands relative
+// to the program counter are shown as the absolute address they end up at,
+// the same way the opcodes compute it.
+inline std::string disassemble(std::uint32_t instr, std::uint16_t address)
+{
+   static constexpr const char* binary[] {"ADD", "SUB", "MUL", "DIV", "REM", "AND", "OR", "XOR"};
+   static constexpr const char* loads[] {"LD", "LDI", "", "LEA", "ST", "STI"};
+
+   auto reg = [&](unsigned shift) { return "R"s + std::to_string((instr >> shift) & 0b1111); };
+   std::uint8_t opcode = instr & 0b111111;
+
+   if (instr == haltInstruction)
+      return "HALT"s;
+   if (instr == snapInstruction)
+      return "SNAP"s;
+
+   switch (opcode)
+   {
+      case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
+      {
+         std::string operand = ((instr >> 6) & 0b1)
+            ? std::to_string(sext((instr >> 15) & 0b11111111111111111, 17))
+            : reg(15);
+         return binary[opcode - 1] + " "s + reg(7) + ", "s + reg(11) + ", "s + operand;
+      }
+      case 9: case 10:
+         return (opcode == 9 ? "NOT "s : "NEG "s) + reg(6) + ", "s + reg(10);
+      case 11:
+      {
+         std::string flags = ((instr >> 6) & 0b001 ? "n"s : ""s) + ((instr >> 6) & 0b010 ? "z"s : ""s) +
+                             ((instr >> 6) & 0b100 ? "p"s : ""s);
+         return "BR"s + flags + " "s + hex_address(address + sext((instr >> 9) & 0b11111111111111111111111, 23) + 1);
+      }
+      case 12:
+         return (((instr >> 6) & 0b1111) == 15 ? "RET"s : "JMP "s + reg(6));
+      case 13:
+         if ((instr >> 6) & 0b1)
+            return "JSRR "s + reg(7);
+         return "JSR "s + hex_address(address + sext((instr >> 7) & 0b1111111111111111111111111, 25) + 1);
+      case 14: case 15: case 17: case 18: case 19:
+         return loads[opcode - 14] + " "s + reg(6) + ", "s + hex_address(address + sext((instr >> 10) & 0b1111111111111111111111, 22));
+      case 16:
+         return "LDR "s + reg(6) + ", "s + reg(10) + ", "s + std::to_string(sext((instr >> 14) & 0b11111111111111, 14));
+      case 20:
+         return "STR "s + reg(6) + ", "s + reg(10) + ", "s + std::to_string(sext((instr >> 14) & 0b111111111111111111, 18));
+      default:
+         return ".WORD "s + std::to_string(static_cast<std::int32_t>(instr));
+   }
+}
+
+#endif // DISASSEMBLER_HPP
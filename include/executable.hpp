@@ -0,0 +1,148 @@
+#ifndef EXECUTABLE_HPP
+#define EXECUTABLE_HPP
+
+#include "catcher.hpp"
+#include "context.hpp"
+#include "mapped_file.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// Layout of an .exf executable, all fields in the byte order of the host:
+//    header         - magic, version, entry point and number of segments
+//    segment table  - address, size and file offset of every segment
+//    words          - raw 32-bit words of all segments, one after another
+//
+// Loading it only validates the tables and copies the words into memory,
+// the source is never lexed or parsed again.
+inline constexpr char exfMagic[4] = {'E', 'X', 'F', '3'};
+inline constexpr std::uint16_t exfVersion = 1;
+
+struct ExfHeader
+{
+   char magic[4];
+   std::uint16_t version;
+   std::uint16_t entry;
+   std::uint32_t segment_count;
+};
+
+struct ExfSegment
+{
+   std::uint32_t address;
+   std::uint32_t size;    // In words
+   std::uint32_t offset;  // In bytes from the start of the file
+};
+
+static_assert(sizeof(ExfHeader) == 12 && sizeof(ExfSegment) == 12);
+
+// Write the segments of the assembled program into an executable
+inline bool write_executable(Catcher& catcher, const VmContext& vm, const std::filesystem::path& path)
+{
+   std::vector<ExfSegment> segments;
+   std::uint32_t offset = sizeof(ExfHeader);
+
+   for (const auto& segment : vm.segments)
+      if (segment.size > 0)
+         segments.push_back({segment.start, segment.size, 0});
+
+   offset += segments.size() * sizeof(ExfSegment);
+   for (auto& segment : segments)
+   {
+      segment.offset = offset;
+      offset += segment.size * sizeof(std::int32_t);
+   }
+
+   std::ofstream file (path, std::ios::binary | std::ios::trunc);
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to create executable '"s + path.string() + "'."s);
+      return false;
+   }
+
+   ExfHeader header {};
+   std::memcpy(header.magic, exfMagic, sizeof(exfMagic));
+   header.version = exfVersion;
+   header.entry = vm.pcStart;
+   header.segment_count = segments.size();
+
+   file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+   file.write(reinterpret_cast<const char*>(segments.data()), segments.size() * sizeof(ExfSegment));
+
+   std::vector<std::int32_t> words;
+   for (const auto& segment : segments)
+   {
+      words.resize(segment.size);
+      vm.memory.read(segment.address, words.data(), words.size());
+      file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(std::int32_t));
+   }
+
+   if (!file)
+   {
+      catcher.insert("Failed to write executable '"s + path.string() + "'."s);
+      return false;
+   }
+   return true;
+}
+
+// Map the executable and copy its segments into the memory of the virtual
+// machine
+inline bool load_executable(Catcher& catcher, VmContext& vm, const std::filesystem::path& path)
+{
+   MappedFile file (path);
+
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to open executable '"s + path.string() + "'."s);
+      return false;
+   }
+
+   ExfHeader header;
+   if (file.size() < sizeof(header))
+   {
+      catcher.insert("File '"s + path.string() + "' is too small to be an executable."s);
+      return false;
+   }
+   std::memcpy(&header, file.data(), sizeof(header));
+
+   if (std::memcmp(header.magic, exfMagic, sizeof(exfMagic)) != 0)
+   {
+      catcher.insert("File '"s + path.string() + "' is not an executable."s);
+      return false;
+   }
+
+   if (header.version != exfVersion)
+   {
+      catcher.insert("Executable '"s + path.string() + "' has version " + std::to_string(header.version) +
+                     ", expected version "s + std::to_string(exfVersion) + "."s);
+      return false;
+   }
+
+   std::uint64_t table_end = sizeof(header) + std::uint64_t(header.segment_count) * sizeof(ExfSegment);
+   if (table_end > file.size())
+   {
+      catcher.insert("Executable '"s + path.string() + "' has a truncated segment table."s);
+      return false;
+   }
+
+   for (std::uint32_t index = 0; index < header.segment_count; ++index)
+   {
+      ExfSegment segment;
+      std::memcpy(&segment, file.data() + sizeof(header) + index * sizeof(ExfSegment), sizeof(segment));
+
+      std::uint64_t end = segment.offset + std::uint64_t(segment.size) * sizeof(std::int32_t);
+      if (std::uint64_t(segment.address) + segment.size > maxMemory || end > file.size() ||
+          segment.offset % sizeof(std::int32_t) != 0)
+      {
+         catcher.insert("Executable '"s + path.string() + "' has an invalid segment "s + std::to_string(index) + "."s);
+         return false;
+      }
+
+      vm.memory.write(segment.address, reinterpret_cast<const std::int32_t*>(file.data() + segment.offset), segment.size);
+      vm.segments.push_back({static_cast<std::uint16_t>(segment.address), segment.size});
+   }
+
+   vm.pcStart = header.entry;
+   return true;
+}
+
+#endif // EXECUTABLE_HPP
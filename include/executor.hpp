@@ -1,12 +1,19 @@
 #ifndef EXECUTOR_HPP
 #define EXECUTOR_HPP
 
+#include "decoder.hpp"
+#include "fusion.hpp"
+#include "jit.hpp"
+#include "tiering.hpp"
 #include "opcodes.hpp"
+#include "profiler.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
 #include <unordered_map>
 #include <functional>
 
 // List of all opcodes to easily execute them 
-inline std::unordered_map<std::int16_t, std::function<void(std::uint32_t)>> opcode_list
+inline std::unordered_map<std::int16_t, std::function<void(VmContext&, std::uint32_t)>> opcode_list
 {
    {1, opcode_add}, {2, opcode_sub}, {3, opcode_mul}, {4, opcode_div}, {5, opcode_rem},
    {6, opcode_and}, {7, opcode_or}, {8, opcode_xor}, {9, opcode_not}, {10, opcode_neg},
@@ -15,36 +22,571 @@ inline std::unordered_map<std::int16_t, std::function<void(std::uint32_t)>> opco
    {19, opcode_sti}, {20, opcode_str}
 };
 
+// Handler of a single instruction
+using OpcodeHandler = void(*)(VmContext&, std::uint32_t);
 
-// Goes through the memory and executes all of the instructions until comes
-// across the HALT command.
+// Opcode that does nothing, used for the unassigned slots of the opcode table
+inline void opcode_nop(VmContext&, std::uint32_t) {}
+
+// Dense table of all 64 opcodes indexed by the lowest 6 bits of an instruction
+inline constexpr std::array<OpcodeHandler, 64> opcode_table = []
+{
+   std::array<OpcodeHandler, 64> table {};
+   table.fill(opcode_nop);
+
+   table[1]  = opcode_add; table[2]  = opcode_sub; table[3]  = opcode_mul;
+   table[4]  = opcode_div; table[5]  = opcode_rem; table[6]  = opcode_and;
+   table[7]  = opcode_or;  table[8]  = opcode_xor; table[9]  = opcode_not;
+   table[10] = opcode_neg; table[11] = opcode_br;  table[12] = opcode_jmp;
+   table[13] = opcode_jsr; table[14] = opcode_ld;  table[15] = opcode_ldi;
+   table[16] = opcode_ldr; table[17] = opcode_lea; table[18] = opcode_st;
+   table[19] = opcode_sti; table[20] = opcode_str;
+   return table;
+}();
+
+// Engines that can be used to run the instructions
+enum class Engine : std::uint8_t
+{
+   legacy,     // Hash map of std::function handlers
+   threaded,   // Direct threading through a dense opcode table
+   predecoded, // Instructions decoded once before execution
+   fused,      // Decoded basic blocks with superinstructions
+   jit,        // Basic blocks compiled to x86-64 machine code
+   tiered,     // Interpreter that promotes hot code to decoded basic blocks
+};
+
+// Goes through the memory of a virtual machine and executes all of the
+// instructions until comes across the HALT command.
 class Executor
 {
 public:
    // Constructors
-   Executor() = default;
+   Executor(VmContext& vm, Engine engine = Engine::legacy, std::uint32_t threshold = defaultThreshold)
+      : vm(vm), engine(engine) { tiers.threshold = threshold; }
    ~Executor() = default;
 
    // Execute all of the instructions found in memory.
    void execute()
    {
-      clear_registers();
-      reg.at(R_PC) = pcStart;
+      vm.clear_registers();
+      vm.reg.at(R_PC) = vm.pcStart;
+      vm.fault = {};
+
+      if (profiled())
+         vm.profiler->start(vm.pcStart);
+      run();
+   }
+
+   // Continue executing from the registers the machine has, like the ones a
+   // snapshot was loaded with
+   void resume()
+   {
+      vm.fault = {};
+
+      if (profiled())
+         vm.profiler->start(vm.reg[R_PC]);
+      run();
+   }
+
+   // Write a snapshot of the machine into the file once the number of
+   // instructions ran, or at every SNAP when it's zero. The snapshots resume
+   // right after the instruction they were taken at. Failures to write them
+   // go into the catcher.
+   void snapshot_into(Catcher& catcher, const std::filesystem::path& path, std::uint64_t after = 0)
+   {
+      snapshot = {&catcher, path, after};
+   }
+
+   // Snapshots written during the last execution
+   std::size_t snapshots() const
+   {
+      return snapshot.taken;
+   }
+
+   // Superinstructions created during the last execution with the fused
+   // engine
+   const FusionReport& fusion_report() const
+   {
+      return report;
+   }
+
+   // Tier-ups and time spent in each tier during the last execution with the
+   // tiered engine
+   const TierReport& tier_report() const
+   {
+      return tiers;
+   }
+
+private:
+   // Where and when to write snapshots, none are written without a catcher
+   struct SnapshotPlan
+   {
+      Catcher* catcher = nullptr;
+      std::filesystem::path path;
+      std::uint64_t after = 0;
+      std::size_t taken = 0;
+   };
+
+   VmContext& vm;
+   Engine engine;
+   FusionReport report;
+   TierReport tiers;
+   SnapshotPlan snapshot;
+
+   // Run the program on the engine until it halts or faults. The engines
+   // stop at SNAP as well, the snapshot is taken here and the engine is
+   // entered again after it.
+   void run()
+   {
+      snapshot.taken = 0;
+
+      // Counted on the interpreter, the engines don't count
+      bool running = true;
+      if (snapshot.catcher && snapshot.after > 0 && (running = execute_counted(snapshot.after)))
+         take_snapshot();
+
+      while (running && !vm.fault)
+      {
+         // Profiling replaces the engine, none of them pay for it otherwise.
+         // Tracing replaces it with the threaded engine, or runs along with
+         // the profile, the others never check for it.
+         if (profiled())
+            execute_profiled();
+         else if (vm.trace)
+            execute_threaded<true>();
+         else if (engine == Engine::threaded)
+            execute_threaded();
+         else if (engine == Engine::predecoded || engine == Engine::fused)
+            execute_predecoded();
+         else if (engine == Engine::jit)
+            execute_jit();
+         else if (engine == Engine::tiered)
+            execute_tiered();
+         else
+            execute_legacy();
+
+         std::uint32_t pc = vm.reg[R_PC];
+         if (vm.fault || pc >= maxMemory || vm.memory[pc] != snapInstruction)
+            break;
+
+         ++vm.reg[R_PC];
+         if (snapshot.catcher && snapshot.after == 0)
+            take_snapshot();
+      }
+
+      // Leave the program counter at the instruction that faulted
+      if (vm.fault)
+         vm.reg[R_PC] = vm.fault.pc;
+      vm.reg[R_COND] = vm.condition_codes();
+
+      vm.pcStart = defaultPcStart;
+   }
+
+   void take_snapshot()
+   {
+      vm.reg[R_COND] = vm.condition_codes();
+      if (write_snapshot(*snapshot.catcher, vm, snapshot.path))
+         ++snapshot.taken;
+   }
+
+   // Interprets up to the number of instructions into the profile and the
+   // trace, if there are any, the same way execute_profiled does. SNAP runs
+   // as a NOP. Returns whether the program is still running after all of
+   // them, without having halted or faulted.
+   bool execute_counted(std::uint64_t count)
+   {
+      using Clock = std::chrono::steady_clock;
+
+      Profile* profile = profiled() ? vm.profiler : nullptr;
+      TraceBuffer::Writer trace (vm.trace);
+      auto last = Clock::now();
+
+      for (; count > 0; --count)
+      {
+         std::int32_t pc = vm.reg[R_PC];
+         if (static_cast<std::uint32_t>(pc) >= maxMemory)
+            return false;
+
+         std::uint32_t instr = vm.memory[pc];
+         std::uint8_t opcode = instr & 0b111111;
+
+         if (profile)
+         {
+            ++profile->hits[pc];
+            ++profile->frames[profile->current].self;
+            ++profile->opcodes[opcode].count;
+         }
+
+         if (instr == haltInstruction)
+         {
+            if (vm.trace)
+               trace.record(vm.reg, pc, instr, vm.condition_codes());
+            return false;
+         }
 
-      while (reg.at(R_PC) < maxMemory)
+         opcode_table[opcode](vm, instr);
+
+         if (profile)
+         {
+            if (opcode == 13)
+               profile->call(vm.reg[R_PC] + 1);
+            else if (opcode == 12 && ((instr >> 6) & 0b1111) == R_R15)
+               profile->ret();
+
+            auto now = Clock::now();
+            profile->opcodes[opcode].time += now - last;
+            last = now;
+         }
+
+         ++vm.reg[R_PC];
+         if (vm.trace)
+            trace.record(vm.reg, pc, instr, vm.condition_codes());
+
+         if (vm.fault)
+            return false;
+      }
+      return true;
+   }
+
+   void execute_legacy()
+   {
+      while (vm.reg.at(R_PC) < maxMemory)
       {
-         std::uint32_t instr = memory.at(reg.at(R_PC));
+         std::uint32_t instr = vm.memory[vm.reg.at(R_PC)];
 
-         // Halt command
-         if (instr == 63)
+         // HALT or SNAP
+         if (stops(instr))
             break;
 
          if (opcode_list.count(instr & 0b111111))
-            opcode_list.at(instr & 0b111111)(instr);
+            opcode_list.at(instr & 0b111111)(vm, instr);
+
+         ++vm.reg.at(R_PC);
+      }
+   }
+
+   // Every handler jumps straight to the handler of the next instruction
+   // instead of returning to a shared loop. The program counter is kept in
+   // the register file, because branches and loads read and write it. The
+   // traced version records every instruction into the trace as well.
+   template <bool Traced = false>
+   void execute_threaded()
+   {
+      std::uint32_t instr;
+      [[maybe_unused]] std::int32_t pc = 0;
+      [[maybe_unused]] TraceBuffer::Writer trace (Traced ? vm.trace : nullptr);
+
+#if defined(__GNUC__) || defined(__clang__)
+      static const void* const labels[64] =
+      {
+         &&op_nop, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_rem, &&op_and,
+         &&op_or,  &&op_xor, &&op_not, &&op_neg, &&op_br,  &&op_jmp, &&op_jsr,
+         &&op_ld,  &&op_ldi, &&op_ldr, &&op_lea, &&op_st,  &&op_sti, &&op_str,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop, &&op_nop,
+         &&op_halt
+      };
+
+      #define DISPATCH()                                                 \
+         if (static_cast<std::uint32_t>(vm.reg[R_PC]) >= maxMemory) return; \
+         instr = vm.memory[vm.reg[R_PC]];                                    \
+         goto *labels[instr & 0b111111]
+
+      #define NEXT(handler)                                                           \
+         if constexpr (Traced) pc = vm.reg[R_PC];                                     \
+         handler(vm, instr);                                                          \
+         ++vm.reg[R_PC];                                                              \
+         if constexpr (Traced) trace.record(vm.reg, pc, instr, vm.condition_codes()); \
+         DISPATCH()
+
+      DISPATCH();
+
+      op_add: NEXT(opcode_add);
+      op_sub: NEXT(opcode_sub);
+      op_mul: NEXT(opcode_mul);
+      op_div: NEXT(opcode_div);
+      op_rem: NEXT(opcode_rem);
+      op_and: NEXT(opcode_and);
+      op_or:  NEXT(opcode_or);
+      op_xor: NEXT(opcode_xor);
+      op_not: NEXT(opcode_not);
+      op_neg: NEXT(opcode_neg);
+      op_br:  NEXT(opcode_br);
+      op_jmp: NEXT(opcode_jmp);
+      op_jsr: NEXT(opcode_jsr);
+      op_ld:  NEXT(opcode_ld);
+      op_ldi: NEXT(opcode_ldi);
+      op_ldr: NEXT(opcode_ldr);
+      op_lea: NEXT(opcode_lea);
+      op_st:  NEXT(opcode_st);
+      op_sti: NEXT(opcode_sti);
+      op_str: NEXT(opcode_str);
+      op_nop: NEXT(opcode_nop);
+
+      // HALT or SNAP, any other instruction with the same opcode is skipped
+      op_halt:
+         if (stops(instr))
+         {
+            if constexpr (Traced) trace.record(vm.reg, vm.reg[R_PC], instr, vm.condition_codes());
+            return;
+         }
+         NEXT(opcode_nop);
+
+      #undef NEXT
+      #undef DISPATCH
+#else
+      while (static_cast<std::uint32_t>(vm.reg[R_PC]) < maxMemory)
+      {
+         pc = vm.reg[R_PC];
+         instr = vm.memory[pc];
+
+         switch (instr & 0b111111)
+         {
+            case 63:
+               if (stops(instr))
+               {
+                  if constexpr (Traced) trace.record(vm.reg, vm.reg[R_PC], instr, vm.condition_codes());
+                  return;
+               }
+               break;
+            default:
+               opcode_table[instr & 0b111111](vm, instr);
+               break;
+         }
+         ++vm.reg[R_PC];
+         if constexpr (Traced)
+            trace.record(vm.reg, pc, instr, vm.condition_codes());
+      }
+#endif
+   }
+
+   // Runs the instructions from the decoded copy of the memory. Stores mark
+   // the entries they overwrite, which get decoded again when reached. The
+   // handlers return the next address, so the program counter is only
+   // written back to the register once the program halts.
+   void execute_predecoded()
+   {
+      decode_memory(vm);
+
+      if (engine == Engine::fused)
+         report = fuse_blocks(vm, vm.reg[R_PC]);
+
+      std::int32_t pc = vm.reg[R_PC];
+      while (static_cast<std::uint32_t>(pc) < maxMemory)
+      {
+         const Decoded& d = vm.decoded[pc];
+
+         // HALT or SNAP
+         if (d.handler == decoded_halt)
+            break;
+
+         pc = d.handler(vm, d, pc);
+      }
+      vm.reg[R_PC] = pc;
+   }
+
+   // Runs the basic blocks compiled by the JIT. Instructions it can't compile
+   // are interpreted one at a time and writes into compiled code throw all of
+   // it away. Falls back to the decoded engine where there's no JIT.
+   void execute_jit()
+   {
+#ifdef VM_JIT
+      Jit jit (vm);
+
+      if (jit.available())
+      {
+         // Stores of the interpreter don't go through the compiled checks
+         auto interpret = [&](std::uint32_t instr)
+         {
+            bool overwrites = jit.overwrites(instr);
+            opcode_table[instr & 0b111111](vm, instr);
+            ++vm.reg[R_PC];
+
+            if (overwrites)
+               jit.flush();
+         };
+
+         while (static_cast<std::uint32_t>(vm.reg[R_PC]) < maxMemory)
+         {
+            std::uint32_t instr = vm.memory[vm.reg[R_PC]];
+
+            // HALT or SNAP
+            if (stops(instr))
+               break;
+
+            if (void* block = jit.lookup(vm.reg[R_PC]))
+            {
+               Jit::Status status = jit.run(block);
+
+               if (status == Jit::halt)
+                  break;
+               if (status == Jit::invalidate)
+                  jit.flush();
+
+               // The interpreter raises the fault, allocates or copies the
+               // page the compiled code left on
+               if (status == Jit::interpret)
+                  interpret(vm.memory[vm.reg[R_PC]]);
+               continue;
+            }
+
+            interpret(instr);
+         }
+         return;
+      }
+#endif
+      execute_predecoded();
+   }
+
+   // Whether there's a profile to fill in, never when the profiler is left
+   // out of the build
+   bool profiled() const
+   {
+#ifndef VM_NO_PROFILER
+      return vm.profiler != nullptr;
+#else
+      return false;
+#endif
+   }
+
+   // Interprets the raw instructions one at a time into the profile, and
+   // into the trace if there is one. The host time of every instruction is
+   // the time since the one before it.
+   void execute_profiled()
+   {
+#ifndef VM_NO_PROFILER
+      using Clock = std::chrono::steady_clock;
+
+      Profile& profile = *vm.profiler;
+      TraceBuffer::Writer trace (vm.trace);
+      auto last = Clock::now();
+
+      while (static_cast<std::uint32_t>(vm.reg[R_PC]) < maxMemory)
+      {
+         std::int32_t pc = vm.reg[R_PC];
+         std::uint32_t instr = vm.memory[pc];
+         std::uint8_t opcode = instr & 0b111111;
+
+         ++profile.hits[pc];
+         ++profile.frames[profile.current].self;
+         ++profile.opcodes[opcode].count;
+
+         // HALT or SNAP
+         if (stops(instr))
+         {
+            if (vm.trace)
+               trace.record(vm.reg, pc, instr, vm.condition_codes());
+            break;
+         }
+
+         opcode_table[opcode](vm, instr);
+
+         if (opcode == 13)
+            profile.call(vm.reg[R_PC] + 1);
+         else if (opcode == 12 && ((instr >> 6) & 0b1111) == R_R15)
+            profile.ret();
+
+         auto now = Clock::now();
+         profile.opcodes[opcode].time += now - last;
+         last = now;
+
+         ++vm.reg[R_PC];
+         if (vm.trace)
+            trace.record(vm.reg, pc, instr, vm.condition_codes());
+      }
+#endif
+   }
+
+   // Starts out interpreting the raw instructions while counting how often
+   // every call target and loop header is reached. Once one of them crosses
+   // the threshold, all of the code reachable from it is decoded and fused
+   // and runs in the optimized tier from then on.
+   void execute_tiered()
+   {
+      using Clock = std::chrono::steady_clock;
+
+      std::vector<std::uint32_t> hotness(maxMemory);
+      std::vector<bool> promoted(maxMemory);
+      vm.decoded.resize(maxMemory);
+      vm.optimized.assign(maxMemory, false);
+
+      auto start = Clock::now(), last = start;
+      tiers.events.clear();
+      tiers.time[0] = tiers.time[1] = {};
+
+      auto switch_tier = [&](Tier from)
+      {
+         auto now = Clock::now();
+         tiers.time[static_cast<int>(from)] += now - last;
+         last = now;
+      };
+
+      while (static_cast<std::uint32_t>(vm.reg[R_PC]) < maxMemory)
+      {
+         std::int32_t pc = vm.reg[R_PC];
+
+         if (promoted[pc])
+         {
+            switch_tier(Tier::interpreted);
+
+            while (static_cast<std::uint32_t>(pc) < maxMemory && promoted[pc])
+            {
+               const Decoded& d = vm.decoded[pc];
+
+               // HALT or SNAP
+               if (d.handler == decoded_halt)
+               {
+                  vm.reg[R_PC] = pc;
+                  switch_tier(Tier::optimized);
+                  return;
+               }
+               pc = d.handler(vm, d, pc);
+            }
+
+            vm.reg[R_PC] = pc;
+            switch_tier(Tier::optimized);
+            continue;
+         }
+
+         std::uint32_t instr = vm.memory[pc];
+         std::uint8_t opcode = instr & 0b111111;
+
+         // HALT or SNAP
+         if (stops(instr))
+            break;
+
+         // Stores go through the decoder, so they invalidate promoted code
+         if (opcode >= 18 && opcode <= 20)
+         {
+            Decoded d = decode_instruction(instr, pc);
+            vm.reg[R_PC] = d.handler(vm, d, pc);
+            continue;
+         }
+
+         opcode_table[opcode](vm, instr);
+
+         // Count taken calls and backward branches towards their target
+         bool call = (opcode == 13);
+         bool back_edge = (opcode == 11 && vm.reg[R_PC] < pc);
+
+         if ((call || back_edge) && vm.reg[R_PC] + 1 >= 0 && vm.reg[R_PC] + 1 < static_cast<std::int32_t>(maxMemory))
+         {
+            std::int32_t target = vm.reg[R_PC] + 1;
 
-         ++reg.at(R_PC);
+            if (++hotness[target] == tiers.threshold && !promoted[target])
+            {
+               std::size_t count = promote_reachable(vm, target, promoted);
+               fuse_blocks(vm, target);
+               tiers.events.push_back({static_cast<std::uint16_t>(target), count, Clock::now() - start});
+            }
+         }
+         ++vm.reg[R_PC];
       }
-      pcStart = 0x3000;
+      switch_tier(Tier::interpreted);
    }
 };
 
@@ -0,0 +1,36 @@
+#ifndef FAULT_HPP
+#define FAULT_HPP
+
+#include "disassembler.hpp"
+#include <iostream>
+
+// Kind of access that left the memory
+enum class Fault : std::uint8_t
+{
+   none,
+   load,
+   store,
+};
+
+// Access outside of the memory that stopped the guest program, along with
+// the address of the instruction that made it
+struct GuestFault
+{
+   Fault kind = Fault::none;
+   std::uint16_t pc = 0;
+   std::int64_t address = 0;
+
+   explicit operator bool() const
+   {
+      return kind != Fault::none;
+   }
+
+   // Display where the program faulted
+   void display() const
+   {
+      std::cout << (kind == Fault::load ? "Load"s : "Store"s) << " fault at "s << hex_address(pc) << ", address "s;
+      std::cout << (in_memory(address) ? hex_address(address) : std::to_string(address)) << " is outside of the memory.\n"s;
+   }
+};
+
+#endif // FAULT_HPP
@@ -0,0 +1,227 @@
+#ifndef FUSION_HPP
+#define FUSION_HPP
+
+#include "decoder.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Two decoded instructions executed by a single handler. The second one is
+// read from the entry right after the first, which is left untouched, so
+// jumps that land in between still run it on its own. A first instruction
+// that faults never falls through to the second one.
+template <DecodedHandler First, DecodedHandler Second>
+inline std::int32_t decoded_fused(VmContext& vm, const Decoded& d, std::int32_t pc)
+{
+   std::int32_t next = First(vm, d, pc);
+   return (next == pc + 1 ? Second(vm, (&d)[1], next) : next);
+}
+
+// Pair of decoded instructions that can be fused into a superinstruction
+struct Fusion
+{
+   DecodedHandler first;
+   DecodedHandler second;
+   DecodedHandler fused;
+   const char* name;
+};
+
+#define FUSION(first, second, name) {first, second, decoded_fused<first, second>, name}
+
+// All of the superinstructions. The first instruction of a pair that gets
+// its condition codes overwritten by the second one skips setting them.
+inline const std::vector<Fusion> fusions
+{
+   // Arithmetic, logic and loads followed by a branch on their result
+   FUSION(decoded_add_imm<>, decoded_br, "ADD+BR"),
+   FUSION(decoded_add_reg<>, decoded_br, "ADD+BR"),
+   FUSION(decoded_sub_imm<>, decoded_br, "SUB+BR"),
+   FUSION(decoded_sub_reg<>, decoded_br, "SUB+BR"),
+   FUSION(decoded_mul_imm<>, decoded_br, "MUL+BR"),
+   FUSION(decoded_mul_reg<>, decoded_br, "MUL+BR"),
+   FUSION(decoded_div_imm<>, decoded_br, "DIV+BR"),
+   FUSION(decoded_div_reg<>, decoded_br, "DIV+BR"),
+   FUSION(decoded_rem_imm<>, decoded_br, "REM+BR"),
+   FUSION(decoded_rem_reg<>, decoded_br, "REM+BR"),
+   FUSION(decoded_and_imm<>, decoded_br, "AND+BR"),
+   FUSION(decoded_and_reg<>, decoded_br, "AND+BR"),
+   FUSION(decoded_or_imm<>,  decoded_br, "OR+BR"),
+   FUSION(decoded_or_reg<>,  decoded_br, "OR+BR"),
+   FUSION(decoded_xor_imm<>, decoded_br, "XOR+BR"),
+   FUSION(decoded_xor_reg<>, decoded_br, "XOR+BR"),
+   FUSION(decoded_not<>,     decoded_br, "NOT+BR"),
+   FUSION(decoded_neg<>,     decoded_br, "NEG+BR"),
+   FUSION(decoded_ld<>,      decoded_br, "LD+BR"),
+   FUSION(decoded_ldi<>,     decoded_br, "LDI+BR"),
+   FUSION(decoded_ldr<>,     decoded_br, "LDR+BR"),
+   FUSION(decoded_lea<>,     decoded_br, "LEA+BR"),
+
+   // Load followed by an accumulation of the loaded value
+   FUSION(decoded_ldr<false>, decoded_add_imm<>, "LDR+ADD"),
+   FUSION(decoded_ldr<false>, decoded_add_reg<>, "LDR+ADD"),
+
+   // Subtraction idiom, NOT followed by ADD of one or of another register
+   FUSION(decoded_not<false>, decoded_add_imm<>, "NOT+ADD"),
+   FUSION(decoded_not<false>, decoded_add_reg<>, "NOT+ADD"),
+};
+
+#undef FUSION
+
+// Handlers that set the condition codes, paired with their variants that
+// don't set them
+inline const std::vector<std::pair<DecodedHandler, DecodedHandler>> flag_setters
+{
+   {decoded_add_imm<>, decoded_add_imm<false>}, {decoded_add_reg<>, decoded_add_reg<false>},
+   {decoded_sub_imm<>, decoded_sub_imm<false>}, {decoded_sub_reg<>, decoded_sub_reg<false>},
+   {decoded_mul_imm<>, decoded_mul_imm<false>}, {decoded_mul_reg<>, decoded_mul_reg<false>},
+   {decoded_div_imm<>, decoded_div_imm<false>}, {decoded_div_reg<>, decoded_div_reg<false>},
+   {decoded_rem_imm<>, decoded_rem_imm<false>}, {decoded_rem_reg<>, decoded_rem_reg<false>},
+   {decoded_and_imm<>, decoded_and_imm<false>}, {decoded_and_reg<>, decoded_and_reg<false>},
+   {decoded_or_imm<>,  decoded_or_imm<false>},  {decoded_or_reg<>,  decoded_or_reg<false>},
+   {decoded_xor_imm<>, decoded_xor_imm<false>}, {decoded_xor_reg<>, decoded_xor_reg<false>},
+   {decoded_not<>, decoded_not<false>}, {decoded_neg<>, decoded_neg<false>},
+   {decoded_ld<>,  decoded_ld<false>},  {decoded_ldi<>, decoded_ldi<false>},
+   {decoded_ldr<>, decoded_ldr<false>}, {decoded_lea<>, decoded_lea<false>}
+};
+
+// Find the variant of the handler that doesn't set the condition codes, or
+// nullptr when it doesn't set them in the first place
+inline DecodedHandler without_flags(DecodedHandler handler)
+{
+   for (const auto& [with, without] : flag_setters)
+      if (with == handler)
+         return without;
+   return nullptr;
+}
+
+// Whether the handler ends a basic block
+inline bool ends_block(DecodedHandler handler)
+{
+   return handler == decoded_br  || handler == decoded_jmp  ||
+          handler == decoded_ret || handler == decoded_jsr  ||
+          handler == decoded_jsrr || handler == decoded_halt;
+}
+
+// Summary of the optimizations applied to the basic blocks of a program
+struct FusionReport
+{
+   std::size_t blocks = 0;
+   std::size_t skipped_flags = 0;
+   std::vector<std::pair<std::uint16_t, const char*>> fused;
+
+   // Display the fusions grouped by their kind
+   void display() const
+   {
+      std::cout << "Fused " << fused.size() << " instruction pair" << (fused.size() == 1 ? "" : "s");
+      std::cout << " in " << blocks << " basic block" << (blocks == 1 ? "" : "s");
+      std::cout << ", skipped " << skipped_flags << " condition code update";
+      std::cout << (skipped_flags == 1 ? "" : "s") << ".\n";
+
+      auto sorted = fused;
+      std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b)
+      {
+         return std::string(a.second) < std::string(b.second);
+      });
+
+      for (std::size_t index = 0; index < sorted.size();)
+      {
+         std::string name = sorted.at(index).second;
+         std::cout << "   " << std::left << std::setw(8) << name << std::right << std::hex;
+
+         for (; index < sorted.size() && name == sorted.at(index).second; ++index)
+            std::cout << " 0x" << sorted.at(index).first;
+         std::cout << std::dec << std::endl;
+      }
+   }
+};
+
+// Find the basic blocks reachable from the entry address in the decoded
+// memory and rewrite them with superinstructions. Only the direct branch and
+// call targets are known, code reached through JMP or JSRR alone is left as
+// it is.
+inline FusionReport fuse_blocks(VmContext& vm, std::uint16_t entry)
+{
+   FusionReport report;
+   std::vector<bool> reachable(maxMemory), leader(maxMemory);
+   std::vector<std::int64_t> work {entry};
+   leader.at(entry) = true;
+
+   auto follow = [&](std::int64_t target)
+   {
+      if (target < 0 || target >= static_cast<std::int64_t>(maxMemory))
+         return;
+      leader.at(target) = true;
+      work.push_back(target);
+   };
+
+   while (!work.empty())
+   {
+      std::int64_t address = work.back();
+      work.pop_back();
+
+      if (reachable.at(address))
+         continue;
+      reachable.at(address) = true;
+
+      const Decoded& d = vm.decoded.at(address);
+
+      if (d.handler == decoded_br || d.handler == decoded_jsr)
+      {
+         follow(d.imm + 1);
+         follow(address + 1);
+      }
+      else if (d.handler == decoded_jsrr)
+         follow(address + 1);
+      else if (!ends_block(d.handler) && address + 1 < static_cast<std::int64_t>(maxMemory))
+         work.push_back(address + 1);
+   }
+
+   for (std::size_t start = 0; start < maxMemory; ++start)
+   {
+      if (!reachable.at(start))
+         continue;
+
+      std::size_t end = start;
+      while (!ends_block(vm.decoded.at(end).handler) && end + 1 < maxMemory &&
+             reachable.at(end + 1) && !leader.at(end + 1))
+         ++end;
+      ++report.blocks;
+
+      // Condition codes overwritten by the next instruction are never read.
+      // LDR can fault before it sets them, which leaves them to the program.
+      for (std::size_t index = start; index < end; ++index)
+      {
+         DecodedHandler without = without_flags(vm.decoded.at(index).handler);
+         DecodedHandler next = vm.decoded.at(index + 1).handler;
+
+         if (without && without_flags(next) && next != decoded_ldr<>)
+         {
+            vm.decoded.at(index).handler = without;
+            vm.optimized.at(index) = vm.optimized.at(index + 1) = true;
+            ++report.skipped_flags;
+         }
+      }
+
+      for (std::size_t index = start; index < end; ++index)
+      {
+         auto fusion = std::find_if(fusions.begin(), fusions.end(), [&](const Fusion& f)
+         {
+            return f.first == vm.decoded.at(index).handler && f.second == vm.decoded.at(index + 1).handler;
+         });
+
+         if (fusion == fusions.end())
+            continue;
+
+         vm.decoded.at(index).handler = fusion->fused;
+         vm.optimized.at(index) = vm.optimized.at(index + 1) = true;
+         report.fused.push_back({index, fusion->name});
+         ++index;
+      }
+      start = end;
+   }
+   return report;
+}
+
+#endif // FUSION_HPP
@@ -0,0 +1,787 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "context.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// The JIT is only available on x86-64 unix systems, other platforms fall back
+// to the interpreter
+#if defined(__x86_64__) && defined(__unix__)
+#define VM_JIT 1
+#include <sys/mman.h>
+#endif
+
+#ifdef VM_JIT
+
+// Translates basic blocks of guest instructions into x86-64 machine code.
+//
+// Host register usage inside of the compiled code:
+//    rbx        - register file (reg)
+//    rbp        - page directory of the memory
+//    rdi        - first table of the directory, covering the lowest addresses
+//    r8d..r15d  - guest registers R0 to R7, R8 to R15 live in the register file
+//    eax..edx   - scratch
+//    esi        - scratch
+//
+// Condition codes are kept the same way as by the interpreter, as the last
+// result that set them in VmContext::cond, which sits right next to the
+// register file.
+//
+// Compiled blocks leave through exits that store the next address into R_PC
+// and return a status. Exits whose target is known get patched into direct
+// jumps once the target block is compiled, so hot loops never return to the
+// executor. DIV and REM are not compiled and are left to the interpreter.
+//
+// Loads and stores walk the page table of the memory inline. Accesses
+// outside of the memory and stores into pages that aren't allocated yet or
+// are shared with a forked memory leave before the access, so the interpreter
+// can run the instruction again and raise the fault, allocate the page or
+// copy it. Only allocated pages get compiled. Stores the interpreter runs
+// for the compiled code can still write into it, like the first store into
+// a shared page that holds code, so the executor checks them with
+// overwrites(). Since pages and tables are only ever allocated or copied
+// outside of the compiled code, the first table is loaded into a register
+// on entry and loads from addresses inside of it skip the directory.
+class Jit
+{
+public:
+   // Status returned by the compiled code
+   enum Status : std::int32_t
+   {
+      next,       // Continue at the address in R_PC
+      invalidate, // Compiled code was overwritten, continue at R_PC
+      halt,       // HALT was executed
+      interpret   // Instruction at R_PC faults or stores into a page the memory
+                  // doesn't own alone, it has to be run by the interpreter
+   };
+
+   // Constructors
+   explicit Jit(VmContext& vm)
+      : vm(vm), cond_offset(reinterpret_cast<std::uint8_t*>(&vm.cond) - reinterpret_cast<std::uint8_t*>(vm.reg.data()))
+   {
+      void* buffer = mmap(nullptr, capacity, PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buffer == MAP_FAILED)
+         return;
+
+      code = static_cast<std::uint8_t*>(buffer);
+      block_at.resize(maxMemory, nullptr);
+      code_map.resize(maxMemory, 0);
+      emit_trampoline();
+   }
+
+   ~Jit()
+   {
+      if (code)
+         munmap(code, capacity);
+   }
+
+   Jit(const Jit&) = delete;
+   Jit& operator=(const Jit&) = delete;
+
+   // Whether the executable buffer could be allocated
+   bool available() const
+   {
+      return code != nullptr;
+   }
+
+   // Compiled code for the block starting at the address, or nullptr if the
+   // instruction at the address has to be interpreted
+   void* lookup(std::uint16_t address)
+   {
+      if (block_at[address])
+         return block_at[address];
+
+      if (!vm.memory.mapped(address) || !compilable(vm.memory[address]))
+         return nullptr;
+
+      // Blocks that don't fit into what is left of the buffer get compiled
+      // again into an empty one
+      if (void* block = compile(address))
+         return block;
+      return compile(address);
+   }
+
+   // Run compiled code until it leaves through an exit
+   Status run(void* block)
+   {
+      using Entry = Status(*)(void*, std::int32_t*, const Memory::Table* const*);
+      return reinterpret_cast<Entry>(code)(block, vm.reg.data(), vm.memory.root());
+   }
+
+   // Whether the instruction at R_PC stores into compiled code. Has to be
+   // asked before the interpreter runs it, STI reads its address from the
+   // memory it may write to.
+   bool overwrites(std::uint32_t instr) const
+   {
+      std::uint8_t opcode = instr & 0b111111;
+      std::int64_t address;
+
+      if (opcode == 18 || opcode == 19)
+      {
+         address = vm.reg[R_PC] + sext((instr >> 10) & 0b1111111111111111111111, 22);
+         if (opcode == 19 && in_memory(address))
+            address = vm.memory[static_cast<std::uint32_t>(address)];
+      }
+      else if (opcode == 20)
+         address = base_address(vm.reg[(instr >> 10) & 0b1111], sext((instr >> 14) & 0b111111111111111111, 18));
+      else
+         return false;
+
+      return address >= 0 && address < static_cast<std::int64_t>(maxMemory) && code_map[address];
+   }
+
+   // Throw away all of the compiled code
+   void flush()
+   {
+      size = exit_size;
+      std::fill(block_at.begin(), block_at.end(), nullptr);
+      std::fill(code_map.begin(), code_map.end(), 0);
+      pending.clear();
+   }
+
+private:
+   static constexpr std::size_t capacity = 16 << 20;
+   static constexpr std::size_t max_block = 256;
+
+   // Scratch registers
+   static constexpr std::uint8_t eax = 0, ecx = 1, edx = 2;
+
+   // Offset of the program counter in the register file
+   static constexpr std::uint8_t pc_offset = R_PC * 4;
+
+   VmContext& vm;
+   std::int32_t cond_offset;   // Of the result the condition codes come from
+   std::uint8_t* code = nullptr;
+   std::size_t size = 0;
+   std::size_t exit_size = 0;  // End of the trampoline, start of the blocks
+   std::size_t exit_common = 0;
+
+   std::vector<void*> block_at;
+   std::vector<std::uint8_t> code_map;  // Marks which addresses are compiled
+
+   // Jumps waiting for their target block to be compiled
+   std::unordered_map<std::uint16_t, std::vector<std::size_t>> pending;
+
+   static bool compilable(std::uint32_t instr)
+   {
+      std::uint8_t opcode = instr & 0b111111;
+      return opcode != 4 && opcode != 5;
+   }
+
+   // Whether the instruction at the address always sets the condition codes,
+   // loads that fault don't
+   static bool sets_flags(std::uint32_t instr, std::int32_t address)
+   {
+      std::uint8_t opcode = instr & 0b111111;
+
+      if (opcode == 14 || opcode == 15)
+         return in_memory(address + sext((instr >> 10) & 0b1111111111111111111111, 22));
+      return (opcode >= 1 && opcode <= 10) || opcode == 17;
+   }
+
+   // Byte emitters
+   // Byte emitters. Past the end of the buffer they only count the bytes, so
+   // a block that doesn't fit is noticed once it's compiled.
+   void byte(std::uint8_t b) { if (size < capacity) code[size] = b; ++size; }
+   void bytes(std::initializer_list<std::uint8_t> list) { for (auto b : list) byte(b); }
+   void dword(std::int32_t d) { if (size + 4 <= capacity) std::memcpy(code + size, &d, 4); size += 4; }
+   void qword(std::uint64_t q) { if (size + 8 <= capacity) std::memcpy(code + size, &q, 8); size += 8; }
+
+   // mov host, guest
+   void load(std::uint8_t host, std::uint8_t guest)
+   {
+      if (guest < 8)
+         bytes({0x41, 0x8b, static_cast<std::uint8_t>(0xc0 | host << 3 | guest)});
+      else
+         bytes({0x8b, static_cast<std::uint8_t>(0x43 | host << 3), static_cast<std::uint8_t>(guest * 4)});
+   }
+
+   // mov guest, host
+   void store(std::uint8_t guest, std::uint8_t host)
+   {
+      if (guest < 8)
+         bytes({0x41, 0x89, static_cast<std::uint8_t>(0xc0 | host << 3 | guest)});
+      else
+         bytes({0x89, static_cast<std::uint8_t>(0x43 | host << 3), static_cast<std::uint8_t>(guest * 4)});
+   }
+
+   // mov guest, imm32
+   void store_imm(std::uint8_t guest, std::int32_t imm)
+   {
+      if (guest < 8)
+         bytes({0x41, static_cast<std::uint8_t>(0xb8 | guest)});
+      else
+         bytes({0xc7, 0x43, static_cast<std::uint8_t>(guest * 4)});
+      dword(imm);
+   }
+
+   // op eax, guest
+   void alu(std::uint8_t opcode, std::uint8_t guest)
+   {
+      bool imul = (opcode == 0xaf);
+
+      if (guest < 8)
+      {
+         byte(0x41);
+         if (imul) byte(0x0f);
+         bytes({opcode, static_cast<std::uint8_t>(0xc0 | guest)});
+      }
+      else
+      {
+         if (imul) byte(0x0f);
+         bytes({opcode, 0x43, static_cast<std::uint8_t>(guest * 4)});
+      }
+   }
+
+   // Set the condition codes from eax, same as update_flags
+   void flags()
+   {
+      bytes({0x48, 0x63, 0xc0});             // movsxd rax, eax
+      bytes({0x48, 0x89, 0x83});             // mov [rbx + cond], rax
+      dword(cond_offset);
+   }
+
+   // Leave through an exit that reruns the instruction at the address in the
+   // interpreter unless rcx holds an address inside of the memory. Base
+   // registers are unsigned, so only their offset can carry it outside.
+   void check_address(std::int32_t pc, std::vector<std::size_t>& reruns)
+   {
+      bytes({0x48, 0x89, 0xc8});             // mov rax, rcx
+      bytes({0x48, 0xc1, 0xe8, 0x20});       // shr rax, 32
+      bytes({0x0f, 0x85});                   // jnz rerun
+      reruns.push_back(size);
+      dword(pc);
+   }
+
+   // Same for a store into the table or page in rax, unless it belongs to
+   // the memory alone. The ones of zeros have no owners, so pages that aren't
+   // allocated yet leave as well.
+   void check_owned(std::size_t owners, std::int32_t pc, std::vector<std::size_t>& reruns)
+   {
+      bytes({0x83, 0xb8});                   // cmp dword [rax + owners], 1
+      dword(owners);
+      byte(1);
+      bytes({0x0f, 0x85});                   // jne rerun
+      reruns.push_back(size);
+      dword(pc);
+   }
+
+   // Host address of the word at the constant address, if its page belongs
+   // to the memory alone. Such pages are never replaced while the code runs,
+   // so it's embedded into the code instead of walking the page table.
+   std::uint64_t host_word(std::uint32_t address) const
+   {
+      if (!vm.memory.owned(address))
+         return 0;
+      return reinterpret_cast<std::uint64_t>(&vm.memory.page(address).words[address & (Memory::pageSize - 1)]);
+   }
+
+   // mov rax, table holding the constant address
+   void table_at(std::uint32_t address)
+   {
+      bytes({0x48, 0x8b, 0x85});             // mov rax, [rbp + table * 8]
+      dword((address >> (Memory::pageBits + Memory::tableBits)) * 8);
+   }
+
+   // mov rax, page holding the constant address out of the table in rax
+   void page_in_table(std::uint32_t address)
+   {
+      bytes({0x48, 0x8b, 0x80});             // mov rax, [rax + page * 8]
+      dword(((address >> Memory::pageBits) & (Memory::tableSize - 1)) * 8);
+   }
+
+   // mov eax, word at the constant address
+   void load_constant(std::uint32_t address)
+   {
+      if (std::uint64_t word = host_word(address))
+      {
+         byte(0xa1);                         // mov eax, [word]
+         qword(word);
+         return;
+      }
+
+      table_at(address);
+      page_in_table(address);
+      bytes({0x8b, 0x80});                   // mov eax, [rax + word * 4]
+      dword((address & (Memory::pageSize - 1)) * 4);
+   }
+
+   // mov word at the constant address, guest
+   void store_constant(std::uint32_t address, std::uint8_t guest, std::int32_t pc, std::vector<std::size_t>& reruns)
+   {
+      if (std::uint64_t word = host_word(address))
+      {
+         load(eax, guest);
+         byte(0xa3);                         // mov [word], eax
+         qword(word);
+         return;
+      }
+
+      table_at(address);
+      check_owned(offsetof(Memory::Table, owners), pc, reruns);
+      page_in_table(address);
+      check_owned(offsetof(Memory::Page, owners), pc, reruns);
+      load(edx, guest);
+      bytes({0x89, 0x90});                   // mov [rax + word * 4], edx
+      dword((address & (Memory::pageSize - 1)) * 4);
+   }
+
+   // mov rax, page holding the address in ecx. Clobbers edx.
+   void page_of_ecx()
+   {
+      bytes({0x81, 0xf9});                   // cmp ecx, tableSize * pageSize - 1
+      dword(Memory::tableSize * Memory::pageSize - 1);
+      bytes({0x77, 0x0b});                   // ja directory
+      bytes({0x89, 0xc8});                   // mov eax, ecx
+      bytes({0xc1, 0xe8, Memory::pageBits}); // shr eax, 12
+      bytes({0x48, 0x8b, 0x04, 0xc7});       // mov rax, [rdi + rax * 8]
+      bytes({0xeb, 0x19});                   // jmp done
+
+      // directory:
+      table_of_ecx();
+      page_in_table_of_ecx();
+      // done:
+   }
+
+   // mov rax, table holding the address in ecx
+   void table_of_ecx()
+   {
+      bytes({0x89, 0xc8});                   // mov eax, ecx
+      bytes({0xc1, 0xe8, Memory::pageBits + Memory::tableBits}); // shr eax, 22
+      bytes({0x48, 0x8b, 0x44, 0xc5, 0x00}); // mov rax, [rbp + rax * 8]
+   }
+
+   // mov rax, page holding the address in ecx out of the table in rax.
+   // Clobbers edx.
+   void page_in_table_of_ecx()
+   {
+      bytes({0x89, 0xca});                   // mov edx, ecx
+      bytes({0xc1, 0xea, Memory::pageBits}); // shr edx, 12
+      bytes({0x81, 0xe2});                   // and edx, tableSize - 1
+      dword(Memory::tableSize - 1);
+      bytes({0x48, 0x8b, 0x04, 0xd0});       // mov rax, [rax + rdx * 8]
+   }
+
+   // mov eax, word at the address in ecx
+   void load_word()
+   {
+      page_of_ecx();
+      bytes({0x81, 0xe1});                   // and ecx, pageSize - 1
+      dword(Memory::pageSize - 1);
+      bytes({0x8b, 0x04, 0x88});             // mov eax, [rax + rcx * 4]
+   }
+
+   // mov word at the address in ecx, guest. Leaves through an invalidate
+   // exit when the word was compiled. Goes through the directory, since the
+   // table has to be checked along with the page.
+   void store_word(std::uint8_t guest, std::int32_t pc, std::vector<std::size_t>& reruns,
+                   std::vector<std::int32_t>& invalidations)
+   {
+      table_of_ecx();
+      check_owned(offsetof(Memory::Table, owners), pc, reruns);
+      page_in_table_of_ecx();
+      check_owned(offsetof(Memory::Page, owners), pc, reruns);
+      bytes({0x89, 0xce});                   // mov esi, ecx
+      bytes({0x81, 0xe6});                   // and esi, pageSize - 1
+      dword(Memory::pageSize - 1);
+      load(edx, guest);
+      bytes({0x89, 0x14, 0xb0});             // mov [rax + rsi * 4], edx
+      bytes({0x81, 0xf9});                   // cmp ecx, maxMemory - 1
+      dword(maxMemory - 1);
+      bytes({0x77, 0x14});                   // ja next
+      bytes({0x48, 0xb8});                   // mov rax, code map
+      qword(reinterpret_cast<std::uint64_t>(code_map.data()));
+      bytes({0x80, 0x3c, 0x08, 0x00});       // cmp byte [rax + rcx], 0
+      bytes({0x0f, 0x85});                   // jne invalidate
+      invalidations.push_back(size);
+      dword(pc + 1);
+   }
+
+   // Leave the compiled code with the address in eax
+   void exit_indirect()
+   {
+      bytes({0x89, 0x43, pc_offset});        // mov [rbx + R_PC], eax
+      bytes({0x31, 0xc0});                   // xor eax, eax
+      jump(exit_common);
+   }
+
+   // Leave the compiled code with a constant address and status
+   void exit_to(std::int32_t address, Status status)
+   {
+      bytes({0xc7, 0x43, pc_offset});        // mov dword [rbx + R_PC], address
+      dword(address);
+      byte(0xb8);                            // mov eax, status
+      dword(status);
+      jump(exit_common);
+   }
+
+   // jmp rel32 to an offset inside of the buffer
+   void jump(std::size_t target)
+   {
+      byte(0xe9);
+      dword(static_cast<std::int32_t>(target - (size + 4)));
+   }
+
+   // Point the rel32 field at the offset to the target
+   void patch(std::size_t field, std::size_t target)
+   {
+      std::int32_t rel = static_cast<std::int32_t>(target - (field + 4));
+      if (field + 4 <= capacity)
+         std::memcpy(code + field, &rel, 4);
+   }
+
+   // Emit a patchable jump or conditional jump towards the guest address. It
+   // goes straight to the target block if it's compiled already, otherwise
+   // to an exit stub until the block gets compiled.
+   void chain(std::int32_t address, std::initializer_list<std::uint8_t> opcode, std::vector<std::pair<std::size_t, std::int32_t>>& stubs)
+   {
+      bytes(opcode);
+      std::size_t field = size;
+      dword(0);
+
+      if (address >= 0 && address < static_cast<std::int32_t>(maxMemory) && block_at[address])
+         patch(field, static_cast<std::uint8_t*>(block_at[address]) - code);
+      else
+      {
+         stubs.push_back({field, address});
+         if (address >= 0 && address < static_cast<std::int32_t>(maxMemory))
+            pending[address].push_back(field);
+      }
+   }
+
+   // Entry and exit shared by all of the blocks
+   //    Status enter(void* block, std::int32_t* reg, const Memory::Table* const* directory)
+   void emit_trampoline()
+   {
+      bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, rbp, r12-r15
+      bytes({0x48, 0x89, 0xf8});             // mov rax, rdi
+      bytes({0x48, 0x89, 0xf3});             // mov rbx, rsi
+      bytes({0x48, 0x89, 0xd5});             // mov rbp, rdx
+      bytes({0x48, 0x8b, 0x3a});             // mov rdi, [rdx]
+
+      for (std::uint8_t guest = 0; guest < 8; ++guest)
+         bytes({0x44, 0x8b, static_cast<std::uint8_t>(0x43 | guest << 3), static_cast<std::uint8_t>(guest * 4)});
+      bytes({0xff, 0xe0});                   // jmp rax
+
+      exit_common = size;
+      for (std::uint8_t guest = 0; guest < 8; ++guest)
+         bytes({0x44, 0x89, static_cast<std::uint8_t>(0x43 | guest << 3), static_cast<std::uint8_t>(guest * 4)});
+
+      bytes({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b}); // pop r15-r12, rbp, rbx
+      byte(0xc3);                            // ret
+      exit_size = size;
+   }
+
+   // Whether everything emitted so far is inside of the buffer. Throws all
+   // of the compiled code away if not, jumps emitted past the end may have
+   // been registered with the blocks they wait for.
+   bool fits()
+   {
+      if (size <= capacity)
+         return true;
+
+      flush();
+      return false;
+   }
+
+   // Compile the block starting at the address, or return nullptr if it
+   // doesn't fit into the rest of the buffer
+   void* compile(std::uint16_t start)
+   {
+      std::uint8_t* block = code + size;
+      std::vector<std::pair<std::size_t, std::int32_t>> stubs;
+      std::vector<std::int32_t> invalidations;
+      std::vector<std::size_t> reruns;
+
+      std::size_t address = start;
+      bool ended = false;
+
+      for (std::size_t count = 0; count < max_block && address < maxMemory && vm.memory.mapped(address) && !ended;
+           ++count, ++address)
+      {
+         std::uint32_t instr = vm.memory[address];
+         std::int32_t pc = address;
+
+         if (!compilable(instr))
+            break;
+
+         code_map[address] = 1;
+
+         if (stops(instr))
+         {
+            exit_to(pc, halt);
+            ended = true;
+            break;
+         }
+
+         std::uint8_t opcode = instr & 0b111111;
+         bool imm_flag = (instr >> 6) & 0b1;
+
+         // Condition codes overwritten by the next instruction are skipped,
+         // it runs right after this one whether it's compiled or not. It's
+         // marked as compiled even when it isn't, so replacing it with one
+         // that doesn't set them throws this code away.
+         bool live = !(address + 1 < maxMemory && sets_flags(vm.memory[address + 1], address + 1));
+         if (!live)
+            code_map[address + 1] = 1;
+
+         switch (opcode)
+         {
+            // ADD, SUB, MUL, AND, OR, XOR
+            case 1: case 2: case 3: case 6: case 7: case 8:
+            {
+               static constexpr std::uint8_t reg_ops[] = {0, 0x03, 0x2b, 0xaf, 0, 0, 0x23, 0x0b, 0x33};
+               static constexpr std::uint8_t imm_ops[] = {0, 0x05, 0x2d, 0, 0, 0, 0x25, 0x0d, 0x35};
+
+               std::uint8_t dr  = (instr >> 7)  & 0b1111;
+               std::uint8_t sr1 = (instr >> 11) & 0b1111;
+               load(eax, sr1);
+
+               if (imm_flag)
+               {
+                  std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
+                  if (opcode == 3)
+                     bytes({0x69, 0xc0});    // imul eax, eax, imm32
+                  else
+                     byte(imm_ops[opcode]);
+                  dword(imm17);
+               }
+               else
+                  alu(reg_ops[opcode], (instr >> 15) & 0b1111);
+
+               store(dr, eax);
+               if (live) flags();
+               break;
+            }
+            // NOT, NEG
+            case 9: case 10:
+            {
+               std::uint8_t dr = (instr >> 6)  & 0b1111;
+               std::uint8_t sr = (instr >> 10) & 0b1111;
+               load(eax, sr);
+               bytes({0xf7, static_cast<std::uint8_t>(opcode == 9 ? 0xd0 : 0xd8)});
+               store(dr, eax);
+               if (live) flags();
+               break;
+            }
+            // BR
+            case 11:
+            {
+               std::int32_t pc_offset23 = sext((instr >> 9) & 0b11111111111111111111111, 23);
+               std::uint8_t nzp = (instr >> 6) & 0b111;
+               std::int32_t target = pc + pc_offset23 + 1;
+
+               // Jump on the result itself for every condition code of the
+               // branch. Positive results also have to fit into 32 bits,
+               // noCondition doesn't.
+               bytes({0x48, 0x8b, 0x83});    // mov rax, [rbx + cond]
+               dword(cond_offset);
+               bytes({0x48, 0x85, 0xc0});    // test rax, rax
+               if (nzp & static_cast<std::uint8_t>(Flag::FL_N))
+                  chain(target, {0x0f, 0x88}, stubs); // js target
+               if (nzp & static_cast<std::uint8_t>(Flag::FL_Z))
+                  chain(target, {0x0f, 0x84}, stubs); // je target
+               if (nzp & static_cast<std::uint8_t>(Flag::FL_P))
+               {
+                  bytes({0x7e, 0x0c});       // jle next
+                  bytes({0x48, 0x3d});       // cmp rax, INT32_MAX
+                  dword(INT32_MAX);
+                  chain(target, {0x0f, 0x8e}, stubs); // jle target
+               }
+               chain(pc + 1, {0xe9}, stubs);
+               ended = true;
+               break;
+            }
+            // JMP, RET
+            case 12:
+            {
+               std::uint8_t base_r = (instr >> 6) & 0b1111;
+               load(eax, base_r);
+               if (base_r == 15)
+               {
+                  byte(0x05);                // add eax, 1
+                  dword(1);
+               }
+               exit_indirect();
+               ended = true;
+               break;
+            }
+            // JSR, JSRR
+            case 13:
+            {
+               store_imm(R_R15, pc);
+               if (imm_flag)
+               {
+                  load(eax, (instr >> 7) & 0b1111);
+                  exit_indirect();
+               }
+               else
+               {
+                  std::int32_t pc_offset25 = sext((instr >> 7) & 0b1111111111111111111111111, 25);
+                  chain(pc + pc_offset25 + 1, {0xe9}, stubs);
+               }
+               ended = true;
+               break;
+            }
+            // LD, LDI, LEA
+            case 14: case 15: case 17:
+            {
+               std::uint8_t dr = (instr >> 6) & 0b1111;
+               std::int32_t target = pc + sext((instr >> 10) & 0b1111111111111111111111, 22);
+
+               if (opcode != 17 && !in_memory(target))
+               {
+                  exit_to(pc, interpret);
+                  ended = true;
+                  break;
+               }
+
+               if (opcode == 17)
+               {
+                  byte(0xb8);                // mov eax, target
+                  dword(target);
+               }
+               else
+                  load_constant(target);
+
+               if (opcode == 15)
+               {
+                  bytes({0x89, 0xc1});       // mov ecx, eax
+                  load_word();
+               }
+               store(dr, eax);
+               if (live) flags();
+               break;
+            }
+            // LDR
+            case 16:
+            {
+               std::uint8_t dr     = (instr >> 6)  & 0b1111;
+               std::uint8_t base_r = (instr >> 10) & 0b1111;
+               load(ecx, base_r);
+               bytes({0x48, 0x81, 0xc1});    // add rcx, offset
+               dword(sext((instr >> 14) & 0b11111111111111, 14));
+               check_address(pc, reruns);
+               load_word();
+               store(dr, eax);
+               if (live) flags();
+               break;
+            }
+            // ST
+            case 18:
+            {
+               std::uint8_t sr = (instr >> 6) & 0b1111;
+               std::int32_t target = pc + sext((instr >> 10) & 0b1111111111111111111111, 22);
+
+               if (!in_memory(target))
+               {
+                  exit_to(pc, interpret);
+                  ended = true;
+                  break;
+               }
+
+               store_constant(target, sr, pc, reruns);
+
+               if (target < static_cast<std::int32_t>(maxMemory))
+               {
+                  bytes({0x48, 0xb8});       // mov rax, code map + address
+                  qword(reinterpret_cast<std::uint64_t>(code_map.data() + target));
+                  bytes({0x80, 0x38, 0x00}); // cmp byte [rax], 0
+                  bytes({0x0f, 0x85});       // jne invalidate
+                  invalidations.push_back(size);
+                  dword(pc + 1);
+               }
+               break;
+            }
+            // STI, STR
+            case 19: case 20:
+            {
+               std::uint8_t sr = (instr >> 6) & 0b1111;
+
+               if (opcode == 19)
+               {
+                  std::int32_t target = pc + sext((instr >> 10) & 0b1111111111111111111111, 22);
+
+                  if (!in_memory(target))
+                  {
+                     exit_to(pc, interpret);
+                     ended = true;
+                     break;
+                  }
+
+                  load_constant(target);
+                  bytes({0x89, 0xc1});       // mov ecx, eax
+               }
+               else
+               {
+                  load(ecx, (instr >> 10) & 0b1111);
+                  bytes({0x48, 0x81, 0xc1}); // add rcx, offset
+                  dword(sext((instr >> 14) & 0b111111111111111111, 18));
+                  check_address(pc, reruns);
+               }
+               store_word(sr, pc, reruns, invalidations);
+               break;
+            }
+            // Unused opcodes do nothing
+            default:
+               break;
+         }
+      }
+
+      // Block got cut short, continue with the next instruction
+      if (!ended)
+         chain(address, {0xe9}, stubs);
+
+      if (!fits())
+         return nullptr;
+
+      // Exit stubs for the jumps that aren't chained yet
+      for (auto& [field, target] : stubs)
+      {
+         patch(field, size);
+         exit_to(target, next);
+      }
+
+      // Writes into compiled code leave the block so it can be thrown away
+      for (std::size_t field : invalidations)
+      {
+         std::int32_t target;
+         std::memcpy(&target, code + field, 4);
+         patch(field, size);
+         exit_to(target, invalidate);
+      }
+
+      // Faults and first stores into a page leave at the instruction making
+      // them
+      for (std::size_t field : reruns)
+      {
+         std::int32_t target;
+         std::memcpy(&target, code + field, 4);
+         patch(field, size);
+         exit_to(target, interpret);
+      }
+
+      if (!fits())
+         return nullptr;
+
+      block_at[start] = block;
+
+      // Chain the jumps that were waiting for this block
+      if (auto it = pending.find(start); it != pending.end())
+      {
+         for (std::size_t field : it->second)
+            patch(field, block - code);
+         pending.erase(it);
+      }
+      return block;
+   }
+};
+
+#endif // VM_JIT
+
+#endif // JIT_HPP
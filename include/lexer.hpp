@@ -1,51 +1,213 @@
 #ifndef LEXER_HPP
 #define LEXER_HPP
 
+#include "arena.hpp"
 #include "catcher.hpp"
-#include <unordered_set>
+#include "mapped_file.hpp"
+#include "register.hpp"
+#include "token.hpp"
+#include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
+#include <memory>
+#include <string_view>
 
 namespace fs = std::filesystem;
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
-// Keywords used in the language
-inline const std::unordered_set<std::string> keywords
+// Instructions of the language, the value of keyword tokens. Branches keep
+// their condition flags above the mnemonic, in the same order as the
+// instruction does.
+enum Mnemonic : std::uint8_t
 {
-   "ADD"s, "SUB"s, "MUL"s, "DIV"s, "REM"s, "AND"s, "OR"s, "XOR"s, "NOT"s,
-   "NEG"s, "BR"s, "BRn"s, "BRz"s, "BRp"s, "BRzp"s, "BRpz"s, "BRnp"s, "BRpn"s,
-   "BRnz"s, "BRzn"s, "BRnzp"s, "BRnpz"s, "BRznp"s, "BRzpn"s, "BRpnz"s,
-   "BRpzn"s, "JMP"s, "RET"s, "HALT"s, "JSR"s, "JSRR"s, "LD"s, "LDI"s, "LDR"s,
-   "LEA"s, "ST"s, "STI"s, "STR"s
+   M_ADD, M_SUB, M_MUL, M_DIV, M_REM, M_AND, M_OR, M_XOR, M_NOT, M_NEG,
+   M_BR, M_JMP, M_RET, M_JSR, M_JSRR, M_LD, M_LDI, M_LDR, M_LEA, M_ST,
+   M_STI, M_STR, M_HALT, M_SNAP
 };
 
-// Registers used in the language
-inline const std::unordered_set<std::string> regis_words
+// Directives of the language, the value of directive tokens
+enum Directive : std::uint8_t
 {
-   "R0"s, "R1"s, "R2"s, "R3"s, "R4"s, "R5"s, "R6"s, "R7"s, "R8"s, "R9"s,
-   "R10"s, "R11"s, "R12"s, "R13"s, "R14"s, "R15"s
+   D_WORD, D_ORG, D_END, D_INCLUDE
 };
 
-// Directives used in the language
-inline const std::unordered_set<std::string> directives
+// Word with a meaning of its own in the language
+struct Keyword
 {
-   ".WORD"s, ".ORG"s, ".END"s, ".INCLUDE"s
+   std::string_view word;
+   Token::Type type;
+   std::int32_t value;
 };
 
-// Tokens used in the lexer
-struct Token
+// Condition flags of a branch keyword, all of them when it has none
+constexpr std::int32_t branch_flags(std::string_view word)
 {
-   enum class Type : std::uint8_t
+   std::int32_t flags = (word.find('n') != word.npos) | (word.find('z') != word.npos) << 1 |
+                        (word.find('p') != word.npos) << 2;
+   return (flags ? flags : 0b111) << 8;
+}
+
+// Keywords, registers and directives used in the language
+inline constexpr Keyword keyword_list[]
+{
+   {"ADD"sv, Token::Type::keyword, M_ADD}, {"SUB"sv, Token::Type::keyword, M_SUB},
+   {"MUL"sv, Token::Type::keyword, M_MUL}, {"DIV"sv, Token::Type::keyword, M_DIV},
+   {"REM"sv, Token::Type::keyword, M_REM}, {"AND"sv, Token::Type::keyword, M_AND},
+   {"OR"sv,  Token::Type::keyword, M_OR},  {"XOR"sv, Token::Type::keyword, M_XOR},
+   {"NOT"sv, Token::Type::keyword, M_NOT}, {"NEG"sv, Token::Type::keyword, M_NEG},
+
+   #define BRANCH(word) {word, Token::Type::keyword, M_BR | branch_flags(word)}
+   BRANCH("BR"sv),    BRANCH("BRn"sv),   BRANCH("BRz"sv),   BRANCH("BRp"sv),
+   BRANCH("BRzp"sv),  BRANCH("BRpz"sv),  BRANCH("BRnp"sv),  BRANCH("BRpn"sv),
+   BRANCH("BRnz"sv),  BRANCH("BRzn"sv),  BRANCH("BRnzp"sv), BRANCH("BRnpz"sv),
+   BRANCH("BRznp"sv), BRANCH("BRzpn"sv), BRANCH("BRpnz"sv), BRANCH("BRpzn"sv),
+   #undef BRANCH
+
+   {"JMP"sv, Token::Type::keyword, M_JMP}, {"RET"sv,  Token::Type::keyword, M_RET},
+   {"JSR"sv, Token::Type::keyword, M_JSR}, {"JSRR"sv, Token::Type::keyword, M_JSRR},
+   {"LD"sv,  Token::Type::keyword, M_LD},  {"LDI"sv,  Token::Type::keyword, M_LDI},
+   {"LDR"sv, Token::Type::keyword, M_LDR}, {"LEA"sv,  Token::Type::keyword, M_LEA},
+   {"ST"sv,  Token::Type::keyword, M_ST},  {"STI"sv,  Token::Type::keyword, M_STI},
+   {"STR"sv, Token::Type::keyword, M_STR}, {"HALT"sv, Token::Type::keyword, M_HALT},
+   {"SNAP"sv, Token::Type::keyword, M_SNAP},
+
+   {"R0"sv,  Token::Type::regis, R_R0},  {"R1"sv,  Token::Type::regis, R_R1},
+   {"R2"sv,  Token::Type::regis, R_R2},  {"R3"sv,  Token::Type::regis, R_R3},
+   {"R4"sv,  Token::Type::regis, R_R4},  {"R5"sv,  Token::Type::regis, R_R5},
+   {"R6"sv,  Token::Type::regis, R_R6},  {"R7"sv,  Token::Type::regis, R_R7},
+   {"R8"sv,  Token::Type::regis, R_R8},  {"R9"sv,  Token::Type::regis, R_R9},
+   {"R10"sv, Token::Type::regis, R_R10}, {"R11"sv, Token::Type::regis, R_R11},
+   {"R12"sv, Token::Type::regis, R_R12}, {"R13"sv, Token::Type::regis, R_R13},
+   {"R14"sv, Token::Type::regis, R_R14}, {"R15"sv, Token::Type::regis, R_R15},
+
+   {".WORD"sv, Token::Type::directive, D_WORD}, {".ORG"sv,     Token::Type::directive, D_ORG},
+   {".END"sv,  Token::Type::directive, D_END},  {".INCLUDE"sv, Token::Type::directive, D_INCLUDE}
+};
+
+// Perfect hash of the keyword list. The seed is searched for at compile time
+// until every keyword lands in a slot of its own, so a lookup is a single
+// hash and a single comparison.
+class KeywordTable
+{
+public:
+   static constexpr std::size_t size = 256;
+
+   // Constructors
+   constexpr KeywordTable()
    {
-      keyword, identifier, directive, regis, number, string, label, comma,
-      colon, eof
-   };
+      for (seed = 1;; ++seed)
+      {
+         for (auto& slot : slots)
+            slot = nullptr;
+
+         bool collision = false;
+         for (const auto& keyword : keyword_list)
+         {
+            auto& slot = slots[hash(keyword.word, seed)];
+            collision = collision || slot;
+            slot = &keyword;
+         }
 
-   Type type;
-   std::string lexeme;
+         if (!collision)
+            return;
+      }
+   }
+
+   // Keyword matching the word, or nullptr when it's an identifier
+   constexpr const Keyword* find(std::string_view word) const
+   {
+      const Keyword* keyword = slots[hash(word, seed)];
+      return (keyword && keyword->word == word ? keyword : nullptr);
+   }
+
+private:
+   const Keyword* slots[size] {};
+   std::uint32_t seed = 0;
+
+   static constexpr std::size_t hash(std::string_view word, std::uint32_t seed)
+   {
+      std::uint32_t h = 2166136261u ^ seed;
+      for (char ch : word)
+         h = (h ^ static_cast<unsigned char>(ch)) * 16777619u;
+      return (h ^ (h >> 16)) % size;
+   }
+};
+
+inline constexpr KeywordTable keyword_table;
+
+// Number at the start of a text, as the lexer reads it
+struct NumberLexeme
+{
+   std::size_t length = 0;
+   std::uint64_t value = 0;  // Without the sign, above 32 bits when it doesn't fit
+   bool negative = false;
+   int base = 10;
+   char invalid = 0;         // Letter or digit outside of the base that ended it, if any
+
+   // Value of the number as the 32 bits of a token
+   std::int32_t bits() const
+   {
+      return static_cast<std::int32_t>(static_cast<std::uint32_t>(negative ? 0 - value : value));
+   }
 };
 
+// Read the decimal, binary or hexadecimal number the text starts with. It's
+// optionally negative and can have ' separators.
+inline NumberLexeme scan_number(std::string_view text)
+{
+   NumberLexeme number;
+   std::size_t end = 0;
+
+   number.negative = (!text.empty() && text[end] == '-');
+   if (number.negative)
+      ++end;
+
+   auto prefix = [&](char ch)
+   {
+      return end + 1 < text.size() && text[end] == '0' && std::tolower(static_cast<unsigned char>(text[end + 1])) == ch;
+   };
+
+   if (prefix('b'))
+   {
+      number.base = 2;
+      end += 2;
+   }
+   else if (prefix('x'))
+   {
+      number.base = 16;
+      end += 2;
+   }
+
+   for (; end < text.size(); ++end)
+   {
+      char ch = text[end];
+      int digit;
+
+      if (ch == '\'')
+         continue;
+
+      if (ch >= '0' && ch <= '9')
+         digit = ch - '0';
+      else if (number.base == 16 && std::isalpha(static_cast<unsigned char>(ch)))
+         digit = std::tolower(static_cast<unsigned char>(ch)) - 'a' + 10;
+      else
+         break;
+
+      if ((number.base == 2 && digit > 1) || (number.base == 16 && digit > 15))
+      {
+         number.invalid = ch;
+         break;
+      }
+
+      number.value = std::min<std::uint64_t>(number.value * number.base + digit, 0x1'0000'0000);
+   }
+
+   number.length = end;
+   return number;
+}
+
 // Lexer tokenizes a string into tokens used by the parser, but in our case
 // the tokens are first put into a translator to translate labels into memory
 // addresses and only parsed and placed into the VM's memory afterwards
@@ -55,164 +217,223 @@ public:
    // Constructors
    Lexer(Catcher& catcher, const fs::path& path)
       : catcher(catcher), path(path) {}
+   Lexer(Catcher& catcher, const fs::path& path, std::string_view text)
+      : catcher(catcher), path(path), text(text), loaded(true) {}
    ~Lexer() = default;
 
-   // Tokenize the file into tokens
-   std::vector<Token>& tokenize()
+   // Map the file into memory, unless the lexer was given its text. Returns
+   // false when the file can't be opened.
+   bool open()
    {
-      std::ifstream file(path);
+      if (loaded)
+         return true;
 
-      if (!file.is_open())
+      file = std::make_shared<MappedFile>(path);
+      loaded = true;
+
+      if (!file->is_open())
       {
          catcher.insert("Failed to open file '"s + path.string() + "'."s);
-         return tokens;
+         return false;
       }
+      text = {reinterpret_cast<const char*>(file->data()), file->size()};
+      return true;
+   }
 
-      std::string line;
-      while (std::getline(file, line))
-      {
-         for (size_t index = 0; index < line.size(); ++index)
-         {
-            if (index >= line.size()) break;
-
-            char ch = line.at(index);
-
-            if (ch == ' ' || ch == '\t' || ch == '\r')
-               continue;
-            else if (ch == '\n' || ch == ';')
-               break;
-            else if (ch == ',')
-               tokens.push_back({Token::Type::comma, ","s});
-            else if (ch == ':')
-               tokens.push_back({Token::Type::colon, ":"s});
-            else if (ch == '"')
-            {
-               std::string string;
-
-               if (index + 1 < line.size())
-                  ++index;
-
-               for (; index < line.size(); ++index)
-               {
-                  ch = line.at(index);
-                  if (ch == '"')
-                     break;
-
-                  string.push_back(ch);
-               }
-
-               if (index == line.size())
-               {
-                  catcher.insert("Unterminated string '"s + string + "'."s);
-                  return tokens;
-               }
-               tokens.push_back({Token::Type::string, string});
-            }
-            else if (std::isalpha(ch) || ch == '_' || ch == '.')
-            {
-               std::string keyword;
-
-               if (ch == '.')
-               {
-                  keyword += ch;
-                  index++;
-               }
-
-               for (; index < line.size(); ++index)
-               {
-                  ch = line.at(index);
-                  
-                  if ((!std::isalnum(ch) && ch != '_') || std::isspace(ch))
-                  {
-                     --index;
-                     break;
-                  }
-                  keyword.push_back(ch);
-               }
-
-               if (directives.count(keyword))
-                  tokens.push_back({Token::Type::directive, keyword});
-               else if (keywords.count(keyword))
-                  tokens.push_back({Token::Type::keyword, keyword});
-               else if (regis_words.count(keyword))
-                  tokens.push_back({Token::Type::regis, keyword});
-               else
-                  tokens.push_back({Token::Type::identifier, keyword});
-            }
-            else if (std::isdigit(ch) || (ch == '-' && index + 1 < line.size() && std::isdigit(line.at(index + 1))))
-            {
-               std::string number;
-               bool hex = false;
-               bool bin = false;
-
-               if (ch == '-')
-               {
-                  number = '-';
-                  ++index;
-                  ch = line.at(index);
-               }
-
-               // Binary
-               if (ch == '0' && index + 1 < line.size() && std::tolower(line.at(index + 1)) == 'b')
-               {
-                  bin = true;
-                  index += 2;
-               }
-
-               // Hexadecimal
-               if (ch == '0' && index + 1 < line.size() && std::tolower(line.at(index + 1)) == 'x')
-               {
-                  hex = true;
-                  index += 2;
-               }
-
-               for (; index < line.size(); ++index)
-               {
-                  ch = line.at(index);
-                  
-                  if (ch == '\'')
-                     continue;
-
-                  if (bin && ch != '0' && ch != '1' && std::isdigit(ch))
-                  {
-                     catcher.insert("Invalid binary format, expected '0' or '1', but got '"s + ch + "' instead."s);
-                     return tokens;
-                  }
-
-                  if (hex && (!std::isdigit(ch) && (!std::isalpha(ch) || std::tolower(ch) > 'f' || std::tolower(ch) < 'a')))
-                  {
-                     catcher.insert("Invalid hex format, expected '0' to 'F', but got '"s + ch + "' instead."s);
-                     return tokens;
-                  }
-
-                  if ((!hex && !std::isdigit(ch)) || (!hex && std::isalpha(ch)) || std::isspace(ch))
-                  {
-                     --index;
-                     break;
-                  }
-                  number.push_back(ch);
-               }
-
-               if ((bin || hex) && number.size() == 0)
-                  number += '0';
-               
-               tokens.push_back({Token::Type::number, (!hex && !bin ? number : 
-                  std::to_string(std::stoi(number, nullptr, (bin ? 2 : 16))))});
-            }
-            else
-               catcher.insert("Unexpected character '"s + ch + "' while tokenizing."s);
-         }
-      }
-      file.close();
+   // Tokenize the file into tokens. The file is mapped into memory instead
+   // of being read and tokens only keep the offset of their lexeme in it,
+   // names are interned once. Lexers given the text up front point into
+   // that text instead.
+   std::vector<Token>& tokenize()
+   {
+      if (!open())
+         return tokens;
+
+      // Sources rarely have more than a token for every four bytes. Reserved
+      // pages that are never written don't count towards the used memory,
+      // so this only saves the copies of a growing vector.
+      tokens.reserve(text.size() / 4);
+
+      while (scan());
 
-      tokens.push_back({Token::Type::eof, ""s});
+      push(Token::Type::eof, index, index);
       return tokens;
    }
 
+   // Next token of the file, for going through it without keeping all of
+   // its tokens. Returns the EOF token once the file ends, call open first.
+   const Token& next()
+   {
+      tokens.clear();
+
+      while (!stopped && tokens.empty())
+         stopped = !scan();
+
+      if (tokens.empty())
+         push(Token::Type::eof, index, index);
+      return tokens.back();
+   }
+
+   // Mapped source file the tokens point into, empty for lexers given the
+   // text up front. Tokens that outlive the lexer have to keep it alive.
+   std::shared_ptr<const MappedFile> source() const
+   {
+      return file;
+   }
+
+   // Text the offsets of the tokens are relative to
+   std::string_view get_text() const
+   {
+      return text;
+   }
+
+   // Names of the identifiers and strings, by the ids the tokens carry
+   Interner& get_names()
+   {
+      return names;
+   }
+
 private:
    Catcher& catcher;
    fs::path path;
+   std::shared_ptr<MappedFile> file;
+   std::string_view text;
+   bool loaded = false;
    std::vector<Token> tokens;
+   Interner names;
+   std::size_t index = 0;
+   bool stopped = false;
+   std::uint32_t line = 1;
+
+   // Move past the next character, comment or token. Returns false once
+   // the text ends or an error stops the lexer.
+   bool scan()
+   {
+      if (index >= text.size())
+         return false;
+
+      char ch = text[index];
+
+      if (ch == ' ' || ch == '\t' || ch == '\r')
+         ++index;
+      else if (ch == '\n')
+      {
+         ++index;
+         ++line;
+      }
+      else if (ch == ';')
+      {
+         while (index < text.size() && text[index] != '\n')
+            ++index;
+      }
+      else if (ch == ',')
+         push(Token::Type::comma, index, index + 1);
+      else if (ch == ':')
+         push(Token::Type::colon, index, index + 1);
+      else if (ch == '"')
+      {
+         if (!tokenize_string())
+            return false;
+      }
+      else if (std::isalpha(static_cast<unsigned char>(ch)) || ch == '_' || ch == '.')
+         tokenize_word();
+      else if (is_digit(ch) || (ch == '-' && index + 1 < text.size() && is_digit(text[index + 1])))
+      {
+         if (!tokenize_number())
+            return false;
+      }
+      else
+      {
+         catcher.insert("Unexpected character '"s + ch + "' while tokenizing at line "s + std::to_string(line) + "."s);
+         ++index;
+      }
+      return true;
+   }
+
+   static bool is_digit(char ch)
+   {
+      return ch >= '0' && ch <= '9';
+   }
+
+   static bool is_word(char ch)
+   {
+      return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+   }
+
+   // Add a token for the text between the offsets and move past it
+   void push(Token::Type type, std::size_t start, std::size_t end, std::int32_t value = 0)
+   {
+      std::size_t length = std::min<std::size_t>(end - start, UINT16_MAX);
+      tokens.push_back({static_cast<std::uint32_t>(start), value, static_cast<std::uint16_t>(length), type});
+      index = end;
+   }
+
+   // Add a token whose value is the id of its text among the names
+   void push_name(Token::Type type, std::size_t start, std::size_t end)
+   {
+      push(type, start, end, static_cast<std::int32_t>(names.intern(text.substr(start, end - start))));
+   }
+
+   // String between quotes on a single line, the lexeme leaves the quotes out
+   bool tokenize_string()
+   {
+      std::size_t start = index + 1, end = start;
+
+      while (end < text.size() && text[end] != '"' && text[end] != '\n')
+         ++end;
+
+      if (end == text.size() || text[end] != '"')
+      {
+         catcher.insert("Unterminated string '"s + std::string(text.substr(start, end - start)) + "'."s);
+         return false;
+      }
+
+      push_name(Token::Type::string, start, end);
+      ++index;
+      return true;
+   }
+
+   // Keywords, registers, directives and identifiers
+   void tokenize_word()
+   {
+      std::size_t end = index + (text[index] == '.');
+
+      while (end < text.size() && is_word(text[end]))
+         ++end;
+
+      if (const Keyword* keyword = keyword_table.find(text.substr(index, end - index)))
+         push(keyword->type, index, end, keyword->value);
+      else
+         push_name(Token::Type::identifier, index, end);
+   }
+
+   // Decimal, binary or hexadecimal number, optionally negative and with
+   // ' separators. The value is converted right away.
+   bool tokenize_number()
+   {
+      NumberLexeme number = scan_number(text.substr(index));
+
+      if (number.invalid && number.base == 2)
+      {
+         catcher.insert("Invalid binary format, expected '0' or '1', but got '"s + number.invalid + "' instead."s);
+         return false;
+      }
+
+      if (number.invalid)
+      {
+         catcher.insert("Invalid hex format, expected '0' to 'F', but got '"s + number.invalid + "' instead."s);
+         return false;
+      }
+
+      if (number.value > 0xFFFF'FFFF)
+      {
+         catcher.insert("Number '"s + std::string(text.substr(index, number.length)) + "' does not fit into 32 bits."s);
+         return false;
+      }
+
+      push(Token::Type::number, index, index + number.length, number.bits());
+      return true;
+   }
 };
 
 #endif // LEXER_HPP
@@ -0,0 +1,182 @@
+#ifndef LINKER_HPP
+#define LINKER_HPP
+
+#include "assembler.hpp"
+#include "object.hpp"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Assemble the file into an object module instead of the memory of a
+// virtual machine. Labels the file doesn't define become symbols for the
+// linker to resolve and the labels of the file itself get exported.
+inline bool assemble_object(Catcher& catcher, ObjectModule& module, const fs::path& path,
+                            TokenCache* cache = nullptr, std::size_t threads = 1)
+{
+   auto vm = std::make_unique<VmContext>();
+   vm->cache = cache;
+   vm->threads = threads;
+   vm->object = &module;
+
+   module = {};
+   module.name = path.string();
+
+   if (!assemble(catcher, *vm, path))
+      return false;
+
+   module.entry = vm->pcStart;
+
+   for (std::size_t index = 0; index < vm->segments.size(); ++index)
+   {
+      const Segment& segment = vm->segments.at(index);
+      module.segments.push_back({segment.start, segment.size, static_cast<std::uint32_t>(module.words.size()), index == 0});
+      module.words.resize(module.words.size() + segment.size);
+      vm->memory.read(segment.start, module.words.data() + module.words.size() - segment.size, segment.size);
+   }
+
+   module.targets.clear();
+   return true;
+}
+
+// Place the modules into the memory of the virtual machine. Segments of an
+// .ORG stay where they are, the relocatable segments are laid out one after
+// another from the entry point of the first module, around the others. The
+// entry point of the first module becomes the entry point of the program.
+inline bool link(Catcher& catcher, VmContext& vm, const std::vector<ObjectModule>& modules)
+{
+   if (modules.empty())
+   {
+      catcher.insert("Nothing to link."s);
+      return false;
+   }
+
+   struct Placement
+   {
+      std::uint32_t start;
+      std::uint32_t end;
+      std::size_t module;
+   };
+
+   // Ranges taken by the segments that can't move
+   std::vector<Placement> fixed;
+   for (std::size_t index = 0; index < modules.size(); ++index)
+      for (const auto& segment : modules.at(index).segments)
+         if (!segment.relocatable && segment.size > 0)
+            fixed.push_back({segment.address, segment.address + segment.size, index});
+
+   std::sort(fixed.begin(), fixed.end(), [](const auto& a, const auto& b) { return a.start < b.start; });
+
+   // Lay the relocatable segments out in the first gap they fit in. Modules
+   // without one don't move at all.
+   std::vector<std::int64_t> deltas (modules.size(), 0);
+   std::vector<Placement> placed = fixed;
+   std::uint32_t cursor = modules.front().entry;
+
+   for (std::size_t index = 0; index < modules.size(); ++index)
+   {
+      for (const auto& segment : modules.at(index).segments)
+      {
+         if (!segment.relocatable || segment.size == 0)
+            continue;
+
+         for (const auto& range : fixed)
+            if (cursor < range.end && range.start < cursor + segment.size)
+               cursor = range.end;
+
+         if (cursor + segment.size > maxMemory)
+         {
+            catcher.insert("Module '"s + modules.at(index).name + "' does not fit into memory."s);
+            return false;
+         }
+
+         deltas.at(index) = std::int64_t(cursor) - segment.address;
+         placed.push_back({cursor, cursor + segment.size, index});
+         cursor += segment.size;
+      }
+   }
+
+   // Segments of different modules must not share an address
+   std::sort(placed.begin(), placed.end(), [](const auto& a, const auto& b) { return a.start < b.start; });
+   for (std::size_t index = 1; index < placed.size(); ++index)
+   {
+      const Placement& previous = placed.at(index - 1);
+      const Placement& current = placed.at(index);
+
+      if (current.start < previous.end && current.module != previous.module)
+      {
+         catcher.insert("Segments of '"s + modules.at(previous.module).name + "' and '"s + modules.at(current.module).name +
+                        "' overlap at address "s + std::to_string(current.start) + "."s);
+         return false;
+      }
+   }
+
+   // Addresses of the exported symbols once every module is in place
+   std::unordered_map<std::string_view, std::uint32_t> globals;
+   std::unordered_map<std::string_view, std::size_t> owners;
+
+   for (std::size_t index = 0; index < modules.size(); ++index)
+   {
+      for (const auto& symbol : modules.at(index).symbols)
+      {
+         if (!symbol.defined)
+            continue;
+
+         auto [owner, inserted] = owners.try_emplace(symbol.name, index);
+         if (!inserted)
+         {
+            catcher.insert("Symbol '"s + symbol.name + "' is defined in both '"s + modules.at(owner->second).name +
+                           "' and '"s + modules.at(index).name + "'."s);
+            continue;
+         }
+         globals[symbol.name] = symbol.address + (symbol.relocatable ? deltas.at(index) : 0);
+      }
+   }
+
+   if (catcher.any_errors())
+      return false;
+
+   // Copy the words and fix up the fields that refer to labels
+   for (std::size_t index = 0; index < modules.size(); ++index)
+   {
+      const ObjectModule& module = modules.at(index);
+      std::int64_t delta = deltas.at(index);
+
+      for (const auto& segment : module.segments)
+      {
+         std::uint32_t address = segment.address + (segment.relocatable ? delta : 0);
+         vm.memory.write(address, module.words.data() + segment.first, segment.size);
+         vm.segments.push_back({static_cast<std::uint16_t>(address), segment.size});
+      }
+
+      for (const auto& relocation : module.relocations)
+      {
+         std::int64_t target = relocation.target + (relocation.relocatable ? delta : 0);
+
+         if (relocation.symbol >= 0)
+         {
+            const std::string& name = module.symbols.at(relocation.symbol).name;
+            auto global = globals.find(name);
+
+            if (global == globals.end())
+            {
+               catcher.insert("Undefined symbol '"s + name + "' in '"s + module.name + "'."s);
+               continue;
+            }
+            target = global->second;
+         }
+
+         std::int64_t site = relocation.address + (module.segments.at(relocation.segment).relocatable ? delta : 0);
+         patch_field(vm.memory, site, relocation.kind, target);
+      }
+   }
+
+   const ObjectModule& main = modules.front();
+   bool moved = !main.segments.empty() && main.segments.front().relocatable && main.segments.front().size > 0;
+   vm.pcStart = main.entry + (moved ? deltas.front() : 0);
+
+   return !catcher.any_errors();
+}
+
+#endif // LINKER_HPP
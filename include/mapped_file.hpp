@@ -0,0 +1,99 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. The file is mapped into memory where the
+// platform supports it and read into a buffer everywhere else.
+class MappedFile
+{
+public:
+   // Constructors
+   explicit MappedFile(const std::filesystem::path& path)
+   {
+#ifdef VM_MMAP
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+         return;
+
+      struct stat info;
+      if (fstat(fd, &info) == 0)
+      {
+         opened = true;
+
+         // Empty files can't be mapped, they are left without any bytes
+         if (info.st_size > 0)
+         {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (mapped == MAP_FAILED)
+               opened = false;
+            else
+            {
+               bytes = static_cast<const std::uint8_t*>(mapped);
+               length = info.st_size;
+            }
+         }
+      }
+      close(fd);
+#else
+      std::ifstream file (path, std::ios::binary);
+      if (!file.is_open())
+         return;
+
+      buffer.assign(std::istreambuf_iterator<char>(file), {});
+      bytes = reinterpret_cast<const std::uint8_t*>(buffer.data());
+      length = buffer.size();
+      opened = true;
+#endif
+   }
+
+   ~MappedFile()
+   {
+#ifdef VM_MMAP
+      if (bytes)
+         munmap(const_cast<std::uint8_t*>(bytes), length);
+#endif
+   }
+
+   MappedFile(const MappedFile&) = delete;
+   MappedFile& operator=(const MappedFile&) = delete;
+
+   // Whether the file could be opened
+   bool is_open() const
+   {
+      return opened;
+   }
+
+   const std::uint8_t* data() const
+   {
+      return bytes;
+   }
+
+   std::size_t size() const
+   {
+      return length;
+   }
+
+private:
+   const std::uint8_t* bytes = nullptr;
+   std::size_t length = 0;
+   bool opened = false;
+
+#ifndef VM_MMAP
+   std::vector<char> buffer;
+#endif
+};
+
+#endif // MAPPED_FILE_HPP
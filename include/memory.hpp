@@ -2,28 +2,333 @@
 #define MEMORY_HPP
 
 #include <cstdint>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <stdexcept>
+#include <string>
 
-// Max memory of the virtual machine
+// Addresses programs are placed at and run from. The assembler, executables
+// and engines address code with 16 bits, loads and stores reach the whole
+// address space.
 inline constexpr std::size_t maxMemory = 1 << 16; // 65536
-inline std::array<std::int32_t, maxMemory> memory;
 
-// Write the value to the address
-inline void writeMemory(std::uint16_t address, std::int32_t value)
+// Words of the memory, the whole 32 bit address space
+inline constexpr std::uint64_t addressSpace = std::uint64_t(1) << 32;
+
+// Whether the guest address lies inside of the memory
+inline bool in_memory(std::int64_t address)
 {
-   memory.at(address) = value;
+   return static_cast<std::uint64_t>(address) < addressSpace;
 }
 
-// Read a value from the memory
-inline std::int32_t readMemory(std::uint16_t address)
+// Address a base register plus an offset points to. Registers hold addresses
+// as unsigned numbers, so only the offset can take it out of the memory.
+inline std::int64_t base_address(std::int32_t base, std::int32_t offset)
 {
-   return memory.at(address);
+   return static_cast<std::int64_t>(static_cast<std::uint32_t>(base)) + offset;
 }
 
 // Sign extend a number to 32 bits
 inline std::int32_t sext(std::int32_t x, std::uint16_t bitCount)
 {
-   return ((x >> (bitCount - 1)) & 1 ? x | (0xffff << bitCount) : x);
+   return ((x >> (bitCount - 1)) & 1 ? x | static_cast<std::int32_t>(~0u << bitCount) : x);
+}
+
+// Instructions that stop every engine. SNAP is a HALT with the lowest bit
+// above the opcode set, it only stops them until the executor took a snapshot.
+inline constexpr std::uint32_t haltInstruction = 63, snapInstruction = 63 | 1 << 6;
+
+inline bool stops(std::uint32_t instr)
+{
+   return instr == haltInstruction || instr == snapInstruction;
 }
 
+// Sparse memory covering the whole address space. Addresses go through a two
+// level page table, the top 10 bits pick a table out of the directory, the
+// next 10 a page out of the table and the last 12 the word inside the page.
+//
+// Pages are allocated the first time they're written to. Until then they're
+// backed by a shared page of zeros, and tables that have no pages yet by a
+// shared table pointing at it, so loads walk the page table without checking
+// anything. Stores remember the last page they went to, consecutive stores
+// into the same page skip the walk and the allocation checks.
+//
+// Forked memories share their tables copy-on-write, and through them their
+// pages. Tables count the memories they belong to and pages the tables they
+// belong to, both are only written to when they have a single owner. Storing
+// into a shared page copies its table first, which shares the page between
+// the tables, and then the page.
+class Memory
+{
+public:
+   static constexpr unsigned pageBits = 12, tableBits = 10;
+   static constexpr std::size_t pageSize = std::size_t(1) << pageBits;   // Words in a page
+   static constexpr std::size_t tableSize = std::size_t(1) << tableBits; // Pages in a table
+
+   struct Page
+   {
+      std::array<std::int32_t, pageSize> words;
+
+      // Tables the page belongs to, never 1 for the page of zeros
+      std::atomic<std::uint32_t> owners;
+   };
+
+   struct Table
+   {
+      std::array<Page*, tableSize> pages;
+
+      // Memories the table belongs to, never 1 for the table of zeros
+      std::atomic<std::uint32_t> owners;
+   };
+
+   // Constructors
+   Memory()
+   {
+      directory.fill(&zeroTable);
+   }
+
+   Memory(const Memory&) = delete;
+   Memory& operator=(const Memory&) = delete;
+
+   ~Memory()
+   {
+      clear();
+   }
+
+   // Value of the word at the address, words never written to read as zero
+   std::int32_t load(std::uint32_t address) const
+   {
+      return page(address).words[address & (pageSize - 1)];
+   }
+
+   std::int32_t operator[](std::uint32_t address) const
+   {
+      return load(address);
+   }
+
+   // Word at the address, its page gets allocated or copied if it isn't
+   // owned by this memory alone yet
+   std::int32_t& word(std::uint32_t address)
+   {
+      if ((address >> pageBits) != last)
+         touch(address);
+      return recent->words[address & (pageSize - 1)];
+   }
+
+   void store(std::uint32_t address, std::int32_t value)
+   {
+      word(address) = value;
+   }
+
+   // Same as load and word, but throw when the address is outside of the
+   // memory
+   std::int32_t at(std::size_t address) const
+   {
+      if (address >= addressSpace)
+         throw std::out_of_range("Memory address " + std::to_string(address) + " is out of range.");
+      return load(address);
+   }
+
+   std::int32_t& at(std::size_t address)
+   {
+      if (address >= addressSpace)
+         throw std::out_of_range("Memory address " + std::to_string(address) + " is out of range.");
+      return word(address);
+   }
+
+   // Copy the words into the memory from the address on
+   void write(std::uint32_t address, const std::int32_t* words, std::size_t count)
+   {
+      while (count > 0)
+      {
+         std::size_t offset = address & (pageSize - 1), chunk = std::min(count, pageSize - offset);
+         std::copy_n(words, chunk, touch(address).words.begin() + offset);
+         address += chunk, words += chunk, count -= chunk;
+      }
+   }
+
+   // Copy the words of the memory from the address on out of it
+   void read(std::uint32_t address, std::int32_t* words, std::size_t count) const
+   {
+      while (count > 0)
+      {
+         std::size_t offset = address & (pageSize - 1), chunk = std::min(count, pageSize - offset);
+         std::copy_n(page(address).words.begin() + offset, chunk, words);
+         address += chunk, words += chunk, count -= chunk;
+      }
+   }
+
+   // Drop every page, the whole memory reads as zero again
+   void clear()
+   {
+      for (Table*& table : directory)
+      {
+         if (table != &zeroTable)
+            release(table);
+         table = &zeroTable;
+      }
+      count = 0;
+      last = ~0u;
+      recent = nullptr;
+   }
+
+   // Turn this memory into a fork of the parent sharing all of its tables.
+   // Only the directory is copied, both memories copy a shared table and
+   // page the first time they store into it. The parent must not be running
+   // or be forked on another thread at the same time.
+   void share(Memory& parent)
+   {
+      clear();
+
+      directory = parent.directory;
+      for (Table* table : directory)
+         if (table != &zeroTable)
+            table->owners.fetch_add(1, std::memory_order_relaxed);
+
+      // The last page the parent stored into is shared now as well
+      count = parent.count;
+      parent.last = ~0u;
+      parent.recent = nullptr;
+   }
+
+   // Whether the page holding the address was allocated
+   bool mapped(std::uint32_t address) const
+   {
+      return &page(address) != &zeroPage;
+   }
+
+   // Whether the page holding the address belongs to this memory alone, so
+   // stores go straight into it
+   bool owned(std::uint32_t address) const
+   {
+      return table(address).owners.load(std::memory_order_acquire) == 1 &&
+             page(address).owners.load(std::memory_order_acquire) == 1;
+   }
+
+   // Number of allocated pages, shared ones included
+   std::size_t resident() const
+   {
+      return count;
+   }
+
+   // Number of allocated pages shared with other memories
+   std::size_t shared() const
+   {
+      std::size_t pages = 0;
+      for_each_page([&](std::uint32_t address, const Page&)
+      {
+         pages += !owned(address);
+      });
+      return pages;
+   }
+
+   // Visit every allocated page along with the address of its first word,
+   // in the order of the addresses
+   template <typename Visit>
+   void for_each_page(Visit visit) const
+   {
+      for (std::size_t index = 0; index < tableSize; ++index)
+      {
+         if (directory[index] == &zeroTable)
+            continue;
+
+         for (std::size_t entry = 0; entry < tableSize; ++entry)
+            if (directory[index]->pages[entry] != &zeroPage)
+               visit(static_cast<std::uint32_t>((index << tableBits | entry) << pageBits), *directory[index]->pages[entry]);
+      }
+   }
+
+   // Page holding the address, the shared page of zeros for addresses never
+   // written to
+   const Page& page(std::uint32_t address) const
+   {
+      return *table(address).pages[(address >> pageBits) & (tableSize - 1)];
+   }
+
+   // Table holding the page of the address, the shared table of zeros for
+   // addresses far from any written to
+   const Table& table(std::uint32_t address) const
+   {
+      return *directory[address >> (pageBits + tableBits)];
+   }
+
+   // Start of the directory, for the code the JIT compiles
+   const Table* const* root() const
+   {
+      return directory.data();
+   }
+
+private:
+   // Never written to, stores allocate a page of their own instead
+   static inline Page zeroPage {};
+   static inline Table zeroTable {[]
+   {
+      std::array<Page*, tableSize> pages;
+      pages.fill(&zeroPage);
+      return pages;
+   }(), 0};
+
+   std::array<Table*, tableSize> directory;
+   std::size_t count = 0;
+
+   // Page the last store went to, by its number
+   std::uint32_t last = ~0u;
+   Page* recent = nullptr;
+
+   // Drop a page of a table, the last one to drop it frees it
+   static void release(Page* page)
+   {
+      if (page->owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
+         delete page;
+   }
+
+   // Drop a table of a memory, along with its pages once it's the last one
+   static void release(Table* table)
+   {
+      if (table->owners.fetch_sub(1, std::memory_order_acq_rel) != 1)
+         return;
+
+      for (Page* page : table->pages)
+         if (page != &zeroPage)
+            release(page);
+      delete table;
+   }
+
+   // Page holding the address, allocated along with its table or copied out
+   // of the memories sharing them if needed
+   Page& touch(std::uint32_t address)
+   {
+      Table*& table = directory[address >> (pageBits + tableBits)];
+      if (table == &zeroTable)
+         table = new Table {zeroTable.pages, 1};
+      else if (table->owners.load(std::memory_order_acquire) != 1)
+      {
+         Table* shared = table;
+         table = new Table {shared->pages, 1};
+         for (Page* page : table->pages)
+            if (page != &zeroPage)
+               page->owners.fetch_add(1, std::memory_order_relaxed);
+         release(shared);
+      }
+
+      Page*& entry = table->pages[(address >> pageBits) & (tableSize - 1)];
+      if (entry == &zeroPage)
+      {
+         entry = new Page {{}, 1};
+         ++count;
+      }
+      else if (entry->owners.load(std::memory_order_acquire) != 1)
+      {
+         Page* shared = entry;
+         entry = new Page {shared->words, 1};
+         release(shared);
+      }
+
+      last = address >> pageBits;
+      recent = entry;
+      return *entry;
+   }
+};
+
 #endif // MEMORY_HPP
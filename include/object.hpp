@@ -0,0 +1,343 @@
+#ifndef OBJECT_HPP
+#define OBJECT_HPP
+
+#include "catcher.hpp"
+#include "mapped_file.hpp"
+#include "memory.hpp"
+#include "register.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Field of an instruction or a word that refers to a label. Every kind is
+// the field one of the parser functions encodes a label operand into.
+enum class RelocationKind : std::uint8_t
+{
+   imm17,  // Immediate of the arithmetic instructions, the address itself
+   br23,   // PC offset of BR, relative to the next instruction
+   jsr25,  // PC offset of JSR, relative to the next instruction
+   ld22,   // PC offset of LD, LDI, LEA, ST and STI, relative to the instruction
+   ldr18,  // Offset of LDR and STR, relative to the instruction
+   word    // Whole word of .WORD, the address itself
+};
+
+// Position of a relocation kind inside the word and what it is relative to
+struct RelocationField
+{
+   std::uint32_t shift;
+   std::uint32_t mask;
+   bool relative;
+   std::int32_t bias;
+};
+
+inline constexpr RelocationField relocation_fields[]
+{
+   {15, 0x1ffff,    false, 0},
+   {9,  0x7fffff,   true,  1},
+   {7,  0x1ffffff,  true,  1},
+   {10, 0x3fffff,   true,  0},
+   {14, 0x3ffff,    true,  0},
+   {0,  0xffffffff, false, 0}
+};
+
+// Point the field of the word at the site to the target address
+inline void patch_field(Memory& memory, std::size_t site, RelocationKind kind, std::int64_t target)
+{
+   const RelocationField& field = relocation_fields[std::size_t(kind)];
+   std::int64_t value = field.relative ? target - (std::int64_t(site) + field.bias) : target;
+
+   std::uint32_t word = memory.at(site);
+   word &= ~(field.mask << field.shift);
+   word |= (static_cast<std::uint32_t>(value) & field.mask) << field.shift;
+   memory.at(site) = word;
+}
+
+// Words the parser placed in a single segment. The segment before the first
+// .ORG is relocatable and gets placed by the linker, segments of an .ORG
+// stay at their address.
+struct ObjectSegment
+{
+   std::uint32_t address;
+   std::uint32_t size;         // In words
+   std::uint32_t first;        // Index of its first word in the module
+   std::uint32_t relocatable;
+};
+
+// Label exported by a module, or used by it without being defined there
+struct ObjectSymbol
+{
+   std::string name;
+   std::uint32_t address = 0;
+   bool defined = false;
+   bool relocatable = false;
+};
+
+// Word of a module whose field has to be fixed up once the layout is known.
+// Refers either to an undefined symbol of the module or, when the symbol is
+// negative, to a label of the module at the target address.
+struct Relocation
+{
+   std::uint32_t address;
+   std::uint32_t target;
+   std::int32_t symbol;
+   std::uint16_t segment;
+   RelocationKind kind;
+   bool relocatable;    // Whether the target moves along with the module
+};
+
+// What a label token of the translated stream refers to
+struct LabelTarget
+{
+   std::int32_t symbol;
+   bool relocatable;
+};
+
+// Separately assembled module. Addresses are the ones the assembler gave
+// the words, the linker moves the relocatable ones and fixes up the fields
+// that refer to labels.
+struct ObjectModule
+{
+   std::string name;
+   std::uint16_t entry = defaultPcStart;
+   std::vector<ObjectSegment> segments;
+   std::vector<std::int32_t> words;
+   std::vector<ObjectSymbol> symbols;
+   std::vector<Relocation> relocations;
+
+   // Targets of the label tokens by their position in the translated stream,
+   // only used while the module is assembled
+   std::unordered_map<std::size_t, LabelTarget> targets;
+
+   // Symbol of a label the module uses but doesn't define
+   std::int32_t import_symbol(std::string_view label)
+   {
+      auto [it, inserted] = lookup.try_emplace(std::string(label), symbols.size());
+
+      if (inserted)
+         symbols.push_back({std::string(label)});
+      return static_cast<std::int32_t>(it->second);
+   }
+
+   // Make a label of the module visible to the other modules
+   void export_symbol(std::string_view label, std::uint32_t address, bool relocatable)
+   {
+      auto [it, inserted] = lookup.try_emplace(std::string(label), symbols.size());
+
+      if (inserted)
+         symbols.push_back({std::string(label)});
+      symbols.at(it->second) = {std::string(label), address, true, relocatable};
+   }
+
+private:
+   std::unordered_map<std::string, std::size_t> lookup;
+};
+
+// Layout of an .obj module, all fields in the byte order of the host:
+//    header         - magic, version, entry point and the table sizes
+//    segment table  - address, size, first word and flags of every segment
+//    symbol table   - name, address and flags of every symbol
+//    relocations    - every word that has to be fixed up
+//    words          - raw 32-bit words of all segments, one after another
+//    names          - names of the symbols, one after another
+inline constexpr char objMagic[4] = {'O', 'B', 'J', '3'};
+inline constexpr std::uint16_t objVersion = 1;
+
+struct ObjHeader
+{
+   char magic[4];
+   std::uint16_t version;
+   std::uint16_t entry;
+   std::uint32_t segment_count;
+   std::uint32_t symbol_count;
+   std::uint32_t relocation_count;
+   std::uint32_t word_count;
+   std::uint32_t names_size;
+};
+
+struct ObjSymbol
+{
+   std::uint32_t name;   // Offset into the names
+   std::uint32_t length;
+   std::uint32_t address;
+   std::uint8_t defined;
+   std::uint8_t relocatable;
+   std::uint16_t padding;
+};
+
+struct ObjRelocation
+{
+   std::uint32_t address;
+   std::uint32_t target;
+   std::int32_t symbol;
+   std::uint16_t segment;
+   std::uint8_t kind;
+   std::uint8_t relocatable;
+};
+
+static_assert(sizeof(ObjHeader) == 28 && sizeof(ObjectSegment) == 16);
+static_assert(sizeof(ObjSymbol) == 16 && sizeof(ObjRelocation) == 16);
+
+// Write the module into an object file
+inline bool write_object(Catcher& catcher, const ObjectModule& module, const std::filesystem::path& path)
+{
+   std::vector<ObjSymbol> symbols;
+   std::vector<ObjRelocation> relocations;
+   std::string names;
+
+   for (const auto& symbol : module.symbols)
+   {
+      symbols.push_back({static_cast<std::uint32_t>(names.size()), static_cast<std::uint32_t>(symbol.name.size()),
+                         symbol.address, symbol.defined, symbol.relocatable, 0});
+      names += symbol.name;
+   }
+
+   for (const auto& relocation : module.relocations)
+      relocations.push_back({relocation.address, relocation.target, relocation.symbol, relocation.segment,
+                             static_cast<std::uint8_t>(relocation.kind), relocation.relocatable});
+
+   std::ofstream file (path, std::ios::binary | std::ios::trunc);
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to create object file '"s + path.string() + "'."s);
+      return false;
+   }
+
+   ObjHeader header {};
+   std::memcpy(header.magic, objMagic, sizeof(objMagic));
+   header.version = objVersion;
+   header.entry = module.entry;
+   header.segment_count = module.segments.size();
+   header.symbol_count = symbols.size();
+   header.relocation_count = relocations.size();
+   header.word_count = module.words.size();
+   header.names_size = names.size();
+
+   file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+   file.write(reinterpret_cast<const char*>(module.segments.data()), module.segments.size() * sizeof(ObjectSegment));
+   file.write(reinterpret_cast<const char*>(symbols.data()), symbols.size() * sizeof(ObjSymbol));
+   file.write(reinterpret_cast<const char*>(relocations.data()), relocations.size() * sizeof(ObjRelocation));
+   file.write(reinterpret_cast<const char*>(module.words.data()), module.words.size() * sizeof(std::int32_t));
+   file.write(names.data(), names.size());
+
+   if (!file)
+   {
+      catcher.insert("Failed to write object file '"s + path.string() + "'."s);
+      return false;
+   }
+   return true;
+}
+
+// Map the object file and read the module out of it
+inline bool load_object(Catcher& catcher, ObjectModule& module, const std::filesystem::path& path)
+{
+   MappedFile file (path);
+
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to open object file '"s + path.string() + "'."s);
+      return false;
+   }
+
+   ObjHeader header;
+   if (file.size() < sizeof(header))
+   {
+      catcher.insert("File '"s + path.string() + "' is too small to be an object file."s);
+      return false;
+   }
+   std::memcpy(&header, file.data(), sizeof(header));
+
+   if (std::memcmp(header.magic, objMagic, sizeof(objMagic)) != 0)
+   {
+      catcher.insert("File '"s + path.string() + "' is not an object file."s);
+      return false;
+   }
+
+   if (header.version != objVersion)
+   {
+      catcher.insert("Object file '"s + path.string() + "' has version " + std::to_string(header.version) +
+                     ", expected version "s + std::to_string(objVersion) + "."s);
+      return false;
+   }
+
+   std::uint64_t size = sizeof(header) + std::uint64_t(header.segment_count) * sizeof(ObjectSegment) +
+                        std::uint64_t(header.symbol_count) * sizeof(ObjSymbol) +
+                        std::uint64_t(header.relocation_count) * sizeof(ObjRelocation) +
+                        std::uint64_t(header.word_count) * sizeof(std::int32_t) + header.names_size;
+   if (size != file.size())
+   {
+      catcher.insert("Object file '"s + path.string() + "' is truncated or has trailing data."s);
+      return false;
+   }
+
+   const std::uint8_t* data = file.data() + sizeof(header);
+   auto read = [&data](void* destination, std::size_t bytes)
+   {
+      std::memcpy(destination, data, bytes);
+      data += bytes;
+   };
+
+   std::vector<ObjSymbol> symbols (header.symbol_count);
+   std::vector<ObjRelocation> relocations (header.relocation_count);
+
+   module = {};
+   module.name = path.string();
+   module.entry = header.entry;
+   module.segments.resize(header.segment_count);
+   module.words.resize(header.word_count);
+
+   read(module.segments.data(), module.segments.size() * sizeof(ObjectSegment));
+   read(symbols.data(), symbols.size() * sizeof(ObjSymbol));
+   read(relocations.data(), relocations.size() * sizeof(ObjRelocation));
+   read(module.words.data(), module.words.size() * sizeof(std::int32_t));
+   std::string_view names (reinterpret_cast<const char*>(data), header.names_size);
+
+   for (const auto& segment : module.segments)
+   {
+      if (std::uint64_t(segment.first) + segment.size > module.words.size() ||
+          std::uint64_t(segment.address) + segment.size > maxMemory)
+      {
+         catcher.insert("Object file '"s + path.string() + "' has an invalid segment."s);
+         return false;
+      }
+   }
+
+   for (const auto& symbol : symbols)
+   {
+      if (std::uint64_t(symbol.name) + symbol.length > names.size())
+      {
+         catcher.insert("Object file '"s + path.string() + "' has an invalid symbol."s);
+         return false;
+      }
+
+      module.symbols.push_back({std::string(names.substr(symbol.name, symbol.length)), symbol.address,
+                                symbol.defined != 0, symbol.relocatable != 0});
+   }
+
+   for (const auto& relocation : relocations)
+   {
+      bool valid = relocation.segment < module.segments.size() && relocation.kind <= std::uint8_t(RelocationKind::word) &&
+                   relocation.symbol < std::int32_t(module.symbols.size());
+
+      if (valid)
+      {
+         const auto& segment = module.segments.at(relocation.segment);
+         valid = relocation.address >= segment.address && relocation.address - segment.address < segment.size;
+      }
+
+      if (!valid)
+      {
+         catcher.insert("Object file '"s + path.string() + "' has an invalid relocation."s);
+         return false;
+      }
+
+      module.relocations.push_back({relocation.address, relocation.target, relocation.symbol, relocation.segment,
+                                    static_cast<RelocationKind>(relocation.kind), relocation.relocatable != 0});
+   }
+   return true;
+}
+
+#endif // OBJECT_HPP
@@ -1,11 +1,22 @@
 #ifndef OPCODES_HPP
 #define OPCODES_HPP
 
-#include "memory.hpp"
-#include "register.hpp"
+#include "context.hpp"
 #include <cstdint>
 #include <cstdio>
 
+// Register numbers come out of 4 bit fields, so the registers are accessed
+// without any checks. Addresses of loads and stores are checked against the
+// memory and the ones outside of it raise a fault.
+
+// Raise a fault for the access made by the current instruction. The program
+// counter ends up past the last address code runs from once the executor moves
+// it on.
+inline void opcode_fault(VmContext& vm, Fault kind, std::int64_t address)
+{
+   vm.reg[R_PC] = vm.raise_fault(kind, vm.reg[R_PC], address) - 1;
+}
+
 // ADD DR, SR1, SR2
 // 0-5    6        7-10 11-14 15-18
 // 000001 imm_flag DR   SR1   SR2
@@ -16,7 +27,7 @@
 //
 // Both registers get added together and result is stored in DR, condition
 // codes are set based on the result.
-inline void opcode_add(std::uint32_t instr)
+inline void opcode_add(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -25,14 +36,14 @@ inline void opcode_add(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) + imm17;
+      vm.reg[dr] = vm.reg[sr1] + imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) + reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] + vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // SUB DR, SR1, SR2
@@ -45,7 +56,7 @@ inline void opcode_add(std::uint32_t instr)
 //
 // SR1 gets subtracted by SR2/imm17 and result is stored in DR, condition
 // codes are set based on the result.
-inline void opcode_sub(std::uint32_t instr)
+inline void opcode_sub(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -54,14 +65,14 @@ inline void opcode_sub(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) - imm17;
+      vm.reg[dr] = vm.reg[sr1] - imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) - reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] - vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // MUL DR, SR1, SR2
@@ -74,7 +85,7 @@ inline void opcode_sub(std::uint32_t instr)
 //
 // Both registers get multiplied together and result is stored in DR, condition
 // codes are set based on the result.
-inline void opcode_mul(std::uint32_t instr)
+inline void opcode_mul(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -83,14 +94,14 @@ inline void opcode_mul(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) * imm17;
+      vm.reg[dr] = vm.reg[sr1] * imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) * reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] * vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // DIV DR, SR1, SR2
@@ -103,7 +114,7 @@ inline void opcode_mul(std::uint32_t instr)
 //
 // SR1 gets divided by SR2/imm17 and result is stored in DR, condition
 // codes are set based on the result.
-inline void opcode_div(std::uint32_t instr)
+inline void opcode_div(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -112,14 +123,14 @@ inline void opcode_div(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = (imm17 == 0 ? 0 : reg.at(sr1) / imm17);
+      vm.reg[dr] = (imm17 == 0 ? 0 : vm.reg[sr1] / imm17);
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = (reg.at(sr2) == 0 ? 0 : reg.at(sr1) / reg.at(sr2));
+      vm.reg[dr] = (vm.reg[sr2] == 0 ? 0 : vm.reg[sr1] / vm.reg[sr2]);
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // REM DR, SR1, SR2
@@ -132,7 +143,7 @@ inline void opcode_div(std::uint32_t instr)
 //
 // SR1 gets divided by SR2/imm17 and the remainder is stored in DR, condition
 // codes are set based on the result.
-inline void opcode_rem(std::uint32_t instr)
+inline void opcode_rem(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -141,14 +152,14 @@ inline void opcode_rem(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = (imm17 == 0 ? 0 : reg.at(sr1) % imm17);
+      vm.reg[dr] = (imm17 == 0 ? 0 : vm.reg[sr1] % imm17);
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = (reg.at(sr2) == 0 ? 0 : reg.at(sr1) % reg.at(sr2));
+      vm.reg[dr] = (vm.reg[sr2] == 0 ? 0 : vm.reg[sr1] % vm.reg[sr2]);
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // AND DR, SR1, SR2
@@ -161,7 +172,7 @@ inline void opcode_rem(std::uint32_t instr)
 //
 // Perform a bitwise and operation on SR1 and SR2/imm17 and store it in DR,
 // condition codes are set based on the result.
-inline void opcode_and(std::uint32_t instr)
+inline void opcode_and(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -170,14 +181,14 @@ inline void opcode_and(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) & imm17;
+      vm.reg[dr] = vm.reg[sr1] & imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) & reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] & vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // OR DR, SR1, SR2
@@ -190,7 +201,7 @@ inline void opcode_and(std::uint32_t instr)
 //
 // Perform a bitwise or operation on SR1 and SR2/imm17 and store it in DR,
 // condition codes are set based on the result.
-inline void opcode_or(std::uint32_t instr)
+inline void opcode_or(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -199,14 +210,14 @@ inline void opcode_or(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) | imm17;
+      vm.reg[dr] = vm.reg[sr1] | imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) | reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] | vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // XOR DR, SR1, SR2
@@ -219,7 +230,7 @@ inline void opcode_or(std::uint32_t instr)
 //
 // Perform a bitwise xor operation on SR1 and SR2/imm17 and store it in DR,
 // condition codes are set based on the result.
-inline void opcode_xor(std::uint32_t instr)
+inline void opcode_xor(VmContext& vm, std::uint32_t instr)
 {
    bool imm_flag    = (instr >> 6)  & 0b1;
    std::uint8_t dr  = (instr >> 7)  & 0b1111;
@@ -228,14 +239,14 @@ inline void opcode_xor(std::uint32_t instr)
    if (imm_flag)
    {
       std::int32_t imm17 = sext((instr >> 15) & 0b11111111111111111, 17);
-      reg.at(dr) = reg.at(sr1) ^ imm17;
+      vm.reg[dr] = vm.reg[sr1] ^ imm17;
    }
    else
    {
       std::uint8_t sr2 = (instr >> 15) & 0b1111;
-      reg.at(dr) = reg.at(sr1) ^ reg.at(sr2);
+      vm.reg[dr] = vm.reg[sr1] ^ vm.reg[sr2];
    }
-   update_flags(dr);
+   vm.update_flags(dr);
 }
 
 // NOT DR, SR
@@ -244,12 +255,12 @@ inline void opcode_xor(std::uint32_t instr)
 //
 // Perform a bitwise not operation on SR and store the result in DR, condition
 // codes are set based on result.
-inline void opcode_not(std::uint32_t instr)
+inline void opcode_not(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr = (instr >> 6)  & 0b1111;
    std::uint8_t sr = (instr >> 10) & 0b1111;
-   reg.at(dr) = ~reg.at(sr);
-   update_flags(dr);
+   vm.reg[dr] = ~vm.reg[sr];
+   vm.update_flags(dr);
 }
 
 // NEG DR, SR
@@ -257,13 +268,13 @@ inline void opcode_not(std::uint32_t instr)
 // 001010 DR  SR
 //
 // Negate the value in SR and store the result in DR, condition codes are set
-// based on result.
-inline void opcode_neg(std::uint32_t instr)
+// based on result. Negated as unsigned, the most negative value stays itself.
+inline void opcode_neg(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr = (instr >> 6)  & 0b1111;
    std::uint8_t sr = (instr >> 10) & 0b1111;
-   reg.at(dr) = -reg.at(sr);
-   update_flags(dr);
+   vm.reg[dr] = static_cast<std::int32_t>(0u - static_cast<std::uint32_t>(vm.reg[sr]));
+   vm.update_flags(dr);
 }
 
 // BR(nzp) LABEL
@@ -272,11 +283,11 @@ inline void opcode_neg(std::uint32_t instr)
 //
 // Branch relative to the current program counter or to the given label if the
 // given condition code is true.
-inline void opcode_br(std::uint32_t instr)
+inline void opcode_br(VmContext& vm, std::uint32_t instr)
 {
    std::int32_t pc_offset23 = sext((instr >> 9) & 0b11111111111111111111111, 23);
    std::uint8_t nzp         = (instr >> 6) & 0b111;
-   reg.at(R_PC) += ((nzp & reg.at(R_COND)) ? pc_offset23 : 0);
+   vm.reg[R_PC] += (branch_taken(nzp, vm.cond) ? pc_offset23 : 0);
 }
 
 // JMP BaseR
@@ -288,10 +299,10 @@ inline void opcode_br(std::uint32_t instr)
 // 001100 1111
 //
 // Unconditionally jump to the value stored in BaseR register.
-inline void opcode_jmp(std::uint32_t instr)
+inline void opcode_jmp(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t base_r = (instr >> 6) & 0b1111;
-   reg.at(R_PC) = (base_r == 15 ? reg.at(base_r) : reg.at(base_r) - 1);
+   vm.reg[R_PC] = (base_r == 15 ? vm.reg[base_r] : vm.reg[base_r] - 1);
 }
 
 // JSR LABEL
@@ -304,20 +315,20 @@ inline void opcode_jmp(std::uint32_t instr)
 //
 // Firstly save program counter in register 15 and then unconditionally jump
 // to the memory address of the label or address contained in the register.
-inline void opcode_jsr(std::uint32_t instr)
+inline void opcode_jsr(VmContext& vm, std::uint32_t instr)
 {
    bool jsrr_flag = (instr >> 6) & 0b1;
-   reg.at(R_R15) = reg.at(R_PC);
+   vm.reg[R_R15] = vm.reg[R_PC];
 
    if (jsrr_flag)
    {
       std::uint8_t base_r = (instr >> 7) & 0b1111;
-      reg.at(R_PC) = reg.at(base_r) - 1;
+      vm.reg[R_PC] = vm.reg[base_r] - 1;
    }
    else
    {
       std::int32_t pc_offset25 = sext((instr >> 7) & 0b1111111111111111111111111, 25);
-      reg.at(R_PC) += pc_offset25;
+      vm.reg[R_PC] += pc_offset25;
    }
 }
 
@@ -327,12 +338,17 @@ inline void opcode_jsr(std::uint32_t instr)
 //
 // Load contents of memory at the address into DR and set condition codes based
 // on the loaded value.
-inline void opcode_ld(std::uint32_t instr)
+inline void opcode_ld(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr          = (instr >> 6) & 0b1111;
    std::int32_t pc_offset22 = sext((instr >> 10) & 0b1111111111111111111111, 22);
-   reg.at(dr) = readMemory(reg.at(R_PC) + pc_offset22);
-   update_flags(dr);
+   std::int32_t address     = vm.reg[R_PC] + pc_offset22;
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::load, address);
+
+   vm.reg[dr] = vm.memory[address];
+   vm.update_flags(dr);
 }
 
 // LDI DR, LABEL
@@ -341,12 +357,18 @@ inline void opcode_ld(std::uint32_t instr)
 //
 // Load the address inside memory, place contents into DR and set and set
 // condition codes based on loaded value.
-inline void opcode_ldi(std::uint32_t instr)
+inline void opcode_ldi(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr          = (instr >> 6) & 0b1111;
    std::int32_t pc_offset22 = sext((instr >> 10) & 0b1111111111111111111111, 22);
-   reg.at(dr) = readMemory(readMemory(reg.at(R_PC) + pc_offset22));
-   update_flags(dr);
+   std::int32_t address     = vm.reg[R_PC] + pc_offset22;
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::load, address);
+
+   std::uint32_t pointer = vm.memory[address];
+   vm.reg[dr] = vm.memory[pointer];
+   vm.update_flags(dr);
 }
 
 // LDR DR, BaseR, offset18
@@ -355,14 +377,19 @@ inline void opcode_ldi(std::uint32_t instr)
 //
 // Load the contents of memory at the address into DR and set condition codes
 // based on the loaded value.
-inline void opcode_ldr(std::uint32_t instr)
+inline void opcode_ldr(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr          = (instr >> 6)  & 0b1111;
    std::uint8_t base_r      = (instr >> 10) & 0b1111;
    std::int32_t pc_offset18 = sext((instr >> 14) & 0b11111111111111, 14);
 
-   reg.at(dr) = readMemory(reg.at(base_r) + pc_offset18);
-   update_flags(dr);
+   std::int64_t address     = base_address(vm.reg[base_r], pc_offset18);
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::load, address);
+
+   vm.reg[dr] = vm.memory[address];
+   vm.update_flags(dr);
 }
 
 // LEA DR, LABEL
@@ -371,12 +398,12 @@ inline void opcode_ldr(std::uint32_t instr)
 //
 // Load the address of the label into DR and set condition codes based on the
 // loaded value.
-inline void opcode_lea(std::uint32_t instr)
+inline void opcode_lea(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t dr          = (instr >> 6) & 0b1111;
    std::int32_t pc_offset22 = sext((instr >> 10) & 0b1111111111111111111111, 22);
-   reg.at(dr) = reg.at(R_PC) + pc_offset22;
-   update_flags(dr);
+   vm.reg[dr] = vm.reg[R_PC] + pc_offset22;
+   vm.update_flags(dr);
 }
 
 // ST SR, LABEL
@@ -384,11 +411,16 @@ inline void opcode_lea(std::uint32_t instr)
 // 010010 SR  PCoffset22
 //
 // Store the value in the register in the memory address of the label.
-inline void opcode_st(std::uint32_t instr)
+inline void opcode_st(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t sr          = (instr >> 6) & 0b1111;
    std::int32_t pc_offset22 = sext((instr >> 10) & 0b1111111111111111111111, 22);
-   writeMemory(reg.at(R_PC) + pc_offset22, reg.at(sr));
+   std::int32_t address     = vm.reg[R_PC] + pc_offset22;
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::store, address);
+
+   vm.memory.store(address, vm.reg[sr]);
 }
 
 // STI SR, LABEL
@@ -396,11 +428,17 @@ inline void opcode_st(std::uint32_t instr)
 // 010011 SR  PCoffset22
 //
 // Store the value in the register in the memory addres specified in the label.
-inline void opcode_sti(std::uint32_t instr)
+inline void opcode_sti(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t sr          = (instr >> 6) & 0b1111;
    std::int32_t pc_offset22 = sext((instr >> 10) & 0b1111111111111111111111, 22);
-   writeMemory(readMemory(reg.at(R_PC) + pc_offset22), reg.at(sr));
+   std::int32_t address     = vm.reg[R_PC] + pc_offset22;
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::load, address);
+
+   std::uint32_t pointer = vm.memory[address];
+   vm.memory.store(pointer, vm.reg[sr]);
 }
 
 // STR SR, BaseR, offset18
@@ -409,12 +447,17 @@ inline void opcode_sti(std::uint32_t instr)
 //
 // Store the value in the SR register in the memory address found in the BaseR
 // register plus the offset.
-inline void opcode_str(std::uint32_t instr)
+inline void opcode_str(VmContext& vm, std::uint32_t instr)
 {
    std::uint8_t sr       = (instr >> 6)  & 0b1111;
    std::uint8_t base_r   = (instr >> 10) & 0b1111;
    std::int32_t offset18 = sext((instr >> 14) & 0b111111111111111111, 18);
-   writeMemory(reg.at(base_r) + offset18, reg.at(sr));
+   std::int64_t address  = base_address(vm.reg[base_r], offset18);
+
+   if (!in_memory(address))
+      return opcode_fault(vm, Fault::store, address);
+
+   vm.memory.store(address, vm.reg[sr]);
 }
 
 #endif // OPCODES_HPP
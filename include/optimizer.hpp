@@ -0,0 +1,1141 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include "context.hpp"
+#include "lexer.hpp"
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Optimizations of the optimizer, in the order they are reported
+enum class Pass : std::uint8_t
+{
+   folding,     // Constant operands made immediates, branches decided
+   peephole,    // Instructions that cancel out or only set the flags again
+   threading,   // Branches to branches sent to where they end up
+   dead_stores, // Results that are never read
+   dead_code,   // Instructions that can never be reached
+   count
+};
+
+inline constexpr const char* pass_names[] {"folding", "peephole", "threading", "dead stores", "dead code"};
+
+// Summary of the optimizations applied to a program by the assembler
+struct OptimizerReport
+{
+   struct Change
+   {
+      Pass pass;
+      std::uint16_t address;  // Before any instruction was removed
+      bool removed;           // Or rewritten in place
+   };
+
+   std::size_t before = 0;
+   std::size_t after = 0;
+   std::vector<Change> changes;
+   std::string skipped;  // Why the program was left as it is, if it was
+
+   // Display the changes grouped by the optimization that made them
+   void display() const
+   {
+      if (!skipped.empty())
+      {
+         std::cout << "Not optimized, " << skipped << ".\n";
+         return;
+      }
+
+      std::cout << "Optimized " << before << " instruction" << (before == 1 ? "" : "s") << " into " << after;
+      std::cout << " with " << changes.size() << " change" << (changes.size() == 1 ? "" : "s") << ".\n";
+
+      for (std::size_t pass = 0; pass < std::size_t(Pass::count); ++pass)
+      {
+         std::size_t removed = 0, rewritten = 0;
+
+         for (const auto& change : changes)
+            if (std::size_t(change.pass) == pass)
+               ++(change.removed ? removed : rewritten);
+
+         if (removed + rewritten == 0)
+            continue;
+
+         std::cout << "   " << std::left << std::setw(12) << pass_names[pass] << std::right;
+         std::cout << removed << " removed, " << rewritten << " rewritten:" << std::hex;
+
+         for (const auto& change : changes)
+            if (std::size_t(change.pass) == pass)
+               std::cout << " 0x" << change.address << (change.removed ? "-" : "");
+         std::cout << std::dec << std::endl;
+      }
+   }
+};
+
+// Optimizer rewrites the translated tokens of a whole program before they
+// are parsed. The instructions are read back from the tokens, split into
+// basic blocks and analysed with the registers all known to be zero at the
+// entry, as the executor leaves them. Removed instructions shift everything
+// after them in their segment, so every label is moved along with the code
+// it points to. Code addresses are expected to only ever come from labels,
+// programs that compute them out of plain numbers or write over their own
+// code can't be optimized.
+class Optimizer
+{
+public:
+   // Constructors
+   Optimizer(VmContext& vm, const std::vector<Token>& tokens, OptimizerReport& report)
+      : vm(vm), tokens(tokens), report(report) {}
+   ~Optimizer() = default;
+
+   // Optimized copy of the tokens, or the tokens as they are when the
+   // program can't be optimized
+   std::vector<Token> optimize()
+   {
+      report = {};
+
+      if (vm.object)
+         report.skipped = "object modules are linked as they are"s;
+      else if (!parse())
+         report.skipped = "the program has errors for the parser to report"s;
+      else if (!separate())
+         report.skipped = "segments of the program overlap"s;
+
+      if (!report.skipped.empty())
+         return tokens;
+
+      for (const auto& instr : items)
+         report.before += (instr.kind == Instruction::Kind::code);
+
+      for (std::size_t round = 0; round < maxRounds; ++round)
+      {
+         build_blocks();
+         propagate();
+
+         if (!remove_unreachable() && !fold() && !eliminate())
+            break;
+      }
+
+      for (const auto& instr : items)
+         report.after += (instr.kind == Instruction::Kind::code && !instr.removed);
+      return emit();
+   }
+
+private:
+   // Instruction or data word of the program along with the tokens it was
+   // parsed from. Operands relative to the program counter are kept as the
+   // address they point to, whether they were given as a label or not.
+   struct Instruction
+   {
+      enum class Kind : std::uint8_t { code, word, end };
+
+      Kind kind = Kind::code;
+      std::size_t first = 0;    // Tokens of the instruction
+      std::size_t last = 0;
+      std::size_t segment = 0;
+      std::int32_t address = 0;
+      std::uint8_t op = 0;      // Mnemonic
+      std::uint8_t nzp = 0;     // Condition flags of branches
+      std::uint8_t dr = 0;      // Destination, or the source of stores
+      std::uint8_t sr1 = 0;     // First source or base register
+      std::uint8_t sr2 = 0;     // Second source register
+      bool immediate = false;   // Last operand is a number or a label
+      bool label = false;       // The operand came from a label
+      std::int32_t value = 0;   // Immediate, offset or address the operand points to
+      bool removed = false;
+   };
+
+   // Words placed from an .ORG, or from the start, on. Its instructions are
+   // the ones in [first, last).
+   struct Segment
+   {
+      std::int32_t start;
+      std::size_t first;
+      std::size_t last;
+   };
+
+   // Instruction of a segment, or the end of the segment when the item is
+   // its last
+   struct Location
+   {
+      std::size_t segment = npos;
+      std::size_t item = 0;
+   };
+
+   // Run of instructions only ever entered at the first and left at the
+   // last. Edges lead to a block, somewhere the optimizer can't follow or to
+   // a HALT.
+   struct Block
+   {
+      std::vector<std::size_t> items;
+      std::int64_t fall = none;
+      std::int64_t taken = none;
+      bool takes = false;  // The edges the condition codes allow
+      bool falls = false;
+   };
+
+   // What is known about the registers at some point of the program. The
+   // condition codes are the values they could have, a bit for none of
+   // them and one for each of N, Z and P.
+   struct State
+   {
+      std::array<std::int32_t, 16> values {};
+      std::uint16_t known = 0;
+      std::uint8_t flags = 0;
+      bool reached = false;
+   };
+
+   static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+   static constexpr std::int64_t none = -3, halt = -2, escape = -1;
+   static constexpr std::size_t maxRounds = 32;
+
+   static constexpr std::uint8_t registersCount = 16;
+
+   // Registers read or written, the condition codes being the bit above them
+   static constexpr std::uint32_t flagsBit = 1u << 16;
+   static constexpr std::uint32_t registersLive = 0xffff;
+   static constexpr std::uint32_t allLive = registersLive | flagsBit;
+
+   VmContext& vm;
+   const std::vector<Token>& tokens;
+   OptimizerReport& report;
+
+   std::vector<Instruction> items;
+   std::vector<Segment> segments;
+   std::vector<std::int32_t> at;  // Item at every address
+   std::vector<Block> blocks;
+   std::vector<std::int64_t> block_of;
+   std::vector<State> states;     // At the start of every block
+   std::vector<std::uint8_t> entries;  // Blocks entered from anywhere
+   std::size_t cursor = 0;
+
+   static bool binary(std::uint8_t op)
+   {
+      return op <= M_XOR;
+   }
+
+   static bool unary(std::uint8_t op)
+   {
+      return op == M_NOT || op == M_NEG;
+   }
+
+   static bool commutative(std::uint8_t op)
+   {
+      return op == M_ADD || op == M_MUL || op == M_AND || op == M_OR || op == M_XOR;
+   }
+
+   static bool relative(std::uint8_t op)
+   {
+      return op == M_BR || op == M_JSR || op == M_LD || op == M_LDI || op == M_LEA || op == M_ST || op == M_STI;
+   }
+
+   // Instructions without any effect besides their register and flags
+   static bool pure(std::uint8_t op)
+   {
+      return binary(op) || unary(op) || op == M_LD || op == M_LDI || op == M_LDR || op == M_LEA;
+   }
+
+   static bool terminator(std::uint8_t op)
+   {
+      return op == M_BR || op == M_JMP || op == M_RET || op == M_JSR || op == M_JSRR || op == M_HALT;
+   }
+
+   // Sign extend the lowest bits of the value, as the field of an
+   // instruction holding it would
+   static std::int32_t field(std::int32_t value, int bits)
+   {
+      return static_cast<std::int32_t>(static_cast<std::uint32_t>(value) << (32 - bits)) >> (32 - bits);
+   }
+
+   static bool fits_imm17(std::int64_t value)
+   {
+      return value >= -(1 << 16) && value < (1 << 16);
+   }
+
+   // Bit of the condition codes set from the value
+   static std::uint8_t flag_of(std::int32_t value)
+   {
+      return (value == 0 ? 0b0100 : value < 0 ? 0b0010 : 0b1000);
+   }
+
+   // Condition codes of the set that make the branch go to its target
+   static std::uint8_t taken_by(std::uint8_t flags, std::uint8_t nzp)
+   {
+      return flags & ((nzp & 0b111) << 1);
+   }
+
+   // Whether the instruction only sets the condition codes from its
+   // destination, like ADD R1, R1, 0
+   static bool identity(const Instruction& instr)
+   {
+      if (!binary(instr.op) || instr.dr != instr.sr1)
+         return false;
+      if (!instr.immediate)
+         return (instr.op == M_AND || instr.op == M_OR) && instr.sr2 == instr.dr;
+      if (instr.label)
+         return false;
+
+      switch (instr.op)
+      {
+         case M_ADD: case M_SUB: case M_OR: case M_XOR: return instr.value == 0;
+         case M_MUL: case M_DIV:                        return instr.value == 1;
+         case M_AND:                                    return instr.value == -1;
+         default:                                       return false;
+      }
+   }
+
+   static std::uint32_t uses(const Instruction& instr)
+   {
+      if (binary(instr.op))
+         return (1u << instr.sr1) | (instr.immediate ? 0 : 1u << instr.sr2);
+
+      switch (instr.op)
+      {
+         case M_NOT: case M_NEG: case M_LDR: case M_JMP: case M_JSRR: return 1u << instr.sr1;
+         case M_BR:                                                   return flagsBit;
+         case M_RET:                                                  return 1u << R_R15;
+         case M_ST: case M_STI:                                       return 1u << instr.dr;
+         case M_STR:                                                  return (1u << instr.dr) | (1u << instr.sr1);
+         case M_SNAP:                                                 return allLive;
+         default:                                                     return 0;
+      }
+   }
+
+   static std::uint32_t defs(const Instruction& instr)
+   {
+      if (pure(instr.op))
+         return (1u << instr.dr) | flagsBit;
+      if (instr.op == M_JSR || instr.op == M_JSRR)
+         return 1u << R_R15;
+      return 0;
+   }
+
+   // Read the instructions out of the tokens the same way the parser does.
+   // Returns false on anything the parser would stop at.
+   bool parse()
+   {
+      std::size_t memory_index = vm.pcStart;
+      segments.push_back({static_cast<std::int32_t>(memory_index), 0, 0});
+
+      while (tokens.at(cursor).type != Token::Type::eof)
+      {
+         Instruction instr;
+         instr.first = cursor;
+         instr.segment = segments.size() - 1;
+         instr.address = static_cast<std::int32_t>(memory_index);
+
+         const Token& token = tokens.at(cursor++);
+
+         if (token.type == Token::Type::directive && token.value == D_ORG)
+         {
+            std::int32_t destination;
+            if (!take(Token::Type::number, destination))
+               return false;
+
+            memory_index = static_cast<std::uint16_t>(destination);
+            segments.back().last = items.size();
+            segments.push_back({static_cast<std::int32_t>(memory_index), items.size(), 0});
+            continue;
+         }
+
+         if (token.type == Token::Type::directive && token.value == D_WORD)
+         {
+            instr.kind = Instruction::Kind::word;
+            if (!take_operand(instr))
+               return false;
+         }
+         else if (token.type == Token::Type::directive && token.value == D_END)
+            instr.kind = Instruction::Kind::end;
+         else if (token.type != Token::Type::keyword || !parse_instruction(instr, token.value))
+            return false;
+
+         instr.last = cursor;
+         items.push_back(instr);
+         ++memory_index;
+
+         if (instr.kind == Instruction::Kind::end)
+            break;
+      }
+
+      segments.back().last = items.size();
+      return true;
+   }
+
+   bool parse_instruction(Instruction& instr, std::int32_t value)
+   {
+      instr.op = value & 0xff;
+      instr.nzp = value >> 8;
+      std::int32_t regis;
+
+      auto take_register = [&](std::uint8_t& destination)
+      {
+         if (!take(Token::Type::regis, regis))
+            return false;
+         destination = static_cast<std::uint8_t>(regis & 0b1111);
+         return true;
+      };
+
+      auto take_comma = [&]
+      {
+         return take(Token::Type::comma, regis);
+      };
+
+      if (binary(instr.op))
+      {
+         if (!take_register(instr.dr) || !take_comma() || !take_register(instr.sr1) || !take_comma())
+            return false;
+         if (!take_operand(instr) && !take_register(instr.sr2))
+            return false;
+         if (instr.immediate && !instr.label)
+            instr.value = field(instr.value, 17);
+         return true;
+      }
+
+      bool parsed;
+      switch (instr.op)
+      {
+         case M_NOT: case M_NEG:
+            parsed = take_register(instr.dr) && take_comma() && take_register(instr.sr1);
+            break;
+         case M_BR: case M_JSR:
+            parsed = take_operand(instr);
+            break;
+         case M_JMP: case M_JSRR:
+            parsed = take_register(instr.sr1);
+            break;
+         case M_RET: case M_HALT: case M_SNAP:
+            parsed = true;
+            break;
+         case M_LD: case M_LDI: case M_LEA: case M_ST: case M_STI:
+            parsed = take_register(instr.dr) && take_comma() && take_operand(instr);
+            break;
+         case M_LDR: case M_STR:
+            parsed = take_register(instr.dr) && take_comma() && take_register(instr.sr1) && take_comma() &&
+                     take_operand(instr);
+            break;
+         default:
+            return false;
+      }
+
+      // Offsets given as numbers point to an address like labels do
+      if (parsed && relative(instr.op) && !instr.label)
+      {
+         if (instr.op == M_BR)
+            instr.value = instr.address + 1 + field(instr.value, 23);
+         else if (instr.op == M_JSR)
+            instr.value = instr.address + 1 + field(instr.value, 25);
+         else
+            instr.value = instr.address + field(instr.value, 22);
+      }
+      return parsed;
+   }
+
+   bool take(Token::Type type, std::int32_t& value)
+   {
+      if (tokens.at(cursor).type != type)
+         return false;
+      value = tokens.at(cursor++).value;
+      return true;
+   }
+
+   // Number or label operand
+   bool take_operand(Instruction& instr)
+   {
+      const Token& token = tokens.at(cursor);
+
+      if (token.type != Token::Type::number && token.type != Token::Type::label)
+         return false;
+
+      instr.immediate = true;
+      instr.label = (token.type == Token::Type::label);
+      instr.value = token.value;
+      ++cursor;
+      return true;
+   }
+
+   // Map every address to the instruction placed there. Returns false when
+   // the segments overlap or run past the memory, so addresses would be
+   // ambiguous.
+   bool separate()
+   {
+      std::vector<std::pair<std::int64_t, std::int64_t>> ranges;
+      for (const auto& segment : segments)
+         if (segment.last > segment.first)
+            ranges.push_back({segment.start, segment.start + std::int64_t(segment.last - segment.first)});
+
+      std::sort(ranges.begin(), ranges.end());
+      for (std::size_t index = 0; index < ranges.size(); ++index)
+         if (ranges.at(index).second > std::int64_t(maxMemory) ||
+             (index > 0 && ranges.at(index).first < ranges.at(index - 1).second))
+            return false;
+
+      at.assign(maxMemory, -1);
+      for (std::size_t index = 0; index < items.size(); ++index)
+         at.at(items.at(index).address) = static_cast<std::int32_t>(index);
+      return true;
+   }
+
+   // Instruction at the address, or the end of a segment
+   Location locate(std::int64_t address) const
+   {
+      if (address < 0 || address > std::int64_t(maxMemory))
+         return {};
+
+      if (address < std::int64_t(maxMemory) && at.at(address) >= 0)
+         return {items.at(at.at(address)).segment, static_cast<std::size_t>(at.at(address))};
+
+      for (std::size_t index = 0; index < segments.size(); ++index)
+      {
+         const Segment& segment = segments.at(index);
+         if (segment.last > segment.first && segment.start + std::int64_t(segment.last - segment.first) == address)
+            return {index, segment.last};
+      }
+      return {};
+   }
+
+   // First instruction that wasn't removed from the location on
+   Location next_alive(Location location) const
+   {
+      if (location.segment == npos)
+         return location;
+
+      while (location.item < segments.at(location.segment).last && items.at(location.item).removed)
+         ++location.item;
+      return location;
+   }
+
+   // Block, or other kind of edge, execution continues at from the location
+   std::int64_t resolve(Location location) const
+   {
+      location = next_alive(location);
+
+      if (location.segment == npos)
+         return escape;
+      if (location.item == segments.at(location.segment).last)
+         return (location.segment + 1 == segments.size() ? halt : escape);
+
+      switch (items.at(location.item).kind)
+      {
+         case Instruction::Kind::code: return block_of.at(location.item);
+         case Instruction::Kind::end:  return halt;
+         default:                      return escape;
+      }
+   }
+
+   // Split the instructions left into basic blocks
+   void build_blocks()
+   {
+      blocks.clear();
+      block_of.assign(items.size(), none);
+      std::vector<bool> leader (items.size());
+      std::vector<std::size_t> unknown;
+
+      auto lead = [&](Location location, bool from_anywhere)
+      {
+         location = next_alive(location);
+         if (location.segment == npos || location.item == segments.at(location.segment).last)
+            return;
+
+         leader.at(location.item) = true;
+         if (from_anywhere)
+            unknown.push_back(location.item);
+      };
+
+      for (std::size_t index = 0; index < segments.size(); ++index)
+      {
+         const Segment& segment = segments.at(index);
+
+         // Segments are entered from anywhere, except for the one of the
+         // entry, which starts with the registers cleared
+         bool adjacent = std::any_of(segments.begin(), segments.end(), [&](const Segment& other)
+         {
+            return other.last > other.first && other.start + std::int64_t(other.last - other.first) == segment.start;
+         });
+         lead({index, segment.first}, segment.start != vm.pcStart || adjacent);
+      }
+
+      for (std::size_t index = 0; index < items.size(); ++index)
+      {
+         const Instruction& instr = items.at(index);
+         if (instr.removed)
+            continue;
+
+         // Data can be run into, so whatever follows it is entered with
+         // anything in the registers
+         if (instr.kind != Instruction::Kind::code)
+            lead({instr.segment, index + 1}, true);
+         else if (terminator(instr.op))
+            lead({instr.segment, index + 1}, instr.op == M_JSR || instr.op == M_JSRR);
+
+         // Labels used for anything but a branch are addresses that could
+         // end up in a register and be jumped to
+         bool code = (instr.kind == Instruction::Kind::code);
+         if (code && instr.op == M_BR)
+            lead(locate(instr.value), false);
+         else if (instr.label || (code && relative(instr.op)))
+            lead(locate(instr.value), true);
+      }
+
+      for (std::size_t index = 0; index < items.size(); ++index)
+      {
+         const Instruction& instr = items.at(index);
+         if (instr.removed || instr.kind != Instruction::Kind::code)
+            continue;
+
+         if (blocks.empty() || (leader.at(index) && !blocks.back().items.empty()))
+            blocks.emplace_back();
+
+         blocks.back().items.push_back(index);
+         block_of.at(index) = static_cast<std::int64_t>(blocks.size() - 1);
+
+         // Anything that isn't code ends the block as well
+         Location next = next_alive({instr.segment, index + 1});
+         if (terminator(instr.op) || next.item == segments.at(instr.segment).last ||
+             items.at(next.item).kind != Instruction::Kind::code || leader.at(next.item))
+            blocks.emplace_back();
+      }
+
+      if (!blocks.empty() && blocks.back().items.empty())
+         blocks.pop_back();
+
+      for (auto& block : blocks)
+      {
+         const Instruction& last = items.at(block.items.back());
+         Location next {last.segment, block.items.back() + 1};
+
+         if (last.op == M_HALT)
+            block.fall = halt;
+         else if (last.op == M_JMP || last.op == M_RET || last.op == M_JSR || last.op == M_JSRR)
+            block.fall = escape;
+         else
+            block.fall = resolve(next);
+
+         if (last.op == M_BR)
+            block.taken = resolve(locate(last.value));
+      }
+
+      entries.assign(blocks.size(), false);
+      for (std::size_t index : unknown)
+         if (block_of.at(index) >= 0)
+            entries.at(block_of.at(index)) = true;
+   }
+
+   // Merge the state into the state at the start of a block. Returns
+   // whether it changed.
+   static bool join(State& into, const State& from)
+   {
+      if (!into.reached)
+      {
+         into = from;
+         return true;
+      }
+
+      std::uint16_t known = into.known & from.known;
+      for (std::size_t r = 0; r < 16; ++r)
+         if ((known >> r & 1) && into.values.at(r) != from.values.at(r))
+            known &= ~(1u << r);
+
+      bool changed = (known != into.known || (into.flags | from.flags) != into.flags);
+      into.known = known;
+      into.flags |= from.flags;
+      return changed;
+   }
+
+   // Value of the result of the instruction, when it is known
+   static bool evaluate(const State& state, const Instruction& instr, std::int32_t& result)
+   {
+      auto known = [&](std::uint8_t r) { return (state.known >> r & 1) != 0; };
+
+      if (unary(instr.op) && known(instr.sr1))
+      {
+         std::uint32_t a = state.values.at(instr.sr1);
+         result = static_cast<std::int32_t>(instr.op == M_NOT ? ~a : 0u - a);
+         return true;
+      }
+
+      // Some results don't depend on what the registers hold
+      bool zero_immediate = binary(instr.op) && instr.immediate && !instr.label && instr.value == 0;
+      bool same_sources = binary(instr.op) && !instr.immediate && instr.sr1 == instr.sr2;
+      if ((zero_immediate && (instr.op == M_AND || instr.op == M_MUL)) ||
+          (same_sources && (instr.op == M_SUB || instr.op == M_XOR)))
+      {
+         result = 0;
+         return true;
+      }
+
+      if (!binary(instr.op) || !known(instr.sr1) || (instr.immediate ? instr.label : !known(instr.sr2)))
+         return false;
+
+      std::int32_t a = state.values.at(instr.sr1);
+      std::int32_t b = (instr.immediate ? instr.value : state.values.at(instr.sr2));
+      std::uint32_t ua = a, ub = b;
+
+      // Dividing the smallest number by -1 is left to the machine
+      if ((instr.op == M_DIV || instr.op == M_REM) && a == std::numeric_limits<std::int32_t>::min() && b == -1)
+         return false;
+
+      switch (instr.op)
+      {
+         case M_ADD: result = static_cast<std::int32_t>(ua + ub); break;
+         case M_SUB: result = static_cast<std::int32_t>(ua - ub); break;
+         case M_MUL: result = static_cast<std::int32_t>(ua * ub); break;
+         case M_DIV: result = (b == 0 ? 0 : a / b); break;
+         case M_REM: result = (b == 0 ? 0 : a % b); break;
+         case M_AND: result = a & b; break;
+         case M_OR:  result = a | b; break;
+         case M_XOR: result = a ^ b; break;
+         default:    return false;
+      }
+      return true;
+   }
+
+   static void transfer(State& state, const Instruction& instr)
+   {
+      if (pure(instr.op))
+      {
+         std::int32_t result;
+         if (evaluate(state, instr, result))
+         {
+            state.values.at(instr.dr) = result;
+            state.known |= 1u << instr.dr;
+            state.flags = flag_of(result);
+         }
+         else
+         {
+            state.known &= ~(1u << instr.dr);
+            state.flags = 0b1110;
+         }
+      }
+      else if (instr.op == M_JSR || instr.op == M_JSRR)
+         state.known &= ~(1u << R_R15);
+   }
+
+   // Find the blocks that can be reached and what is known at their start,
+   // only following branches the condition codes allow
+   void propagate()
+   {
+      states.assign(blocks.size(), {});
+      std::vector<std::size_t> work;
+
+      auto enter = [&](std::int64_t block, const State& state)
+      {
+         if (block >= 0 && join(states.at(block), state))
+            work.push_back(block);
+      };
+
+      State anything;
+      anything.flags = 0b1111;
+      anything.reached = true;
+
+      State cleared;
+      cleared.known = 0xffff;
+      cleared.flags = 0b0001;
+      cleared.reached = true;
+
+      Location entry = next_alive(locate(vm.pcStart));
+      if (entry.segment != npos && entry.item < segments.at(entry.segment).last &&
+          items.at(entry.item).kind == Instruction::Kind::code)
+         enter(block_of.at(entry.item), cleared);
+
+      for (std::size_t block = 0; block < blocks.size(); ++block)
+         if (entries.at(block))
+            enter(block, anything);
+
+      while (!work.empty())
+      {
+         std::size_t index = work.back();
+         work.pop_back();
+
+         Block& block = blocks.at(index);
+         State state = states.at(index);
+         for (std::size_t item : block.items)
+            transfer(state, items.at(item));
+
+         const Instruction& last = items.at(block.items.back());
+         std::uint8_t taken = (last.op == M_BR ? taken_by(state.flags, last.nzp) : 0);
+
+         block.takes = (taken != 0);
+         block.falls = (last.op != M_BR || (state.flags & ~taken) != 0);
+
+         if (block.takes)
+            enter(block.taken, state);
+         if (block.falls)
+            enter(block.fall, state);
+      }
+   }
+
+   void record(Pass pass, const Instruction& instr, bool removed)
+   {
+      report.changes.push_back({pass, static_cast<std::uint16_t>(instr.address), removed});
+   }
+
+   bool remove_unreachable()
+   {
+      bool changed = false;
+
+      for (std::size_t index = 0; index < blocks.size(); ++index)
+      {
+         if (states.at(index).reached)
+            continue;
+
+         for (std::size_t item : blocks.at(index).items)
+         {
+            items.at(item).removed = true;
+            record(Pass::dead_code, items.at(item), true);
+         }
+         changed = true;
+      }
+      return changed;
+   }
+
+   // Rewrite the instructions with what is known about the registers
+   // before them. Returns whether anything changed.
+   bool fold()
+   {
+      bool changed = false;
+
+      for (std::size_t index = 0; index < blocks.size(); ++index)
+      {
+         State state = states.at(index);
+         Instruction* previous = nullptr;
+
+         for (std::size_t item : blocks.at(index).items)
+         {
+            Instruction& instr = items.at(item);
+            bool rewritten = false;
+
+            if (binary(instr.op) || unary(instr.op))
+               rewritten = fold_operands(state, instr) | fold_pair(previous, instr);
+            else if (instr.op == M_BR)
+               rewritten = fold_branch(state.flags, instr, item);
+
+            changed |= rewritten;
+            if (instr.removed)
+               continue;
+
+            transfer(state, instr);
+            previous = &instr;
+         }
+      }
+      return changed;
+   }
+
+   bool fold_operands(const State& state, Instruction& instr)
+   {
+      auto known = [&](std::uint8_t r) { return (state.known >> r & 1) != 0; };
+      bool changed = false;
+
+      // Registers known to hold a small constant become immediates
+      if (binary(instr.op) && !instr.immediate)
+      {
+         if (known(instr.sr2) && fits_imm17(state.values.at(instr.sr2)))
+         {
+            instr.value = state.values.at(instr.sr2);
+            instr.immediate = changed = true;
+         }
+         else if (commutative(instr.op) && known(instr.sr1) && fits_imm17(state.values.at(instr.sr1)))
+         {
+            instr.value = state.values.at(instr.sr1);
+            instr.sr1 = instr.sr2;
+            instr.immediate = changed = true;
+         }
+      }
+
+      // Results known ahead of time are added to a register known to hold
+      // a close enough value instead, the source first. One other than the
+      // destination lets whatever set the destination before go, unless the
+      // destination already holds the result.
+      std::int32_t result;
+      if (instr.op != M_ADD && evaluate(state, instr, result))
+      {
+         auto fits = [&](std::uint8_t r)
+         {
+            return known(r) && fits_imm17(std::int64_t(result) - state.values.at(r));
+         };
+
+         std::uint8_t base = registersCount;
+         if (fits(instr.sr1) && (instr.sr1 != instr.dr || state.values.at(instr.sr1) == result))
+            base = instr.sr1;
+         for (std::uint8_t r = 0; r < registersCount && base == registersCount; ++r)
+            if (r != instr.dr && fits(r))
+               base = r;
+         if (base == registersCount && fits(instr.sr1))
+            base = instr.sr1;
+
+         if (base != registersCount)
+         {
+            instr.op = M_ADD;
+            instr.sr1 = base;
+            instr.immediate = true;
+            instr.label = false;
+            instr.value = static_cast<std::int32_t>(std::int64_t(result) - state.values.at(base));
+            changed = true;
+         }
+      }
+
+      if (changed)
+         record(Pass::folding, instr, false);
+      return changed;
+   }
+
+   // NOT or NEG of the result of the same operation gets the original value
+   // back
+   bool fold_pair(Instruction* previous, Instruction& instr)
+   {
+      if (!previous || !unary(instr.op) || previous->op != instr.op || instr.sr1 != previous->dr)
+         return false;
+
+      if (previous->dr != previous->sr1)
+      {
+         // The source still holds the original value
+         to_copy(instr, previous->sr1);
+      }
+      else if (instr.dr == previous->dr)
+      {
+         // Both go and only the condition codes are set again
+         previous->removed = true;
+         record(Pass::peephole, *previous, true);
+         to_copy(instr, instr.dr);
+      }
+      else
+         return false;
+
+      record(Pass::peephole, instr, false);
+      return true;
+   }
+
+   static void to_copy(Instruction& instr, std::uint8_t source)
+   {
+      instr.op = M_ADD;
+      instr.sr1 = source;
+      instr.immediate = true;
+      instr.label = false;
+      instr.value = 0;
+   }
+
+   // Drop branches that are never taken or that go to the next instruction
+   // anyway, and send branches to other branches where those end up
+   bool fold_branch(std::uint8_t flags, Instruction& instr, std::size_t item)
+   {
+      std::uint8_t taken = taken_by(flags, instr.nzp);
+
+      if (taken == 0)
+      {
+         instr.removed = true;
+         record(Pass::folding, instr, true);
+         return true;
+      }
+
+      bool changed = false;
+      std::int32_t target = instr.value;
+
+      for (std::size_t hop = 0; hop < maxRounds; ++hop)
+      {
+         Location location = next_alive(locate(target));
+         if (location.segment == npos || location.item == segments.at(location.segment).last)
+            break;
+
+         const Instruction& next = items.at(location.item);
+         if (next.kind != Instruction::Kind::code || next.op != M_BR || &next == &instr)
+            break;
+
+         // The condition codes are the same at the next branch
+         std::uint8_t both = taken_by(taken, next.nzp);
+         if (both == taken && next.value != target)
+            target = next.value;
+         else if (both == 0)
+            target = next.address + 1;
+         else
+            break;
+      }
+
+      if (target != instr.value)
+      {
+         instr.value = target;
+         record(Pass::threading, instr, false);
+         changed = true;
+      }
+
+      Location to = next_alive(locate(instr.value));
+      Location after = next_alive({instr.segment, item + 1});
+
+      if (to.segment == after.segment && to.item == after.item)
+      {
+         instr.removed = true;
+         record(Pass::peephole, instr, true);
+         changed = true;
+      }
+      return changed;
+   }
+
+   // Remove instructions whose results are never read. Returns whether any
+   // got removed.
+   bool eliminate()
+   {
+      std::vector<std::uint32_t> live_in (blocks.size());
+
+      auto live_out = [&](const Block& block)
+      {
+         std::uint32_t live = 0;
+
+         for (auto [edge, followed] : {std::pair {block.fall, block.falls}, std::pair {block.taken, block.takes}})
+         {
+            if (!followed || edge == none)
+               continue;
+            live |= (edge >= 0 ? live_in.at(edge) : edge == halt ? registersLive : allLive);
+         }
+         return live;
+      };
+
+      for (bool changed = true; changed;)
+      {
+         changed = false;
+
+         for (std::size_t index = blocks.size(); index-- > 0;)
+         {
+            std::uint32_t live = live_out(blocks.at(index));
+
+            for (auto item = blocks.at(index).items.rbegin(); item != blocks.at(index).items.rend(); ++item)
+               live = (live & ~defs(items.at(*item))) | uses(items.at(*item));
+
+            if (live != live_in.at(index))
+            {
+               live_in.at(index) = live;
+               changed = true;
+            }
+         }
+      }
+
+      bool removed = false;
+
+      for (const auto& block : blocks)
+      {
+         std::uint32_t live = live_out(block);
+
+         for (auto item = block.items.rbegin(); item != block.items.rend(); ++item)
+         {
+            Instruction& instr = items.at(*item);
+
+            if (pure(instr.op) && (defs(instr) & live) == 0)
+            {
+               instr.removed = removed = true;
+               record(Pass::dead_stores, instr, true);
+            }
+            else if (identity(instr) && (live & flagsBit) == 0)
+            {
+               instr.removed = removed = true;
+               record(Pass::peephole, instr, true);
+            }
+            else
+               live = (live & ~defs(instr)) | uses(instr);
+         }
+      }
+      return removed;
+   }
+
+   // Write the instructions left back into tokens
+   std::vector<Token> emit() const
+   {
+      // New address of every instruction and of the end of every segment
+      std::vector<std::int32_t> addresses (items.size()), ends (segments.size());
+      for (std::size_t index = 0; index < segments.size(); ++index)
+      {
+         std::int32_t address = segments.at(index).start;
+         for (std::size_t item = segments.at(index).first; item < segments.at(index).last; ++item)
+         {
+            addresses.at(item) = address;
+            address += !items.at(item).removed;
+         }
+         ends.at(index) = address;
+      }
+
+      // Removed instructions are replaced by whatever follows them
+      auto moved = [&](std::int32_t address)
+      {
+         Location location = next_alive(locate(address));
+         if (location.segment == npos)
+            return address;
+         if (location.item == segments.at(location.segment).last)
+            return ends.at(location.segment);
+         return addresses.at(location.item);
+      };
+
+      std::vector<Token> output;
+      output.reserve(tokens.size());
+
+      std::size_t next = 0;
+      for (std::size_t index = 0; index < tokens.size();)
+      {
+         if (next == items.size() || index != items.at(next).first)
+         {
+            output.push_back(tokens.at(index++));
+            continue;
+         }
+
+         const Instruction& instr = items.at(next++);
+         index = instr.last;
+
+         if (!instr.removed)
+            emit_instruction(output, instr, addresses.at(next - 1), moved);
+      }
+      return output;
+   }
+
+   template <typename Moved>
+   void emit_instruction(std::vector<Token>& output, const Instruction& instr, std::int32_t address, Moved&& moved) const
+   {
+      Token token = tokens.at(instr.first);
+
+      auto push = [&](Token::Type type, std::int32_t value = 0)
+      {
+         token.type = type;
+         token.value = value;
+         output.push_back(token);
+      };
+
+      auto push_operand = [&]
+      {
+         if (instr.label)
+            push(Token::Type::label, moved(instr.value));
+         else if (instr.kind == Instruction::Kind::code && relative(instr.op))
+            push(Token::Type::number, moved(instr.value) - address - (instr.op == M_BR || instr.op == M_JSR));
+         else
+            push(Token::Type::number, instr.value);
+      };
+
+      if (instr.kind != Instruction::Kind::code)
+      {
+         output.push_back(token);
+         if (instr.kind == Instruction::Kind::word)
+            push_operand();
+         return;
+      }
+
+      push(Token::Type::keyword, instr.op | (instr.op == M_BR ? instr.nzp << 8 : 0));
+
+      if (binary(instr.op) || unary(instr.op) || instr.op == M_LDR || instr.op == M_STR ||
+          (relative(instr.op) && instr.op != M_BR && instr.op != M_JSR))
+      {
+         push(Token::Type::regis, instr.dr);
+         push(Token::Type::comma);
+      }
+
+      if (binary(instr.op) || unary(instr.op) || instr.op == M_LDR || instr.op == M_STR ||
+          instr.op == M_JMP || instr.op == M_JSRR)
+         push(Token::Type::regis, instr.sr1);
+
+      if (binary(instr.op) || instr.op == M_LDR || instr.op == M_STR)
+      {
+         push(Token::Type::comma);
+         if (instr.immediate)
+            push_operand();
+         else
+            push(Token::Type::regis, instr.sr2);
+      }
+      else if (relative(instr.op))
+         push_operand();
+   }
+};
+
+#endif // OPTIMIZER_HPP
@@ -1,29 +1,38 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
+#include "context.hpp"
 #include "lexer.hpp"
-#include "memory.hpp"
-#include "register.hpp"
+#include "object.hpp"
+#include "profiler.hpp"
+#include <algorithm>
 
 // Parse the tokens and construct the instructions. Instructions get loaded
-// into memory, which are then executed by the executor
+// into memory, which are then executed by the executor. The tokens are
+// either all of them in a vector or a stream that only keeps the latest.
+template <typename Tokens = std::vector<Token>>
 class Parser
 {
 public:
    // Constructors
-   Parser(Catcher& catcher, std::vector<Token>& tokens)
-      : catcher(catcher), tokens(tokens) {}
+   Parser(Catcher& catcher, VmContext& vm, Tokens& tokens)
+      : catcher(catcher), vm(vm), tokens(tokens) {}
    ~Parser() = default;
 
    // Parse the tokens
    void parse()
    {
+      vm.segments.push_back({static_cast<std::uint16_t>(memory_index), 0});
+
       while (!is(Token::Type::eof))
       {
+         origin = tokens.at(index).offset;
+
          // Handle directives as a unique case
          if (is(Token::Type::directive))
          {
             handle_directives();
+            if (quit_flag) return;
             continue;
          }
 
@@ -32,62 +41,44 @@ public:
          if (quit_flag || check(Token::Type::keyword))
             return;
 
-         const std::string& lexeme = tokens.at(index).lexeme;
+         std::int32_t value = tokens.at(index).value;
 
          // Match the command
-         if (lexeme == "ADD"s)
-            parse_imm17_opcode(0b000001);
-         else if (lexeme == "SUB"s)
-            parse_imm17_opcode(0b000010);
-         else if (lexeme == "MUL"s)
-            parse_imm17_opcode(0b000011);
-         else if (lexeme == "DIV"s)
-            parse_imm17_opcode(0b000100);
-         else if (lexeme == "REM"s)
-            parse_imm17_opcode(0b000101);
-         else if (lexeme == "AND"s)
-            parse_imm17_opcode(0b000110);
-         else if (lexeme == "OR"s)
-            parse_imm17_opcode(0b000111);
-         else if (lexeme == "XOR"s)
-            parse_imm17_opcode(0b001000);
-         else if (lexeme == "NOT"s)
-            parse_unary_opcode(0b001001);
-         else if (lexeme == "NEG"s)
-            parse_unary_opcode(0b001010);
-         else if (lexeme.substr(0, 2) == "BR"s)
-            parse_br_opcode(lexeme);
-         else if (lexeme == "JMP"s)
-            parse_jmp_opcode();
-         else if (lexeme == "RET"s)
-            parse_ret_opcode();
-         else if (lexeme == "JSR"s)
-            parse_jsr_opcode();
-         else if (lexeme == "JSRR"s)
-            parse_jsrr_opcode();
-         else if (lexeme == "LD"s)
-            parse_ld_opcode(0b001110);
-         else if (lexeme == "LDI"s)
-            parse_ld_opcode(0b001111);
-         else if (lexeme == "LDR"s)
-            parse_ldr_opcode(0b010000);
-         else if (lexeme == "LEA"s)
-            parse_ld_opcode(0b010001);
-         else if (lexeme == "ST"s)
-            parse_ld_opcode(0b010010);
-         else if (lexeme == "STI"s)
-            parse_ld_opcode(0b010011);
-         else if (lexeme == "STR"s)
-            parse_ldr_opcode(0b010100);
-         else if (lexeme == "HALT"s)
-            parse_halt_opcode();
-         else check(Token::Type::eof);
+         switch (static_cast<Mnemonic>(value & 0xff))
+         {
+            case M_ADD:  parse_imm17_opcode(0b000001); break;
+            case M_SUB:  parse_imm17_opcode(0b000010); break;
+            case M_MUL:  parse_imm17_opcode(0b000011); break;
+            case M_DIV:  parse_imm17_opcode(0b000100); break;
+            case M_REM:  parse_imm17_opcode(0b000101); break;
+            case M_AND:  parse_imm17_opcode(0b000110); break;
+            case M_OR:   parse_imm17_opcode(0b000111); break;
+            case M_XOR:  parse_imm17_opcode(0b001000); break;
+            case M_NOT:  parse_unary_opcode(0b001001); break;
+            case M_NEG:  parse_unary_opcode(0b001010); break;
+            case M_BR:   parse_br_opcode(value >> 8); break;
+            case M_JMP:  parse_jmp_opcode(); break;
+            case M_RET:  parse_ret_opcode(); break;
+            case M_JSR:  parse_jsr_opcode(); break;
+            case M_JSRR: parse_jsrr_opcode(); break;
+            case M_LD:   parse_ld_opcode(0b001110); break;
+            case M_LDI:  parse_ld_opcode(0b001111); break;
+            case M_LDR:  parse_ldr_opcode(0b010000); break;
+            case M_LEA:  parse_ld_opcode(0b010001); break;
+            case M_ST:   parse_ld_opcode(0b010010); break;
+            case M_STI:  parse_ld_opcode(0b010011); break;
+            case M_STR:  parse_ldr_opcode(0b010100); break;
+            case M_HALT: parse_halt_opcode(haltInstruction); break;
+            case M_SNAP: parse_halt_opcode(snapInstruction); break;
+            default:     check(Token::Type::eof); break;
+         }
 
          if (quit_flag) return;
       }
 
       // Always add a HALT command at the end
-      memory.at(memory_index) = 0b111111;
+      vm.memory.at(memory_index) = 0b111111;
+      extend_segment(memory_index);
    }
 
    void parse_imm17_opcode(std::uint32_t opcode)
@@ -111,7 +102,8 @@ public:
 
       if (is(Token::Type::number, Token::Type::label))
       {
-         std::int32_t number = std::stoi(tokens.at(index).lexeme);
+         std::int32_t number = tokens.at(index).value;
+         relocate(RelocationKind::imm17);
          instr |= (number & 0b11111111111111111) << 15;
          instr |= 0b1 << 6;
       }
@@ -144,26 +136,18 @@ public:
       insert(instr);
    }
 
-   void parse_br_opcode(const std::string& lexeme)
+   void parse_br_opcode(std::uint32_t nzp)
    {
       std::uint32_t instr = 0b001011;
-
-      bool n = (lexeme.find("n") != lexeme.npos);
-      bool z = (lexeme.find("z") != lexeme.npos);
-      bool p = (lexeme.find("p") != lexeme.npos);
-
-      if (!n && !z && !p) n = z = p = true;
-
-      instr |= n << 6;
-      instr |= z << 7;
-      instr |= p << 8;
+      instr |= (nzp & 0b111) << 6;
 
       advance();
       if (check(Token::Type::number, Token::Type::label)) return;
 
-      std::int32_t pc_offset23 = std::stoi(tokens.at(index).lexeme);
+      std::int32_t pc_offset23 = tokens.at(index).value;
       if (is(Token::Type::label))
          pc_offset23 -= memory_index + 1;
+      relocate(RelocationKind::br23);
 
       instr |= (pc_offset23 & 0b11111111111111111111111) << 9;
 
@@ -198,10 +182,11 @@ public:
 
       if (check(Token::Type::number, Token::Type::label)) return;
 
-      std::int32_t pc_offset25 = std::stoi(tokens.at(index).lexeme);
+      std::int32_t pc_offset25 = tokens.at(index).value;
       if (is(Token::Type::label))
          pc_offset25 -= memory_index + 1;
-      
+      relocate(RelocationKind::jsr25);
+
       instr |= (pc_offset25 & 0b1111111111111111111111111) << 7;
 
       advance();
@@ -236,9 +221,10 @@ public:
       advance();
       if (check(Token::Type::number, Token::Type::label)) return;
 
-      std::int32_t pc_offset22 = std::stoi(tokens.at(index).lexeme);
+      std::int32_t pc_offset22 = tokens.at(index).value;
       if (is(Token::Type::label))
          pc_offset22 -= memory_index;
+      relocate(RelocationKind::ld22);
 
       instr |= (pc_offset22 & 0b1111111111111111111111) << 10;
       
@@ -267,9 +253,10 @@ public:
       advance();
       if (check(Token::Type::number, Token::Type::label)) return;
 
-      std::int32_t pc_offset18 = std::stoi(tokens.at(index).lexeme);
+      std::int32_t pc_offset18 = tokens.at(index).value;
       if (is(Token::Type::label))
          pc_offset18 -= memory_index;
+      relocate(RelocationKind::ldr18);
 
       instr |= (pc_offset18 & 0b111111111111111111) << 14;
 
@@ -277,41 +264,45 @@ public:
       insert(instr);
    }
 
-   void parse_halt_opcode()
+   void parse_halt_opcode(std::uint32_t instr)
    {
       advance();
-      insert(0b111111);
+      insert(instr);
    }
 
    void handle_directives()
    {
-      const std::string& lexeme = tokens.at(index).lexeme;
+      Directive directive = static_cast<Directive>(tokens.at(index).value);
 
-      if (lexeme == ".ORG"s)
+      if (directive == D_ORG)
       {
          advance();
          if (check(Token::Type::number)) return;
 
-         std::uint16_t destination = std::stoi(tokens.at(index).lexeme);
-         reg.at(R_PC) = destination;
+         std::uint16_t destination = tokens.at(index).value;
+         vm.reg.at(R_PC) = destination;
          memory_index = destination;
+         vm.segments.push_back({destination, 0});
 
          advance();
       }
-      else if (lexeme == ".WORD"s)
+      else if (directive == D_WORD)
       {
          advance();
          if (check(Token::Type::number, Token::Type::label)) return;
 
-         std::int32_t value = std::stoi(tokens.at(index).lexeme);
-         writeMemory(memory_index, value);
+         std::int32_t value = tokens.at(index).value;
+         relocate(RelocationKind::word);
+         vm.writeMemory(memory_index, value);
+         extend_segment(memory_index);
          ++memory_index;
 
          advance();
       }
-      else if (lexeme == ".END"s)
+      else if (directive == D_END)
       {
-         memory.at(memory_index) = 0b111111;
+         vm.memory.at(memory_index) = 0b111111;
+         extend_segment(memory_index);
          quit_flag = true;
          return;
       }
@@ -326,7 +317,7 @@ public:
    {
       if (tokens.at(index).type != type)
       {
-         catcher.insert("Unexpected token while parsing: '"s + tokens.at(index).lexeme + "'."s);
+         catcher.insert("Unexpected token while parsing: '"s + std::string(vm.sources.lexeme(tokens.at(index))) + "'"s + location() + "."s);
          quit_flag = true;
       }
       return quit_flag;
@@ -336,7 +327,7 @@ public:
    {
       if (tokens.at(index).type != type1 && tokens.at(index).type != type2)
       {
-         catcher.insert("Unexpected token while parsing: '"s + tokens.at(index).lexeme + "'."s);
+         catcher.insert("Unexpected token while parsing: '"s + std::string(vm.sources.lexeme(tokens.at(index))) + "'"s + location() + "."s);
          quit_flag = true;
       }
       return quit_flag;
@@ -354,26 +345,77 @@ public:
 
    void insert(std::uint32_t instr)
    {
-      if (memory_index < memory.size())
+      if (memory_index < maxMemory)
       {
-         memory.at(memory_index) = instr;
+         vm.memory.at(memory_index) = instr;
+         extend_segment(memory_index);
+         if (vm.profiler)
+            vm.profiler->origins.at(memory_index) = origin;
          ++memory_index;
       }
    }
 
+   // Grow the current segment to cover the address
+   void extend_segment(std::size_t address)
+   {
+      Segment& segment = vm.segments.back();
+      std::size_t end = std::min(address + 1, maxMemory);
+
+      if (end > segment.start + segment.size)
+         segment.size = end - segment.start;
+   }
+
+   // Record the label operand of the word at the memory index when the
+   // program is assembled into an object module. Only fields that change
+   // once the linker moves the relocatable segment are recorded.
+   void relocate(RelocationKind kind)
+   {
+      if (!is(Token::Type::label) || memory_index >= maxMemory)
+         return;
+
+      // Streamed labels may only be defined further down
+      if constexpr (requires { tokens.fixup(index, memory_index, kind); })
+         tokens.fixup(index, memory_index, kind);
+
+      if (!vm.object)
+         return;
+
+      auto target = vm.object->targets.find(index);
+      if (target == vm.object->targets.end())
+         return;
+
+      auto [symbol, relocatable] = target->second;
+      bool moves = (vm.segments.size() == 1);
+
+      if (symbol < 0 && (relocation_fields[std::size_t(kind)].relative ? relocatable == moves : !relocatable))
+         return;
+
+      vm.object->relocations.push_back({static_cast<std::uint32_t>(memory_index),
+                                        static_cast<std::uint32_t>(tokens.at(index).value), symbol,
+                                        static_cast<std::uint16_t>(vm.segments.size() - 1), kind, relocatable});
+   }
+
+   // Position of the current token in its source file
+   std::string location()
+   {
+      return vm.sources.location(tokens.at(index));
+   }
+
    std::uint8_t get_register()
    {
       if (!is(Token::Type::regis))
-         catcher.insert("Unexpected token while parsing: '"s + tokens.at(index).lexeme + "'. Expected register."s);
-      return std::stoi(tokens.at(index).lexeme.substr(1));
+         catcher.insert("Unexpected token while parsing: '"s + std::string(vm.sources.lexeme(tokens.at(index))) + "'"s + location() + ". Expected register."s);
+      return tokens.at(index).value;
    }
 
 private:
    Catcher& catcher;
-   std::vector<Token>& tokens;
-   size_t memory_index = pcStart;
+   VmContext& vm;
+   Tokens& tokens;
+   size_t memory_index = vm.pcStart;
    size_t index = 0;
    bool quit_flag = false;
+   std::uint32_t origin = 0;  // Offset of the line being parsed in the source map
 };
 
 #endif // PARSER_HPP
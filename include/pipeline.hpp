@@ -0,0 +1,412 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "context.hpp"
+#include "lexer.hpp"
+#include "object.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "translator.hpp"
+#include <array>
+#include <limits>
+#include <memory>
+
+// Translator that works on a stream of tokens instead of a vector. Files
+// are lexed a token at a time and every token is translated the moment it
+// is asked for, with the same rules as the Translator. A label used before
+// it is defined can't get its address yet, it comes out without one along
+// with the symbol it stands for, so the field can be fixed up at the end.
+class StreamTranslator
+{
+public:
+   // Constructors
+   StreamTranslator(Catcher& catcher, VmContext& vm, const fs::path& path)
+      : catcher(catcher), vm(vm)
+   {
+      if (!open(path, ""s))
+         failed = true;
+   }
+   ~StreamTranslator() = default;
+
+   // Next translated token. The symbol is the one the label still waits for,
+   // negative for every other token. Ends with the EOF of the main file, or
+   // with an EOF right away once translating failed.
+   const Token& next(std::int32_t& symbol)
+   {
+      symbol = -1;
+
+      while (!failed && !frames.empty())
+      {
+         Frame& frame = *frames.back();
+         const Token& token = frame.current;
+
+         if (token.type == Token::Type::eof)
+         {
+            output = rebase(frame, token);
+            pending_org = false;
+
+            if (!close())
+               break;
+            if (frames.empty())
+               return output;
+            continue;
+         }
+
+         if (pending_org)
+         {
+            pending_org = false;
+            output = rebase(frame, token);
+
+            if (token.type == Token::Type::number)
+            {
+               frame.extent = {true, static_cast<size_t>(token.value)};
+               if (frame.extent.index < vm.pcStart)
+                  vm.pcStart = frame.extent.index;
+            }
+            else
+               output.type = Token::Type::label;
+
+            advance(frame);
+            return output;
+         }
+
+         if (token.type == Token::Type::identifier)
+         {
+            std::uint32_t id = intern(frame, token.value);
+
+            if (frame.following.type == Token::Type::colon && defined.at(id))
+            {
+               catcher.insert("Label '"s + std::string(name(frame, token)) + "' is already defined."s);
+               failed = true;
+               break;
+            }
+            else if (frame.following.type == Token::Type::colon)
+            {
+               addresses.at(id) = memory_index(frame);
+               defined.at(id) = true;
+
+               // Skip the colon along with the label
+               advance(frame);
+               advance(frame);
+               continue;
+            }
+
+            output = rebase(frame, token);
+            output.type = Token::Type::label;
+
+            if (defined.at(id))
+               output.value = addresses.at(id);
+            else
+            {
+               output.value = 0;
+               symbol = id;
+               frame.forward.push_back({id, name(frame, token)});
+            }
+            advance(frame);
+            return output;
+         }
+
+         if (token.type == Token::Type::directive && token.value == D_ORG)
+         {
+            // The operand comes out right after the directive
+            output = rebase(frame, token);
+            advance(frame);
+            pending_org = true;
+            return output;
+         }
+
+         if (token.type == Token::Type::directive && token.value == D_INCLUDE)
+         {
+            advance(frame);
+
+            if (!include(frame))
+            {
+               failed = true;
+               break;
+            }
+            continue;
+         }
+
+         if (token.type == Token::Type::directive || token.type == Token::Type::keyword)
+            ++frame.extent.index;
+
+         output = rebase(frame, token);
+         advance(frame);
+         return output;
+      }
+
+      failed = true;
+      output = {};
+      return output;
+   }
+
+   // Address of a symbol defined anywhere in the stream
+   std::int32_t address(std::uint32_t symbol) const
+   {
+      return addresses.at(symbol);
+   }
+
+private:
+   // File being translated, with its own labels like the Translator gives
+   // every file
+   struct Frame
+   {
+      std::unique_ptr<Lexer> lexer;
+      Token current;
+      Token following;
+      std::uint32_t base;  // Of the file in the source map
+      size_t start;
+      Translator::Extent extent;
+      std::string original;  // File of the catcher to go back to
+
+      // Symbols of the names of the file and the labels it used before
+      // defining them
+      std::vector<std::int32_t> symbols;
+      std::vector<std::pair<std::uint32_t, std::string_view>> forward;
+   };
+
+   Catcher& catcher;
+   VmContext& vm;
+   std::vector<std::unique_ptr<Frame>> frames;
+   Token output;
+   bool pending_org = false;
+   bool failed = false;
+
+   // Symbols of every file, they stay around for the fixups
+   std::vector<std::int32_t> addresses;
+   std::vector<bool> defined;
+
+   // Start lexing the file on a frame of its own
+   bool open(const fs::path& path, const std::string& original)
+   {
+      auto frame = std::make_unique<Frame>();
+      frame->lexer = std::make_unique<Lexer>(catcher, path);
+      frame->start = vm.pcStart;
+      frame->original = original;
+
+      if (!frame->lexer->open())
+         return false;
+
+      // Tokens can outlive the frame in the buffers after it
+      frame->base = vm.sources.add(frame->lexer->source(), frame->lexer->get_text(), path.string());
+
+      frame->current = frame->lexer->next();
+      frame->following = frame->lexer->next();
+      frames.push_back(std::move(frame));
+      return !catcher.any_errors();
+   }
+
+   // Finish the file on top, its labels have to be defined by now
+   bool close()
+   {
+      Frame& frame = *frames.back();
+
+      for (auto [id, label] : frame.forward)
+         if (!defined.at(id))
+            catcher.insert("Undefined label '"s + std::string(label) + "' while translating."s);
+
+      if (catcher.any_errors())
+         return false;
+
+      Translator::Extent extent = frame.extent;
+      catcher.specify(frame.original);
+      frames.pop_back();
+
+      if (!frames.empty())
+      {
+         frames.back()->extent.advance(extent);
+         advance(*frames.back());
+      }
+      return true;
+   }
+
+   // Handle the string of an .INCLUDE the same way the Translator does
+   bool include(Frame& frame)
+   {
+      if (frame.current.type != Token::Type::string)
+      {
+         catcher.insert("Expected string after '.INCLUDE' directive, got '"s +
+                        std::string(vm.sources.lexeme(rebase(frame, frame.current))) + "' instead."s);
+         return false;
+      }
+
+      std::string file (name(frame, frame.current));
+
+      if (!fs::is_regular_file(file))
+      {
+         catcher.insert("File '"s + file + "' could not be included as it cannot be opened or found."s);
+         return false;
+      }
+
+      if (!vm.translated_files.insert(file).second)
+      {
+         advance(frame);
+         return true;
+      }
+
+      std::string original = catcher.get_file();
+      catcher.specify(file);
+      return open(file, original);
+   }
+
+   // Symbol of the name of the file, added on its first use
+   std::uint32_t intern(Frame& frame, std::int32_t name)
+   {
+      if (frame.symbols.size() <= std::size_t(name))
+         frame.symbols.resize(name + 1, -1);
+
+      std::int32_t& symbol = frame.symbols.at(name);
+      if (symbol < 0)
+      {
+         symbol = static_cast<std::int32_t>(addresses.size());
+         addresses.push_back(0);
+         defined.push_back(false);
+      }
+      return symbol;
+   }
+
+   std::string_view name(Frame& frame, const Token& token) const
+   {
+      return frame.lexer->get_names().name(token.value);
+   }
+
+   Token rebase(const Frame& frame, Token token) const
+   {
+      token.offset += frame.base;
+      return token;
+   }
+
+   std::int32_t memory_index(const Frame& frame) const
+   {
+      return static_cast<std::int32_t>(frame.extent.absolute ? frame.extent.index : frame.start + frame.extent.index);
+   }
+
+   void advance(Frame& frame)
+   {
+      frame.current = frame.following;
+      if (frame.current.type != Token::Type::eof)
+         frame.following = frame.lexer->next();
+      if (catcher.any_errors())
+         failed = true;
+   }
+};
+
+// Bounded buffer of the translated tokens the parser reads from. It pulls
+// tokens from the translator as the parser moves forward and only keeps the
+// latest few, along with the fields that wait for a label.
+class TokenPipe
+{
+public:
+   // Field of a word that refers to a label defined after it
+   struct Fixup
+   {
+      std::uint32_t address;
+      std::uint32_t symbol;
+      RelocationKind kind;
+   };
+
+   // Constructors
+   explicit TokenPipe(StreamTranslator& translator)
+      : translator(translator) {}
+   ~TokenPipe() = default;
+
+   // Token at the index, which can't be more than the capacity behind the
+   // last one
+   const Token& at(std::size_t index)
+   {
+      while (index >= count && !ended)
+         pull();
+      return slot(std::min(index, count - 1)).token;
+   }
+
+   // Number of tokens, unknown until the stream ended
+   std::size_t size() const
+   {
+      return (ended ? count : std::numeric_limits<std::size_t>::max());
+   }
+
+   // Remember the field if the label at the index is still waiting for its
+   // address
+   void fixup(std::size_t index, std::size_t address, RelocationKind kind)
+   {
+      std::int32_t symbol = slot(index).symbol;
+
+      if (symbol >= 0)
+         fixups.push_back({static_cast<std::uint32_t>(address), static_cast<std::uint32_t>(symbol), kind});
+   }
+
+   // Translate whatever the parser didn't get to, labels past an .END
+   // still count
+   void drain()
+   {
+      while (!ended)
+         pull();
+   }
+
+   const std::vector<Fixup>& get_fixups() const
+   {
+      return fixups;
+   }
+
+private:
+   static constexpr std::size_t capacity = 16;
+
+   struct Slot
+   {
+      Token token;
+      std::int32_t symbol;
+   };
+
+   StreamTranslator& translator;
+   std::array<Slot, capacity> ring {};
+   std::size_t count = 0;
+   bool ended = false;
+   std::vector<Fixup> fixups;
+
+   Slot& slot(std::size_t index)
+   {
+      return ring[index % capacity];
+   }
+
+   void pull()
+   {
+      Slot& next = slot(count++);
+      next.token = translator.next(next.symbol);
+      ended = (next.token.type == Token::Type::eof);
+   }
+};
+
+// Assemble the file without ever holding all of its tokens. The lexer, the
+// translator and the parser run in lockstep through a small buffer and the
+// words go straight into memory, so apart from the mapped source only the
+// labels and the fields waiting for them take memory. Those fields are
+// filled in at the end. Stops at the first error and leaves it in the
+// catcher.
+inline bool assemble_streaming(Catcher& catcher, VmContext& vm, const fs::path& path)
+{
+   catcher.specify(path.string());
+
+   StreamTranslator translator (catcher, vm, path);
+   TokenPipe pipe (translator);
+
+   Parser parser (catcher, vm, pipe);
+   parser.parse();
+   pipe.drain();
+
+   if (catcher.any_errors())
+      return false;
+   catcher.specify(""s);
+
+   for (const auto& fixup : pipe.get_fixups())
+      patch_field(vm.memory, fixup.address, fixup.kind, translator.address(fixup.symbol));
+
+   // Never holds the whole program to optimize
+   if (vm.optimizer)
+   {
+      *vm.optimizer = {};
+      vm.optimizer->skipped = "the streaming pipeline never holds the whole program"s;
+   }
+   return true;
+}
+
+#endif // PIPELINE_HPP
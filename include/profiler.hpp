@@ -0,0 +1,214 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "catcher.hpp"
+#include "context.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <vector>
+
+// Where a program spends its time, filled in by the executor when the
+// virtual machine has a profile attached. Instructions are counted by opcode
+// and by address, and attributed to the stack of calls made with JSR and
+// JSRR and left with RET. Building with VM_NO_PROFILER leaves the profiled
+// loop out of the executor.
+struct Profile
+{
+   struct Opcode
+   {
+      std::uint64_t count = 0;
+      std::chrono::nanoseconds time {};  // Of the host, spent in the handler
+   };
+
+   // Call of a routine from the frame of the routine that called it. The
+   // first frame is the entry of the program.
+   struct Frame
+   {
+      std::uint16_t address;  // Of the first instruction of the routine
+      std::uint32_t parent;
+      std::uint64_t self = 0; // Instructions executed in the routine itself
+   };
+
+   static constexpr std::uint32_t noOrigin = std::numeric_limits<std::uint32_t>::max();
+   static constexpr std::size_t maxDepth = 1024;
+
+   std::array<Opcode, 64> opcodes {};
+   std::vector<std::uint64_t> hits = std::vector<std::uint64_t>(maxMemory);
+
+   // Offset in the source map of the instruction at every address, recorded
+   // by the parser
+   std::vector<std::uint32_t> origins = std::vector<std::uint32_t>(maxMemory, noOrigin);
+
+   std::vector<Frame> frames;
+   std::map<std::pair<std::uint32_t, std::uint16_t>, std::uint32_t> children;
+   std::uint32_t current = 0;
+   std::size_t depth = 0;     // Calls deeper than the maximum stay in the deepest frame
+   std::size_t overflow = 0;
+
+   // Forget the counts of the last execution, the origins stay
+   void start(std::uint16_t entry)
+   {
+      opcodes = {};
+      std::fill(hits.begin(), hits.end(), 0);
+      frames.assign(1, {entry, 0});
+      children.clear();
+      current = 0;
+      depth = overflow = 0;
+   }
+
+   // Enter the routine at the address from the current frame
+   void call(std::int32_t address)
+   {
+      if (depth == maxDepth || address < 0 || address >= std::int32_t(maxMemory))
+      {
+         ++overflow;
+         return;
+      }
+
+      auto [child, added] = children.try_emplace({current, static_cast<std::uint16_t>(address)},
+                                                 static_cast<std::uint32_t>(frames.size()));
+      if (added)
+         frames.push_back({static_cast<std::uint16_t>(address), current});
+
+      current = child->second;
+      ++depth;
+   }
+
+   // Go back to the frame of the caller, returns without a call stay in the
+   // frame they are in
+   void ret()
+   {
+      if (overflow > 0)
+         --overflow;
+      else if (depth > 0)
+      {
+         current = frames.at(current).parent;
+         --depth;
+      }
+   }
+
+   // Display the opcodes by host time, the hottest addresses and the
+   // routines by the instructions executed in them
+   void display(const SourceMap& sources, std::size_t top = 10) const
+   {
+      using std::chrono::duration_cast, std::chrono::microseconds;
+
+      std::uint64_t total = 0;
+      for (const auto& opcode : opcodes)
+         total += opcode.count;
+
+      std::cout << "Profiled " << total << " instruction" << (total == 1 ? "" : "s") << ".\n";
+
+      std::vector<std::size_t> order (opcodes.size());
+      for (std::size_t index = 0; index < order.size(); ++index)
+         order.at(index) = index;
+      std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return opcodes.at(a).time > opcodes.at(b).time; });
+
+      std::cout << "   opcode       count      time\n";
+      for (std::size_t index : order)
+      {
+         if (opcodes.at(index).count == 0)
+            continue;
+
+         std::cout << "   " << std::left << std::setw(6) << opcode_name(index) << std::right;
+         std::cout << std::setw(12) << opcodes.at(index).count;
+         std::cout << std::setw(8) << duration_cast<microseconds>(opcodes.at(index).time).count() << "us\n";
+      }
+
+      std::vector<std::size_t> hottest;
+      for (std::size_t address = 0; address < hits.size(); ++address)
+         if (hits.at(address) > 0)
+            hottest.push_back(address);
+
+      std::size_t shown = std::min(top, hottest.size());
+      std::partial_sort(hottest.begin(), hottest.begin() + shown, hottest.end(),
+                        [&](std::size_t a, std::size_t b) { return hits.at(a) > hits.at(b); });
+
+      std::cout << "   address      hits  source\n";
+      for (std::size_t index = 0; index < shown; ++index)
+      {
+         std::size_t address = hottest.at(index);
+         std::cout << "   0x" << std::hex << std::setw(4) << std::setfill('0') << address << std::dec << std::setfill(' ');
+         std::cout << std::setw(12) << hits.at(address) << "  " << source(sources, address) << "\n";
+      }
+
+      std::vector<std::uint64_t> routines (maxMemory);
+      for (const auto& frame : frames)
+         routines.at(frame.address) += frame.self;
+
+      std::cout << "   routine      self  source\n";
+      for (std::size_t address = 0; address < routines.size(); ++address)
+      {
+         if (routines.at(address) == 0)
+            continue;
+
+         std::cout << "   0x" << std::hex << std::setw(4) << std::setfill('0') << address << std::dec << std::setfill(' ');
+         std::cout << std::setw(12) << routines.at(address) << "  " << source(sources, address) << "\n";
+      }
+   }
+
+   // File and line the address was assembled from, or nothing for programs
+   // loaded from executables
+   std::string source(const SourceMap& sources, std::size_t address) const
+   {
+      return (origins.at(address) == noOrigin ? ""s : sources.line(origins.at(address)));
+   }
+
+   static std::string opcode_name(std::size_t opcode)
+   {
+      static constexpr const char* names[] {
+         "NOP", "ADD", "SUB", "MUL", "DIV", "REM", "AND", "OR", "XOR", "NOT", "NEG",
+         "BR", "JMP", "JSR", "LD", "LDI", "LDR", "LEA", "ST", "STI", "STR"
+      };
+      return (opcode < std::size(names) ? names[opcode] : opcode == 63 ? "HALT" : "NOP");
+   }
+};
+
+// Write the call stacks of the profile in the collapsed format flame graph
+// tools read, one line of frames separated by semicolons and the number of
+// instructions executed in the last of them
+inline bool write_flame_graph(Catcher& catcher, const VmContext& vm, const std::filesystem::path& path)
+{
+   const Profile& profile = *vm.profiler;
+   std::ofstream file (path);
+
+   if (!file)
+   {
+      catcher.insert("Failed to write flame graph '"s + path.string() + "'."s);
+      return false;
+   }
+
+   auto name = [&](std::uint16_t address)
+   {
+      std::ostringstream oss;
+      oss << "0x" << std::hex << std::setw(4) << std::setfill('0') << address;
+
+      std::string source = profile.source(vm.sources, address);
+      return (source.empty() ? oss.str() : oss.str() + " "s + source);
+   };
+
+   for (std::uint32_t index = 0; index < profile.frames.size(); ++index)
+   {
+      if (profile.frames.at(index).self == 0)
+         continue;
+
+      std::string stack = name(profile.frames.at(index).address);
+      for (std::uint32_t frame = index; frame != 0;)
+      {
+         frame = profile.frames.at(frame).parent;
+         stack = name(profile.frames.at(frame).address) + ";"s + stack;
+      }
+      file << stack << " " << profile.frames.at(index).self << "\n";
+   }
+   return true;
+}
+
+#endif // PROFILER_HPP
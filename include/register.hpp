@@ -4,8 +4,8 @@
 #include <array>
 #include <cstdint>
 
-// Start of the program counter
-inline std::uint16_t pcStart = 0x3000; // ~12000 in hexadecimal
+// Default start of the program counter
+inline constexpr std::uint16_t defaultPcStart = 0x3000; // ~12000 in hexadecimal
 
 // Registers - 16 usable registers, program counter and condition register
 enum Register : std::uint8_t
@@ -32,7 +32,7 @@ enum Register : std::uint8_t
 };
 
 // Register storage
-inline std::array<std::int32_t, R_COUNT> reg;
+using Registers = std::array<std::int32_t, R_COUNT>;
 
 // Condition flags
 enum class Flag : std::int8_t
@@ -42,18 +42,4 @@ enum class Flag : std::int8_t
    FL_N = 0b001, // Negative flag
 };
 
-// Update condition flags
-inline void update_flags(std::uint8_t r)
-{
-   reg.at(R_COND) = static_cast<std::int32_t>(
-      reg.at(r) == 0 ? Flag::FL_Z : (reg.at(r) >> 31 ? Flag::FL_N : Flag::FL_P)
-   );
-}
-
-// Clear all registers
-inline void clear_registers()
-{
-   reg.fill(0);
-}
-
 #endif // REGISTER_HPP
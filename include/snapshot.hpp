@@ -0,0 +1,181 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include "catcher.hpp"
+#include "context.hpp"
+#include "mapped_file.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// Layout of a .vms snapshot of a running machine, all fields in the byte
+// order of the host:
+//    header         - magic, version, entry point, counts, condition codes
+//                     and the registers, the program counter among them
+//    segment table  - start and size of every segment
+//    page table     - address of the first word of every allocated page
+//    pages          - raw words of every page, one after another from the
+//                     first multiple of vmsAlignment after the tables on
+//
+// Only the pages the program wrote to are saved. The pages are aligned in
+// the file, so loading it maps it and copies them straight out of the
+// mapping, nothing gets executed again.
+inline constexpr char vmsMagic[4] = {'V', 'M', 'S', '1'};
+inline constexpr std::uint16_t vmsVersion = 1;
+inline constexpr std::uint64_t vmsAlignment = 4096;
+
+struct VmsHeader
+{
+   char magic[4];
+   std::uint16_t version;
+   std::uint16_t entry;
+   std::uint32_t segment_count;
+   std::uint32_t page_count;
+   std::int64_t cond;
+   std::int32_t registers[R_COUNT];
+};
+
+struct VmsSegment
+{
+   std::uint32_t start;
+   std::uint32_t size;  // In words
+};
+
+static_assert(sizeof(VmsHeader) == 96 && sizeof(VmsSegment) == 8);
+
+// Offset of the first page, past the header and the tables
+inline std::uint64_t vms_pages_offset(std::uint64_t segment_count, std::uint64_t page_count)
+{
+   std::uint64_t tables = sizeof(VmsHeader) + segment_count * sizeof(VmsSegment) + page_count * sizeof(std::uint32_t);
+   return (tables + vmsAlignment - 1) / vmsAlignment * vmsAlignment;
+}
+
+// Write the registers, the condition codes and the allocated pages of the
+// machine into a snapshot
+inline bool write_snapshot(Catcher& catcher, const VmContext& vm, const std::filesystem::path& path)
+{
+   std::vector<VmsSegment> segments;
+   for (const auto& segment : vm.segments)
+      segments.push_back({segment.start, segment.size});
+
+   std::vector<std::uint32_t> pages;
+   vm.memory.for_each_page([&](std::uint32_t address, const Memory::Page&) { pages.push_back(address); });
+
+   std::ofstream file (path, std::ios::binary | std::ios::trunc);
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to create snapshot '"s + path.string() + "'."s);
+      return false;
+   }
+
+   VmsHeader header {};
+   std::memcpy(header.magic, vmsMagic, sizeof(vmsMagic));
+   header.version = vmsVersion;
+   header.entry = vm.pcStart;
+   header.segment_count = segments.size();
+   header.page_count = pages.size();
+   header.cond = vm.cond;
+   std::memcpy(header.registers, vm.reg.data(), sizeof(header.registers));
+
+   file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+   file.write(reinterpret_cast<const char*>(segments.data()), segments.size() * sizeof(VmsSegment));
+   file.write(reinterpret_cast<const char*>(pages.data()), pages.size() * sizeof(std::uint32_t));
+
+   std::uint64_t tables = sizeof(header) + segments.size() * sizeof(VmsSegment) + pages.size() * sizeof(std::uint32_t);
+   std::vector<char> padding (vms_pages_offset(segments.size(), pages.size()) - tables);
+   file.write(padding.data(), padding.size());
+
+   for (std::uint32_t address : pages)
+   {
+      const auto& words = vm.memory.page(address).words;
+      file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(std::int32_t));
+   }
+
+   if (!file)
+   {
+      catcher.insert("Failed to write snapshot '"s + path.string() + "'."s);
+      return false;
+   }
+   return true;
+}
+
+// Map the snapshot and put the machine back into the state it was taken in.
+// Executor::resume continues the program from there.
+inline bool load_snapshot(Catcher& catcher, VmContext& vm, const std::filesystem::path& path)
+{
+   MappedFile file (path);
+
+   if (!file.is_open())
+   {
+      catcher.insert("Failed to open snapshot '"s + path.string() + "'."s);
+      return false;
+   }
+
+   VmsHeader header;
+   if (file.size() < sizeof(header))
+   {
+      catcher.insert("File '"s + path.string() + "' is too small to be a snapshot."s);
+      return false;
+   }
+   std::memcpy(&header, file.data(), sizeof(header));
+
+   if (std::memcmp(header.magic, vmsMagic, sizeof(vmsMagic)) != 0)
+   {
+      catcher.insert("File '"s + path.string() + "' is not a snapshot."s);
+      return false;
+   }
+
+   if (header.version != vmsVersion)
+   {
+      catcher.insert("Snapshot '"s + path.string() + "' has version " + std::to_string(header.version) +
+                     ", expected version "s + std::to_string(vmsVersion) + "."s);
+      return false;
+   }
+
+   std::uint64_t offset = vms_pages_offset(header.segment_count, header.page_count);
+   if (offset + std::uint64_t(header.page_count) * Memory::pageSize * sizeof(std::int32_t) > file.size())
+   {
+      catcher.insert("Snapshot '"s + path.string() + "' is truncated."s);
+      return false;
+   }
+
+   std::vector<Segment> segments;
+   const std::uint8_t* table = file.data() + sizeof(header);
+   for (std::uint32_t index = 0; index < header.segment_count; ++index, table += sizeof(VmsSegment))
+   {
+      VmsSegment segment;
+      std::memcpy(&segment, table, sizeof(segment));
+
+      if (std::uint64_t(segment.start) + segment.size > maxMemory)
+      {
+         catcher.insert("Snapshot '"s + path.string() + "' has an invalid segment "s + std::to_string(index) + "."s);
+         return false;
+      }
+      segments.push_back({static_cast<std::uint16_t>(segment.start), segment.size});
+   }
+
+   vm.memory.clear();
+   for (std::uint32_t index = 0; index < header.page_count; ++index, table += sizeof(std::uint32_t))
+   {
+      std::uint32_t address;
+      std::memcpy(&address, table, sizeof(address));
+
+      if (address % Memory::pageSize != 0)
+      {
+         catcher.insert("Snapshot '"s + path.string() + "' has an invalid page "s + std::to_string(index) + "."s);
+         return false;
+      }
+
+      const std::uint8_t* words = file.data() + offset + std::uint64_t(index) * Memory::pageSize * sizeof(std::int32_t);
+      vm.memory.write(address, reinterpret_cast<const std::int32_t*>(words), Memory::pageSize);
+   }
+
+   std::memcpy(vm.reg.data(), header.registers, sizeof(header.registers));
+   vm.cond = header.cond;
+   vm.pcStart = header.entry;
+   vm.segments = std::move(segments);
+   vm.fault = {};
+   return true;
+}
+
+#endif // SNAPSHOT_HPP
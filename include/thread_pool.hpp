@@ -0,0 +1,169 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads that share the tasks through work stealing. Every
+// worker has its own queue and takes the newest task from it, so tasks
+// submitted by a worker stay on its core. Once a worker runs out of tasks it
+// steals the oldest one from the other queues before going to sleep.
+class ThreadPool
+{
+public:
+   using Task = std::function<void()>;
+
+   // Constructors
+   explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency())
+   {
+      threads = std::max<std::size_t>(threads, 1);
+
+      for (std::size_t index = 0; index < threads; ++index)
+         queues.push_back(std::make_unique<Queue>());
+      for (std::size_t index = 0; index < threads; ++index)
+         workers.emplace_back([this, index] { work(index); });
+   }
+
+   ~ThreadPool()
+   {
+      wait();
+      {
+         std::lock_guard lock (mutex);
+         stopping = true;
+      }
+      wake.notify_all();
+
+      for (auto& worker : workers)
+         worker.join();
+   }
+
+   ThreadPool(const ThreadPool&) = delete;
+   ThreadPool& operator=(const ThreadPool&) = delete;
+
+   // Number of worker threads
+   std::size_t size() const
+   {
+      return workers.size();
+   }
+
+   // Queue the task. Tasks submitted from outside of the pool are spread
+   // over the workers in turn.
+   void submit(Task task)
+   {
+      std::size_t index = (current_pool == this ? current_worker : next++ % queues.size());
+
+      ++pending;
+      ++queued;
+      {
+         std::lock_guard lock (queues.at(index)->mutex);
+         queues.at(index)->tasks.push_back(std::move(task));
+      }
+
+      // Taking the lock orders the wake up after a worker checks for tasks
+      {
+         std::lock_guard lock (mutex);
+      }
+      wake.notify_one();
+   }
+
+   // Block until every submitted task has finished
+   void wait()
+   {
+      std::unique_lock lock (mutex);
+      done.wait(lock, [this] { return pending == 0; });
+   }
+
+private:
+   struct Queue
+   {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+   };
+
+   std::vector<std::unique_ptr<Queue>> queues;
+   std::vector<std::thread> workers;
+
+   std::mutex mutex;
+   std::condition_variable wake;
+   std::condition_variable done;
+   bool stopping = false;
+
+   std::atomic<std::size_t> pending = 0; // Submitted but not finished
+   std::atomic<std::size_t> queued = 0;  // Submitted but not started
+   std::atomic<std::size_t> next = 0;
+
+   // Pool and queue of the worker running on this thread
+   static inline thread_local ThreadPool* current_pool = nullptr;
+   static inline thread_local std::size_t current_worker = 0;
+
+   // Take the newest task of the worker's own queue
+   bool pop(std::size_t index, Task& task)
+   {
+      Queue& queue = *queues.at(index);
+      std::lock_guard lock (queue.mutex);
+
+      if (queue.tasks.empty())
+         return false;
+
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      return true;
+   }
+
+   // Take the oldest task of any other queue
+   bool steal(std::size_t index, Task& task)
+   {
+      for (std::size_t offset = 1; offset < queues.size(); ++offset)
+      {
+         Queue& queue = *queues.at((index + offset) % queues.size());
+         std::lock_guard lock (queue.mutex);
+
+         if (queue.tasks.empty())
+            continue;
+
+         task = std::move(queue.tasks.front());
+         queue.tasks.pop_front();
+         return true;
+      }
+      return false;
+   }
+
+   void work(std::size_t index)
+   {
+      current_pool = this;
+      current_worker = index;
+
+      while (true)
+      {
+         Task task;
+
+         if (pop(index, task) || steal(index, task))
+         {
+            --queued;
+            task();
+
+            if (--pending == 0)
+            {
+               std::lock_guard lock (mutex);
+               done.notify_all();
+            }
+            continue;
+         }
+
+         std::unique_lock lock (mutex);
+         wake.wait(lock, [this] { return stopping || queued > 0; });
+
+         if (stopping && queued == 0)
+            return;
+      }
+   }
+};
+
+#endif // THREAD_POOL_HPP
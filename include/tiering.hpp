@@ -0,0 +1,90 @@
+#ifndef TIERING_HPP
+#define TIERING_HPP
+
+#include "fusion.hpp"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Default number of times a branch target has to be reached before the code
+// behind it gets promoted
+inline constexpr std::uint32_t defaultThreshold = 1000;
+
+// Execution tiers of the tiered engine
+enum class Tier : std::uint8_t
+{
+   interpreted, // Raw instructions through the opcode table
+   optimized,   // Decoded basic blocks with superinstructions
+};
+
+// Summary of the tiered execution of a program
+struct TierReport
+{
+   struct Event
+   {
+      std::uint16_t address;
+      std::size_t instructions;       // Instructions promoted together
+      std::chrono::nanoseconds when;  // Time since the start of execution
+   };
+
+   std::uint32_t threshold = defaultThreshold;
+   std::vector<Event> events;
+   std::chrono::nanoseconds time[2] {};
+
+   // Display the tier-up events and the time spent in each tier
+   void display() const
+   {
+      using std::chrono::duration_cast, std::chrono::microseconds;
+
+      std::cout << events.size() << " tier-up" << (events.size() == 1 ? "" : "s");
+      std::cout << " with threshold " << threshold << ".\n";
+
+      for (const auto& event : events)
+      {
+         std::cout << "   0x" << std::hex << event.address << std::dec << ": ";
+         std::cout << event.instructions << " instruction" << (event.instructions == 1 ? "" : "s");
+         std::cout << " at " << duration_cast<microseconds>(event.when).count() << "us\n";
+      }
+
+      std::cout << "Interpreted tier: " << duration_cast<microseconds>(time[0]).count() << "us, ";
+      std::cout << "optimized tier: " << duration_cast<microseconds>(time[1]).count() << "us.\n";
+   }
+};
+
+// Decode all of the code reachable from the entry that isn't promoted yet,
+// following the same edges as fuse_blocks. Returns how many instructions got
+// promoted.
+inline std::size_t promote_reachable(VmContext& vm, std::uint16_t entry, std::vector<bool>& promoted)
+{
+   std::size_t count = 0;
+   std::vector<std::int64_t> work {entry};
+
+   auto push = [&](std::int64_t address)
+   {
+      if (address >= 0 && address < static_cast<std::int64_t>(maxMemory))
+         work.push_back(address);
+   };
+
+   while (!work.empty())
+   {
+      std::int64_t address = work.back();
+      work.pop_back();
+
+      if (promoted.at(address))
+         continue;
+
+      promoted.at(address) = true;
+      vm.decoded.at(address) = decode_instruction(vm.memory[address], address);
+      ++count;
+
+      const Decoded& d = vm.decoded.at(address);
+
+      if (d.handler == decoded_br || d.handler == decoded_jsr)
+         push(d.imm + 1);
+      if (d.handler != decoded_jmp && d.handler != decoded_ret && d.handler != decoded_halt)
+         push(address + 1);
+   }
+   return count;
+}
+
+#endif // TIERING_HPP
@@ -0,0 +1,110 @@
+#ifndef TOKEN_HPP
+#define TOKEN_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::string_literals;
+
+// Tokens used in the lexer, 12 bytes each. The lexeme isn't stored, only
+// where it starts and how long it is. Identifiers and strings carry the id
+// of their name in the interner of their file, numbers and registers their
+// value, keywords and directives what they stand for and labels get the
+// address they stand for once they are translated.
+struct Token
+{
+   enum class Type : std::uint8_t
+   {
+      keyword, identifier, directive, regis, number, string, label, comma,
+      colon, eof
+   };
+
+   std::uint32_t offset = 0;  // In the file, or in the source map once translated
+   std::int32_t value = 0;
+   std::uint16_t length = 0;  // Stops growing at the largest value
+   Type type = Type::eof;
+};
+
+static_assert(sizeof(Token) == 12);
+
+// Source texts of an assembly laid out one after another in a single range
+// of offsets, so translated tokens of every file point into them with just
+// their offset. Lexemes and positions are only looked up for error messages
+// and profiles.
+class SourceMap
+{
+public:
+   // Add the text of the file the owner keeps alive, returns the offset it
+   // starts at
+   std::uint32_t add(std::shared_ptr<const void> owner, std::string_view text, const std::string& file = ""s)
+   {
+      std::uint32_t base = end;
+
+      // One more for the EOF, so it doesn't point into the next text
+      entries.push_back({base, text, std::move(owner), file});
+      end += static_cast<std::uint32_t>(text.size()) + 1;
+      return base;
+   }
+
+   // Text the token was lexed from
+   std::string_view lexeme(const Token& token) const
+   {
+      const Entry* entry = find(token.offset);
+      if (!entry)
+         return {};
+
+      std::size_t offset = token.offset - entry->base;
+      return entry->text.substr(std::min(offset, entry->text.size()), token.length);
+   }
+
+   // Line and column of the token, counted from the start of its text
+   std::string location(const Token& token) const
+   {
+      const Entry* entry = find(token.offset);
+      if (!entry)
+         return ""s;
+
+      std::string_view before = entry->text.substr(0, std::min<std::size_t>(token.offset - entry->base, entry->text.size()));
+      std::size_t line = std::count(before.begin(), before.end(), '\n') + 1;
+      std::size_t column = before.size() - (before.rfind('\n') + 1) + 1;
+
+      return " at line "s + std::to_string(line) + ", column "s + std::to_string(column);
+   }
+
+   // File and line of the offset as 'file:line', empty when the offset
+   // isn't in any of the texts
+   std::string line(std::uint32_t offset) const
+   {
+      const Entry* entry = find(offset);
+      if (!entry || offset - entry->base > entry->text.size())
+         return ""s;
+
+      std::string_view before = entry->text.substr(0, offset - entry->base);
+      return entry->file + ":"s + std::to_string(std::count(before.begin(), before.end(), '\n') + 1);
+   }
+
+private:
+   struct Entry
+   {
+      std::uint32_t base;
+      std::string_view text;
+      std::shared_ptr<const void> owner;
+      std::string file;
+   };
+
+   std::vector<Entry> entries;
+   std::uint32_t end = 0;
+
+   const Entry* find(std::uint32_t offset) const
+   {
+      auto after = std::upper_bound(entries.begin(), entries.end(), offset,
+                                    [](std::uint32_t offset, const Entry& entry) { return offset < entry.base; });
+      return (after == entries.begin() ? nullptr : &*(after - 1));
+   }
+};
+
+#endif // TOKEN_HPP
@@ -0,0 +1,457 @@
+#ifndef TOKEN_CACHE_HPP
+#define TOKEN_CACHE_HPP
+
+#include "context.hpp"
+#include "lexer.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Tokens of a single source file along with the text they point into and
+// the names of its identifiers and strings
+struct TokenStream
+{
+   std::shared_ptr<const void> source;
+   std::string_view text;
+   std::vector<Token> tokens;
+   Interner names;
+};
+
+// Directory of the disk cache of the user running the program, inside of the
+// temporary directory every user shares
+inline fs::path user_cache_directory()
+{
+#ifdef VM_MMAP
+   return fs::temp_directory_path() / ("vm32bit-cache-"s + std::to_string(geteuid()));
+#else
+   return fs::temp_directory_path() / "vm32bit-cache";
+#endif
+}
+
+// Cache of token streams keyed by the hash of the file contents, so files
+// that didn't change since they were last seen are never lexed again. Streams
+// are kept in memory and, when the cache has a directory, written to disk to
+// outlive the process. Only a directory no other user can write to is used,
+// and every token read back is checked against the text it was lexed from.
+// It can be shared by multiple threads.
+class TokenCache
+{
+public:
+   struct Statistics
+   {
+      std::size_t memory_hits = 0;
+      std::size_t disk_hits = 0;
+      std::size_t misses = 0;
+   };
+
+   // Constructors
+   explicit TokenCache(const fs::path& directory = {})
+      : directory(private_directory(directory)) {}
+   ~TokenCache() = default;
+
+   // Tokens of the file, lexed only when its contents weren't seen before.
+   // Returns nullptr and leaves the errors in the catcher when the file can't
+   // be read or tokenized.
+   std::shared_ptr<const TokenStream> tokenize(Catcher& catcher, const fs::path& path)
+   {
+      MappedFile file (path);
+
+      if (!file.is_open())
+      {
+         catcher.insert("Failed to open file '"s + path.string() + "'."s);
+         return nullptr;
+      }
+
+      auto text = std::make_shared<const std::string>();
+      if (file.size() > 0)
+         text = std::make_shared<const std::string>(reinterpret_cast<const char*>(file.data()), file.size());
+      std::uint64_t hash = hash_text(*text);
+
+      {
+         std::lock_guard lock (mutex);
+         auto entry = entries.find(hash);
+
+         if (entry != entries.end() && *entry->second.text == *text)
+         {
+            ++statistics.memory_hits;
+            return entry->second.stream;
+         }
+      }
+
+      auto stream = load(hash, text);
+      bool loaded = (stream != nullptr);
+
+      if (!loaded)
+      {
+         Lexer lexer (catcher, path, *text);
+         auto& tokens = lexer.tokenize();
+
+         if (catcher.any_errors())
+            return nullptr;
+
+         stream = std::make_shared<TokenStream>(TokenStream {text, *text, std::move(tokens), std::move(lexer.get_names())});
+         store(hash, *stream);
+      }
+
+      std::lock_guard lock (mutex);
+      ++(loaded ? statistics.disk_hits : statistics.misses);
+
+      if (entries.size() >= maxEntries)
+         entries.clear();
+      entries[hash] = {text, stream};
+      return stream;
+   }
+
+   // Hits and misses since the cache was created or cleared
+   Statistics get_statistics() const
+   {
+      std::lock_guard lock (mutex);
+      return statistics;
+   }
+
+   // Forget all of the streams, including the ones on disk
+   void clear()
+   {
+      std::lock_guard lock (mutex);
+      entries.clear();
+      statistics = {};
+
+      std::error_code error;
+      if (!directory.empty())
+         for (const auto& entry : fs::directory_iterator(directory, error))
+            if (entry.path().extension() == ".tok")
+               fs::remove(entry.path(), error);
+   }
+
+private:
+   // Bump whenever the layout of the tokens or the meaning of their values
+   // changes, so streams of older builds are lexed again
+   static constexpr std::uint32_t version = 2;
+   static constexpr std::size_t maxEntries = 4096;
+
+   struct Entry
+   {
+      std::shared_ptr<const std::string> text;
+      std::shared_ptr<const TokenStream> stream;
+   };
+
+   // Layout of a stream on disk: the header, the source text, the tokens as
+   // they are in memory and every name as its length followed by its bytes
+   struct Header
+   {
+      char magic[4];
+      std::uint32_t version;
+      std::uint64_t hash;
+      std::uint64_t text_size;
+      std::uint64_t token_count;
+      std::uint64_t name_count;
+      std::uint64_t names_size;
+   };
+
+   static constexpr char magic[4] = {'T', 'O', 'K', 'S'};
+
+   fs::path directory;
+   mutable std::mutex mutex;
+   std::unordered_map<std::uint64_t, Entry> entries;
+   Statistics statistics;
+
+   // The directory, created accessible to the user alone, or an empty path
+   // when it belongs to another user or others can write to it, since the
+   // streams in it end up in the assembled programs
+   static fs::path private_directory(const fs::path& directory)
+   {
+#ifdef VM_MMAP
+      if (directory.empty())
+         return directory;
+
+      std::error_code error;
+      fs::create_directories(directory.parent_path(), error);
+      ::mkdir(directory.c_str(), 0700);
+
+      struct stat status;
+      if (::lstat(directory.c_str(), &status) != 0 || !S_ISDIR(status.st_mode) || status.st_uid != ::geteuid() ||
+          (status.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+         return {};
+
+      if ((status.st_mode & 0777) != 0700 && ::chmod(directory.c_str(), 0700) != 0)
+         return {};
+#endif
+      return directory;
+   }
+
+   // Whether the token is one the lexer could have made out of the text it
+   // points into, with the value it would have given it
+   static bool valid_token(const Token& token, std::string_view text, const Interner& names)
+   {
+      if (std::uint64_t(token.offset) + token.length > text.size())
+         return false;
+      std::string_view lexeme = text.substr(token.offset, token.length);
+
+      switch (token.type)
+      {
+         case Token::Type::keyword: case Token::Type::regis: case Token::Type::directive:
+         {
+            const Keyword* keyword = keyword_table.find(lexeme);
+            return keyword && keyword->type == token.type && keyword->value == token.value;
+         }
+         case Token::Type::number:
+         {
+            NumberLexeme number = scan_number(text.substr(token.offset));
+            return !number.invalid && number.value <= 0xFFFF'FFFF && number.bits() == token.value &&
+                   std::min<std::size_t>(number.length, UINT16_MAX) == token.length;
+         }
+         case Token::Type::identifier: case Token::Type::string:
+         {
+            // Names longer than a token can tell are cut off in the lexeme
+            if (std::uint32_t(token.value) >= names.size())
+               return false;
+            std::string_view name = names.name(std::uint32_t(token.value));
+            return name == lexeme || (token.length == UINT16_MAX && name.starts_with(lexeme));
+         }
+         case Token::Type::comma:
+            return lexeme == ","sv && token.value == 0;
+         case Token::Type::colon:
+            return lexeme == ":"sv && token.value == 0;
+         case Token::Type::eof:
+            return token.length == 0 && token.value == 0;
+         default:
+            return false;
+      }
+   }
+
+   static std::uint64_t hash_text(std::string_view text)
+   {
+      std::uint64_t hash = 14695981039346656037ull;
+      for (char ch : text)
+         hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+      return hash;
+   }
+
+   fs::path entry_path(std::uint64_t hash) const
+   {
+      char name[32];
+      std::snprintf(name, sizeof(name), "%016llx.tok", static_cast<unsigned long long>(hash));
+      return directory / name;
+   }
+
+   // Read the stream of the text from disk, nullptr when it isn't there
+   std::shared_ptr<TokenStream> load(std::uint64_t hash, std::shared_ptr<const std::string> text) const
+   {
+      if (directory.empty())
+         return nullptr;
+
+      MappedFile file (entry_path(hash));
+      Header header;
+
+      if (!file.is_open() || file.size() < sizeof(header))
+         return nullptr;
+      std::memcpy(&header, file.data(), sizeof(header));
+
+      if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version ||
+          header.hash != hash || header.text_size != text->size())
+         return nullptr;
+
+      // Every part has to fit into what's left of the file, so the sizes of
+      // a crafted header can't wrap around
+      std::uint64_t left = file.size() - sizeof(header);
+      if (header.text_size > left)
+         return nullptr;
+      left -= header.text_size;
+
+      if (header.token_count > left / sizeof(Token))
+         return nullptr;
+      left -= header.token_count * sizeof(Token);
+
+      if (header.names_size != left)
+         return nullptr;
+
+      // Hashes can collide, the text has to match as well
+      const std::uint8_t* data = file.data() + sizeof(header);
+      if (std::memcmp(data, text->data(), text->size()) != 0)
+         return nullptr;
+      data += text->size();
+
+      auto stream = std::make_shared<TokenStream>();
+      stream->source = text;
+      stream->text = *text;
+      stream->tokens.resize(header.token_count);
+      std::memcpy(stream->tokens.data(), data, header.token_count * sizeof(Token));
+      data += header.token_count * sizeof(Token);
+
+      const std::uint8_t* end = data + header.names_size;
+      for (std::uint64_t id = 0; id < header.name_count; ++id)
+      {
+         std::uint32_t length;
+         if (end - data < std::ptrdiff_t(sizeof(length)))
+            return nullptr;
+         std::memcpy(&length, data, sizeof(length));
+         data += sizeof(length);
+
+         if (end - data < std::ptrdiff_t(length))
+            return nullptr;
+         stream->names.intern({reinterpret_cast<const char*>(data), length});
+         data += length;
+      }
+
+      if (data != end || stream->names.size() != header.name_count)
+         return nullptr;
+
+      // The stream ends with the only EOF
+      const auto& tokens = stream->tokens;
+      if (tokens.empty() || tokens.back().type != Token::Type::eof)
+         return nullptr;
+
+      for (std::size_t index = 0; index < tokens.size(); ++index)
+         if (!valid_token(tokens[index], *text, stream->names) ||
+             (tokens[index].type == Token::Type::eof && index + 1 != tokens.size()))
+            return nullptr;
+      return stream;
+   }
+
+   // Write the stream to disk. The file is written under a temporary name
+   // and renamed, so other processes never read half of it.
+   void store(std::uint64_t hash, const TokenStream& stream) const
+   {
+      if (directory.empty())
+         return;
+
+      std::error_code error;
+      fs::path path = entry_path(hash);
+      fs::path temporary = path;
+      temporary += "."s + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+      {
+         std::ofstream file (temporary, std::ios::binary | std::ios::trunc);
+         if (!file.is_open())
+            return;
+
+         std::string names;
+         for (std::uint32_t id = 0; id < stream.names.size(); ++id)
+         {
+            std::string_view name = stream.names.name(id);
+            std::uint32_t length = name.size();
+
+            names.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            names.append(name);
+         }
+
+         Header header {};
+         std::memcpy(header.magic, magic, sizeof(magic));
+         header.version = version;
+         header.hash = hash;
+         header.text_size = stream.text.size();
+         header.token_count = stream.tokens.size();
+         header.name_count = stream.names.size();
+         header.names_size = names.size();
+
+         file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+         file.write(stream.text.data(), stream.text.size());
+         file.write(reinterpret_cast<const char*>(stream.tokens.data()), stream.tokens.size() * sizeof(Token));
+         file.write(names.data(), names.size());
+
+         if (!file)
+         {
+            file.close();
+            fs::remove(temporary, error);
+            return;
+         }
+      }
+      fs::rename(temporary, path, error);
+   }
+};
+
+// Tokenize the file, through the cache when there is one. Returns nullptr
+// when the catcher got errors.
+inline std::shared_ptr<const TokenStream> lex_file(Catcher& catcher, TokenCache* cache, const fs::path& path)
+{
+   if (cache)
+      return cache->tokenize(catcher, path);
+
+   Lexer lexer (catcher, path);
+   auto& tokens = lexer.tokenize();
+
+   if (catcher.any_errors())
+      return nullptr;
+   return std::make_shared<TokenStream>(TokenStream {lexer.source(), lexer.get_text(), std::move(tokens),
+                                                     std::move(lexer.get_names())});
+}
+
+// Tokenize the file, unless its tokens were already lexed ahead of time.
+// Returns nullptr when the catcher got errors.
+inline std::shared_ptr<const TokenStream> tokenize_file(Catcher& catcher, VmContext& vm, const fs::path& path)
+{
+   auto prefetched = vm.prefetched.find(path.string());
+
+   if (prefetched != vm.prefetched.end())
+      return prefetched->second;
+   return lex_file(catcher, vm.cache, path);
+}
+
+// Lex every file the tokens include, directly or through other files, on
+// the threads of the machine. Files are lexed as soon as an include of them
+// is found, the translator then visits them in the same order as before and
+// only finds their tokens ready, so the output doesn't change. Files that
+// can't be lexed are left to the translator to report in order.
+inline void tokenize_includes(VmContext& vm, const TokenStream& stream)
+{
+   auto includes = [](const TokenStream& stream, auto&& visit)
+   {
+      const auto& tokens = stream.tokens;
+
+      for (std::size_t index = 0; index + 1 < tokens.size(); ++index)
+         if (tokens[index].type == Token::Type::directive && tokens[index].value == D_INCLUDE &&
+             tokens[index + 1].type == Token::Type::string)
+            visit(std::string(stream.names.name(tokens[index + 1].value)));
+   };
+
+   bool any = false;
+   includes(stream, [&any](const std::string&) { any = true; });
+
+   if (vm.threads < 2 || !any)
+      return;
+
+   std::mutex mutex;
+   std::unordered_set<std::string> seen;
+   ThreadPool pool (vm.threads);
+
+   std::function<void(const TokenStream&)> discover = [&](const TokenStream& stream)
+   {
+      includes(stream, [&](const std::string& file)
+      {
+         {
+            std::lock_guard lock (mutex);
+            if (!seen.insert(file).second)
+               return;
+         }
+
+         pool.submit([&, file]
+         {
+            Catcher catcher;
+            if (!fs::is_regular_file(file))
+               return;
+
+            auto stream = lex_file(catcher, vm.cache, file);
+            if (!stream)
+               return;
+
+            {
+               std::lock_guard lock (mutex);
+               vm.prefetched.emplace(file, stream);
+            }
+            discover(*stream);
+         });
+      });
+   };
+
+   discover(stream);
+   pool.wait();
+}
+
+#endif // TOKEN_CACHE_HPP
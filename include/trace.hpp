@@ -0,0 +1,226 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "catcher.hpp"
+#include "disassembler.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Instruction recorded by the trace, along with what it left behind
+struct TraceEntry
+{
+   std::uint32_t instr;
+   std::int32_t value;   // Of the destination register after the instruction, the
+                         // address of the next one for the program counter
+   std::uint16_t pc;
+   std::uint8_t reg;     // Destination register, the program counter for jumps
+   std::uint8_t flags;   // Condition codes after the instruction
+};
+
+static_assert(sizeof(TraceEntry) == 12);
+
+// Register an instruction writes, or the one worth looking at for those that
+// write none. Stores show the register they store. Every opcode picks the
+// register field out of the instruction or a fixed register, without any
+// branches.
+struct TraceRegister
+{
+   std::uint8_t shift;
+   std::uint8_t mask;
+   std::uint8_t fixed;
+};
+
+inline constexpr std::array<TraceRegister, 64> trace_registers = []
+{
+   std::array<TraceRegister, 64> table {};
+   table.fill({0, 0, R_PC});
+
+   for (std::size_t opcode = 1; opcode <= 8; ++opcode)
+      table[opcode] = {7, 0b1111, 0};
+   for (std::size_t opcode : {9, 10, 14, 15, 16, 17, 18, 19, 20})
+      table[opcode] = {6, 0b1111, 0};
+   table[13] = {0, 0, R_R15};
+   return table;
+}();
+
+inline std::uint8_t trace_register(std::uint32_t instr)
+{
+   const TraceRegister& field = trace_registers[instr & 0b111111];
+   return ((instr >> field.shift) & field.mask) | field.fixed;
+}
+
+// Layout of a binary .trc dump, all fields in the byte order of the host:
+//    header   - magic, version, number of entries and instructions recorded
+//    entries  - the entries from the oldest to the latest
+inline constexpr char trcMagic[4] = {'T', 'R', 'C', '1'};
+inline constexpr std::uint16_t trcVersion = 1;
+
+struct TrcHeader
+{
+   char magic[4];
+   std::uint16_t version;
+   std::uint16_t entry_size;
+   std::uint32_t count;
+   std::uint32_t padding;
+   std::uint64_t recorded;
+};
+
+static_assert(sizeof(TrcHeader) == 24);
+
+// Ring of the last instructions the executor ran. It only ever has a single
+// writer, the thread running the program, which publishes the entries by
+// moving the head forward. Readers never block it, they copy the entries
+// behind the head and drop the ones the writer could have overwritten in
+// the meantime. While a program runs, the head can lag behind the latest
+// entries by less than the publish interval. Only the threaded engine and
+// the profiler record into it, programs traced with any other engine run
+// on the threaded one.
+class TraceBuffer
+{
+public:
+   static constexpr std::size_t defaultCapacity = 4096;
+   static constexpr std::size_t maxCapacity = 1 << 24;  // 192MB of entries
+
+   // Constructors
+   explicit TraceBuffer(std::size_t capacity = defaultCapacity)
+      : entries(std::bit_ceil(std::max<std::size_t>(capacity, 1))), mask(entries.size() - 1) {}
+   ~TraceBuffer() = default;
+
+   // Records the instructions of a single execution. The position is kept
+   // by the writer, so it can stay in a register, and published to readers
+   // every few entries and once the writer goes away.
+   class Writer
+   {
+   public:
+      static constexpr std::uint64_t publishInterval = 64;
+
+      // Constructors
+      explicit Writer(TraceBuffer* buffer)
+         : buffer(buffer), ring(buffer ? buffer->entries.data() : nullptr),
+           mask(buffer ? buffer->mask : 0), next(buffer ? buffer->next : 0) {}
+      ~Writer()
+      {
+         if (buffer)
+            buffer->publish(next);
+      }
+
+      Writer(const Writer&) = delete;
+      Writer& operator=(const Writer&) = delete;
+
+      // Record the instruction at the address that just ran, with the
+      // program counter already moved on to the next one
+      void record(const Registers& reg, std::int32_t pc, std::uint32_t instr, std::int32_t flags)
+      {
+         std::uint8_t r = trace_register(instr);
+         ring[next & mask] = {instr, reg[r], static_cast<std::uint16_t>(pc), r, static_cast<std::uint8_t>(flags)};
+
+         if (++next % publishInterval == 0)
+            buffer->publish(next);
+      }
+
+   private:
+      TraceBuffer* buffer;
+      TraceEntry* ring;
+      std::size_t mask;
+      std::uint64_t next;
+   };
+
+   // Forget every entry
+   void clear()
+   {
+      publish(0);
+   }
+
+   std::size_t capacity() const
+   {
+      return entries.size();
+   }
+
+   // Instructions recorded since the trace was cleared
+   std::uint64_t recorded() const
+   {
+      return head.load(std::memory_order_acquire);
+   }
+
+   // Copy of the last entries, up to the count, from the oldest to the latest
+   std::vector<TraceEntry> snapshot(std::size_t count = defaultCapacity) const
+   {
+      std::uint64_t end = head.load(std::memory_order_acquire);
+      std::uint64_t begin = end - std::min<std::uint64_t>({end, count, entries.size()});
+
+      std::vector<TraceEntry> copy;
+      copy.reserve(end - begin);
+      for (std::uint64_t index = begin; index < end; ++index)
+         copy.push_back(entries[index & mask]);
+
+      // The writer went on while copying, whatever it lapped is gone
+      std::uint64_t now = head.load(std::memory_order_acquire);
+      std::uint64_t lapped = (now > entries.size() ? now - entries.size() : 0);
+      if (lapped > begin)
+         copy.erase(copy.begin(), copy.begin() + std::min<std::uint64_t>(lapped - begin, copy.size()));
+      return copy;
+   }
+
+   // Display the last entries disassembled
+   void display(std::size_t count = 32) const
+   {
+      auto copy = snapshot(count);
+      std::uint64_t total = recorded();
+
+      std::cout << "Last " << copy.size() << " of " << total << " instruction" << (total == 1 ? "" : "s") << ":\n";
+      for (const auto& entry : copy)
+      {
+         std::string text = disassemble(entry.instr, entry.pc);
+         std::string reg = (entry.reg == R_PC ? "PC"s : "R"s + std::to_string(entry.reg));
+
+         std::cout << "   " << hex_address(entry.pc) << "  " << std::left << std::setw(24) << text << std::right;
+         std::cout << reg << " = " << (entry.reg == R_PC ? hex_address(entry.value) : std::to_string(entry.value));
+         std::cout << "  " << ((entry.flags & 0b001) ? "n" : "-") << ((entry.flags & 0b010) ? "z" : "-");
+         std::cout << ((entry.flags & 0b100) ? "p" : "-") << "\n";
+      }
+   }
+
+   // Write the entries into a binary .trc file
+   bool write(Catcher& catcher, const std::filesystem::path& path) const
+   {
+      auto copy = snapshot(entries.size());
+
+      TrcHeader header {};
+      std::memcpy(header.magic, trcMagic, sizeof(trcMagic));
+      header.version = trcVersion;
+      header.entry_size = sizeof(TraceEntry);
+      header.count = static_cast<std::uint32_t>(copy.size());
+      header.recorded = recorded();
+
+      std::ofstream file (path, std::ios::binary);
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char*>(copy.data()), copy.size() * sizeof(TraceEntry));
+
+      if (!file)
+      {
+         catcher.insert("Failed to write trace '"s + path.string() + "'."s);
+         return false;
+      }
+      return true;
+   }
+
+private:
+   std::vector<TraceEntry> entries;
+   std::size_t mask;
+   std::uint64_t next = 0;  // Of the writer, ahead of the head while it runs
+   std::atomic<std::uint64_t> head = 0;
+
+   void publish(std::uint64_t position)
+   {
+      next = position;
+      head.store(position, std::memory_order_release);
+   }
+};
+
+#endif // TRACE_HPP
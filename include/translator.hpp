@@ -1,129 +1,220 @@
 #ifndef TRANSLATOR_HPP
 #define TRANSLATOR_HPP
 
+#include "context.hpp"
 #include "lexer.hpp"
-#include "register.hpp"
-#include <algorithm>
-#include <unordered_map>
-
-// Store translated files to avoid infinite include loops
-inline std::unordered_set<std::string> translated_files;
+#include "object.hpp"
+#include "token_cache.hpp"
 
 // Translator finds all labels in the code and replaces them with their
-// memory address and handles includes
+// memory address and handles includes. The translated tokens are appended to
+// a single output stream, included files write straight into the stream of
+// the file that includes them, so every token is copied once no matter how
+// many includes there are.
 class Translator
 {
 public:
+   // Position of the memory index after a run of tokens. It either moved by
+   // some words from wherever it was, or got set by an .ORG.
+   struct Extent
+   {
+      bool absolute = false;
+      size_t index = 0;
+
+      void advance(const Extent& other)
+      {
+         if (other.absolute)
+            *this = other;
+         else
+            index += other.index;
+      }
+   };
+
    // Constructors
-   Translator(Catcher& catcher, std::vector<Token>& tokens)
-      : catcher(catcher), tokens(tokens) {}
+   Translator(Catcher& catcher, VmContext& vm, const TokenStream& stream)
+      : catcher(catcher), vm(vm), tokens(stream.tokens), names(stream.names),
+        base(vm.sources.add(stream.source, stream.text, catcher.get_file())) {}
    ~Translator() = default;
 
-   // Translate the tokens
-   void translate()
+   // Translate the tokens into a new stream
+   std::vector<Token> translate()
+   {
+      std::vector<Token> output;
+      output.reserve(tokens.size());
+
+      translate_into(output);
+
+      // Labels of the file itself are what an object module exports, in the
+      // order they first appear so the object file is always the same
+      if (vm.object)
+         for (std::uint32_t symbol = 0; symbol < names.size(); ++symbol)
+            if (defined.at(symbol))
+               vm.object->export_symbol(names.name(symbol), addresses.at(symbol), relocatable.at(symbol));
+
+      push(output, tokens.back());
+      return output;
+   }
+
+private:
+   Catcher& catcher;
+   VmContext& vm;
+   const std::vector<Token>& tokens;
+   const Interner& names;
+   std::uint32_t base;  // Of the file in the source map
+   size_t start = vm.pcStart;
+   size_t index = 0;
+   Extent extent;
+
+   // Labels of the file by the id of their name, along with the positions
+   // of the output they are used at
+   std::vector<std::int32_t> addresses = std::vector<std::int32_t>(names.size());
+   std::vector<bool> defined = std::vector<bool>(names.size());
+   std::vector<bool> relocatable = std::vector<bool>(names.size());
+   std::vector<std::pair<size_t, std::uint32_t>> references;
+
+   // Append the translated tokens without the EOF to the output. Returns
+   // false when the translation had to stop because of an error.
+   bool translate_into(std::vector<Token>& output)
    {
-      // Find all definitions and labels
       while (!is(Token::Type::eof))
       {
-         auto& token = tokens.at(index);
+         const Token& token = tokens.at(index);
 
          if (is(Token::Type::identifier))
          {
-            if (peek(Token::Type::colon) && definitions.count(token.lexeme))
-               catcher.insert("Label '"s + token.lexeme + "' is already defined."s);
+            std::uint32_t symbol = token.value;
+
+            if (peek(Token::Type::colon) && defined.at(symbol))
+            {
+               catcher.insert("Label '"s + std::string(names.name(symbol)) + "' is already defined."s);
+               push(output, token);
+            }
             else if (peek(Token::Type::colon))
             {
-               definitions[token.lexeme] = std::to_string(memory_index);
-               token.lexeme = tokens.at(index + 1).lexeme = "FLAG_FOR_DEL"s;
+               addresses.at(symbol) = memory_index();
+               defined.at(symbol) = true;
+               relocatable.at(symbol) = !extent.absolute;
+
+               // Skip the colon along with the label
+               advance();
             }
             else
-               labels.push_back({token.lexeme, index});
+            {
+               references.push_back({output.size(), symbol});
+               push(output, token);
+            }
          }
-         else if (is(Token::Type::directive) || is(Token::Type::keyword))
+         else if (is(Token::Type::directive) && token.value == D_ORG)
          {
-            if (token.lexeme == ".ORG"s)
+            push(output, token);
+            advance();
+
+            if (is(Token::Type::eof))
+               continue;
+
+            push(output, tokens.at(index));
+
+            if (is(Token::Type::number))
             {
-               advance();
-               
-               if (is(Token::Type::number))
-               {
-                  memory_index = std::stoi(tokens.at(index).lexeme);
-                  if (memory_index < pcStart)
-                     pcStart = memory_index;
-               }
-               else
-                  tokens.at(index).type = Token::Type::label;
+               extent = {true, static_cast<size_t>(tokens.at(index).value)};
+               if (extent.index < vm.pcStart)
+                  vm.pcStart = extent.index;
             }
-            else if (token.lexeme == ".INCLUDE"s)
-            {
-               token.lexeme = "FLAG_FOR_DEL"s;
-               advance();
-
-               if (!is(Token::Type::string))
-               {
-                  catcher.insert("Expected string after '.INCLUDE' directive, got '"s + tokens.at(index).lexeme + "' instead."s);
-                  return;
-               }
+            else
+               output.back().type = Token::Type::label;
+         }
+         else if (is(Token::Type::directive) && token.value == D_INCLUDE)
+         {
+            advance();
 
-               if (!fs::is_regular_file(tokens.at(index).lexeme))
-               {
-                  catcher.insert("File '"s + tokens.at(index).lexeme + "' could not be included as it cannot be opened or found."s);
-                  return;
-               }
+            if (!is(Token::Type::string))
+            {
+               catcher.insert("Expected string after '.INCLUDE' directive, got '"s +
+                              std::string(vm.sources.lexeme(rebase(tokens.at(index)))) + "' instead."s);
+               return false;
+            }
 
-               if (translated_files.count(tokens.at(index).lexeme))
-               {
-                  tokens.at(index).lexeme = "FLAG_FOR_DEL"s;
-                  advance();
-                  continue;
-               }
-               translated_files.insert(tokens.at(index).lexeme);
+            std::string file (names.name(tokens.at(index).value));
 
-               std::string original = catcher.get_file();
-               catcher.specify(tokens.at(index).lexeme);
+            if (!fs::is_regular_file(file))
+            {
+               catcher.insert("File '"s + file + "' could not be included as it cannot be opened or found."s);
+               return false;
+            }
 
-               Lexer lexer (catcher, tokens.at(index).lexeme);
-               auto& tokens2 = lexer.tokenize();
+            if (!vm.translated_files.insert(file).second)
+            {
+               advance();
+               continue;
+            }
 
-               if (catcher.any_errors())
-                  return;
+            std::string original = catcher.get_file();
+            catcher.specify(file);
 
-               Translator translator (catcher, tokens2);
-               translator.translate();
+            auto included = tokenize_file(catcher, vm, file);
 
-               if (catcher.any_errors())
-                  return;
+            if (!included)
+               return false;
 
-               // pop off the EOF token to avoid duplicates
-               if (!tokens2.empty())
-                  tokens2.pop_back();
+            Translator translator (catcher, vm, *included);
+            if (!translator.translate_into(output) || catcher.any_errors())
+               return false;
 
-               catcher.specify(original);
-               tokens.at(index).lexeme = "FLAG_FOR_DEL"s;
-               tokens.insert(tokens.begin() + index + 1, tokens2.begin(), tokens2.end());
-            }
-            else
-               ++memory_index;
+            catcher.specify(original);
+            extent.advance(translator.extent);
+         }
+         else
+         {
+            if (is(Token::Type::directive) || is(Token::Type::keyword))
+               ++extent.index;
+            push(output, token);
          }
 
          advance();
       }
 
       // Replace all labels with their memory addresses
-      for (auto& [label, ind] : labels)
+      for (auto [position, symbol] : references)
       {
-         if (!definitions.count(label))
-            catcher.insert("Undefined label '"s + tokens.at(ind).lexeme + "' while translating."s);
+         Token& label = output.at(position);
+
+         if (!defined.at(symbol) && vm.object)
+         {
+            // Left for the linker to find in another module
+            label.type = Token::Type::label;
+            label.value = 0;
+            vm.object->targets[position] = {vm.object->import_symbol(names.name(symbol)), false};
+         }
+         else if (!defined.at(symbol))
+            catcher.insert("Undefined label '"s + std::string(names.name(symbol)) + "' while translating."s);
          else
-            tokens.at(ind) = {Token::Type::label, definitions.at(label)};
+         {
+            label.type = Token::Type::label;
+            label.value = addresses.at(symbol);
+
+            if (vm.object)
+               vm.object->targets[position] = {-1, relocatable.at(symbol)};
+         }
       }
+      return true;
+   }
 
-      // Erase label definitions
-      tokens.erase(std::remove_if(tokens.begin(), tokens.end(),
-      [](const auto& t) -> bool
-      {
-         return t.lexeme == "FLAG_FOR_DEL"s;
-      }), tokens.end());
+   // The token with its offset moved into the source map
+   Token rebase(Token token) const
+   {
+      token.offset += base;
+      return token;
+   }
+
+   void push(std::vector<Token>& output, const Token& token) const
+   {
+      output.push_back(rebase(token));
+   }
+
+   // Address the next word of the file goes to
+   std::int32_t memory_index() const
+   {
+      return static_cast<std::int32_t>(extent.absolute ? extent.index : start + extent.index);
    }
 
    void advance()
@@ -140,14 +231,6 @@ public:
    {
       return index + 1 < tokens.size() && tokens.at(index + 1).type == type;
    }
-
-private:
-   Catcher& catcher;
-   std::vector<Token>& tokens;
-   std::vector<std::pair<std::string, size_t>> labels;
-   std::unordered_map<std::string, std::string> definitions;
-   size_t memory_index = pcStart;
-   size_t index = 0;
 };
 
 #endif // TRANSLATOR_HPP
@@ -1,6 +1,14 @@
+#include "assembler.hpp"
+#include "batch.hpp"
+#include "executable.hpp"
 #include "executor.hpp"
-#include "parser.hpp"
-#include "translator.hpp"
+#include "linker.hpp"
+#include "pipeline.hpp"
+#include "snapshot.hpp"
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <optional>
 
 // Project by chalcinxx
 // https://www.youtube.com/playlist?list=PLAYMpoWModGOzP_LNhaJDvMbUxX_9OI90
@@ -19,8 +27,107 @@
 // The commands can be found in opcodes.hpp file, where their bit size and
 // functions are documented.
 
+// Number given to a command, or nothing if it isn't made of digits alone or
+// is larger than the maximum
+std::optional<std::uint64_t> parse_number(const std::string& text, std::uint64_t max)
+{
+   std::uint64_t value = 0;
+   auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+
+   if (text.empty() || error != std::errc{} || end != text.data() + text.size() || value > max)
+      return std::nullopt;
+   return value;
+}
+
+// Where and when the programs that run write snapshots, if anywhere
+struct SnapshotOptions
+{
+   fs::path path;
+   std::uint64_t after = 0;
+};
+
+// Execute the program loaded into the virtual machine and print the results.
+// Programs resumed from a snapshot continue from the registers they have.
+void execute_program(VmContext& vm, Engine engine, std::uint32_t threshold, const fs::path& flame_graph = {},
+                     const SnapshotOptions& snapshot = {}, bool resumed = false)
+{
+   Catcher catcher;
+
+   // Execute instructions one by one
+   Executor executor (vm, engine, threshold);
+   if (!snapshot.path.empty())
+      executor.snapshot_into(catcher, snapshot.path, snapshot.after);
+
+   auto start = std::chrono::steady_clock::now();
+   if (resumed)
+      executor.resume();
+   else
+      executor.execute();
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   // Temporarily print out 5 registers before traps are added
+   std::cout << vm.reg.at(R_R0) << std::endl;
+   std::cout << vm.reg.at(R_R1) << std::endl;
+   std::cout << vm.reg.at(R_R2) << std::endl;
+   std::cout << vm.reg.at(R_R3) << std::endl;
+   std::cout << vm.reg.at(R_R4) << std::endl;
+   if (vm.fault)
+      vm.fault.display();
+   if (engine == Engine::fused)
+      executor.fusion_report().display();
+   if (engine == Engine::tiered)
+      executor.tier_report().display();
+   if (vm.trace)
+   {
+      // Anything but a HALT stopping the program is a fault, show how it
+      // got there
+      std::int32_t pc = vm.reg.at(R_PC);
+      if (pc < 0 || pc >= static_cast<std::int32_t>(maxMemory) || vm.memory[pc] != haltInstruction)
+      {
+         std::cout << "Program stopped without a HALT at "s << hex_address(pc) << ".\n"s;
+         vm.trace->display();
+      }
+      else
+         std::cout << "Traced "s << vm.trace->recorded() << " instructions, 'trace show' for the last of them.\n"s;
+   }
+   if (vm.profiler)
+   {
+      vm.profiler->display(vm.sources);
+
+      Catcher catcher;
+      if (!flame_graph.empty() && write_flame_graph(catcher, vm, flame_graph))
+         std::cout << "Wrote the call stacks into '"s << flame_graph.string() << "'.\n"s;
+      catcher.display();
+   }
+   if (executor.snapshots() > 0)
+   {
+      std::cout << "Wrote "s << executor.snapshots() << " snapshot"s << (executor.snapshots() == 1 ? ""s : "s"s);
+      std::cout << " into '"s << snapshot.path.string() << "'.\n"s;
+   }
+   catcher.display();
+   std::cout << "Executed in "s << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us.\n"s;
+}
+
 int main()
 {
+   Engine engine = Engine::threaded;
+   std::uint32_t threshold = defaultThreshold;
+   bool streaming = false;
+   bool optimizing = false;
+   bool profiling = false;
+   std::string flame_graph;
+   SnapshotOptions snapshot;
+
+   // Last instructions of the latest program, kept after it stops
+   std::unique_ptr<TraceBuffer> trace;
+
+   // Only the threaded engine and the profiler record the trace, the
+   // executor runs on them in place of the selected engine while it's on
+   const std::string tracedEngine = "Programs run on the threaded engine, or the profiler, while tracing is on.\n"s;
+
+   // Token streams of the files, kept between runs and on disk
+   TokenCache cache (user_cache_directory());
+
    while (true)
    {
       // Get file from the user
@@ -36,6 +143,20 @@ int main()
          std::cout << "Run a file: 'run file.asx'\n";
          std::cout << "Compile a file: 'compile file.asx executable.exf'\n";
          std::cout << "Run an executable: 'exec executable.exf'\n";
+         std::cout << "Assemble a file into an object file: 'assemble file.asx module.obj'\n";
+         std::cout << "Link object files into an executable: 'link executable.exf main.obj lib.obj ...'\n";
+         std::cout << "Run every file of a manifest on all cores: 'batch manifest.txt' or 'batch manifest.txt 4'\n";
+         std::cout << "Show or clear the token cache: 'cache' or 'cache clear'\n";
+         std::cout << "Select the engine: 'engine legacy', 'threaded', 'predecoded', 'fused', 'jit' or 'tiered'\n";
+         std::cout << "Set the tier-up threshold: 'threshold 1000'\n";
+         std::cout << "Select the assembler pipeline: 'pipeline buffered' or 'streaming'\n";
+         std::cout << "Optimize the programs before running or compiling them: 'optimize on' or 'off'\n";
+         std::cout << "Profile the programs that run: 'profile on', 'profile on stacks.folded' or 'profile off'\n";
+         std::cout << "Trace the last instructions of the programs that run, on the threaded engine: 'trace on', 'trace on 65536' or 'trace off'\n";
+         std::cout << "Show or save the trace of the last program: 'trace show', 'trace show 100' or 'trace save file.trc'\n";
+         std::cout << "Snapshot the programs that run at every SNAP or after a number of instructions: 'snapshot on file.vms',\n";
+         std::cout << "   'snapshot on file.vms 1000000' or 'snapshot off'\n";
+         std::cout << "Resume a program from a snapshot: 'restore file.vms'\n";
          std::cout << "Quit the program: 'quit' or 'exit'\n";
          continue;
       }
@@ -48,6 +169,169 @@ int main()
 
       Catcher catcher;
 
+      // Engine selection
+      if (command == "engine"s && output.empty())
+      {
+         if (input == "legacy"s)
+            engine = Engine::legacy;
+         else if (input == "threaded"s)
+            engine = Engine::threaded;
+         else if (input == "predecoded"s)
+            engine = Engine::predecoded;
+         else if (input == "fused"s)
+            engine = Engine::fused;
+         else if (input == "jit"s)
+            engine = Engine::jit;
+         else if (input == "tiered"s)
+            engine = Engine::tiered;
+         else
+         {
+            catcher.insert("Unknown engine: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+            continue;
+         }
+
+         if (trace && engine != Engine::threaded)
+            std::cout << tracedEngine;
+         continue;
+      }
+
+      // Token cache statistics
+      if (command == "cache"s && output.empty())
+      {
+         if (input == "clear"s)
+            cache.clear();
+         else if (!input.empty())
+         {
+            catcher.insert("Unknown cache command: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+            continue;
+         }
+
+         auto statistics = cache.get_statistics();
+         std::cout << "Token cache: " << statistics.memory_hits << " memory hits, " << statistics.disk_hits;
+         std::cout << " disk hits, " << statistics.misses << " misses.\n";
+         continue;
+      }
+
+      // Assembler pipeline selection
+      if (command == "pipeline"s && output.empty())
+      {
+         if (input == "buffered"s || input == "streaming"s)
+            streaming = (input == "streaming"s);
+         else
+         {
+            catcher.insert("Unknown pipeline: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+         }
+         continue;
+      }
+
+      // Optimization of assembled programs
+      if (command == "optimize"s && output.empty())
+      {
+         if (input == "on"s || input == "off"s)
+            optimizing = (input == "on"s);
+         else
+         {
+            catcher.insert("Unknown optimize option: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+         }
+         continue;
+      }
+
+      // Profiling of executed programs, optionally into a flame graph
+      if (command == "profile"s)
+      {
+         if (input == "on"s || (input == "off"s && output.empty()))
+         {
+            profiling = (input == "on"s);
+            flame_graph = output;
+         }
+         else
+         {
+            catcher.insert("Unknown profile option: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+         }
+         continue;
+      }
+
+      // Tracing of executed programs and dumps of the last trace
+      if (command == "trace"s)
+      {
+         auto count = parse_number(output, TraceBuffer::maxCapacity);
+
+         if ((input == "on"s || input == "show"s) && !output.empty() && !count)
+         {
+            catcher.insert("Invalid trace length: '"s + output + "', expected a number up to "s +
+                           std::to_string(TraceBuffer::maxCapacity) + "."s);
+            catcher.display();
+         }
+         else if (input == "on"s)
+         {
+            trace = std::make_unique<TraceBuffer>(count.value_or(TraceBuffer::defaultCapacity));
+            if (engine != Engine::threaded)
+               std::cout << tracedEngine;
+         }
+         else if (input == "off"s && output.empty())
+            trace.reset();
+         else if (input == "show"s || (input == "save"s && !output.empty()))
+         {
+            if (!trace)
+               catcher.insert("Tracing is off, nothing was traced."s);
+            else if (input == "show"s)
+               trace->display(count.value_or(32));
+            else if (trace->write(catcher, output))
+               std::cout << "Saved the trace into '"s << output << "'.\n"s;
+            catcher.display();
+         }
+         else
+         {
+            catcher.insert("Unknown trace option: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+         }
+         continue;
+      }
+
+      // Snapshots of executed programs
+      if (command == "snapshot"s)
+      {
+         std::string count;
+         iss >> count;
+
+         auto after = parse_number(count, UINT64_MAX);
+
+         if (input == "on"s && !output.empty() && !count.empty() && !after)
+         {
+            catcher.insert("Invalid instruction count: '"s + count + "', expected a number."s);
+            catcher.display();
+         }
+         else if (input == "on"s && !output.empty())
+            snapshot = {output, after.value_or(0)};
+         else if (input == "off"s && output.empty())
+            snapshot = {};
+         else
+         {
+            catcher.insert("Unknown snapshot option: '"s + input + "'. Type 'help' for help."s);
+            catcher.display();
+         }
+         continue;
+      }
+
+      // Tier-up threshold of the tiered engine
+      if (command == "threshold"s && output.empty())
+      {
+         if (auto value = parse_number(input, UINT32_MAX))
+            threshold = std::max<std::uint64_t>(1, *value);
+         else
+         {
+            catcher.insert("Invalid threshold: '"s + input + "', expected a positive number up to "s +
+                           std::to_string(UINT32_MAX) + "."s);
+            catcher.display();
+         }
+         continue;
+      }
+
       // Interpretation
       if (command == "run"s && output.empty())
       {
@@ -58,50 +342,157 @@ int main()
             continue;
          }
 
-         catcher.specify(input);
-         translated_files.clear();
+         // Every run gets a fresh machine
+         auto vm = std::make_unique<VmContext>();
+         vm->cache = &cache;
+         vm->threads = std::thread::hardware_concurrency();
+
+         OptimizerReport optimizations;
+         if (optimizing)
+            vm->optimizer = &optimizations;
 
-         // Tokenize the file contents
-         Lexer lexer (catcher, input);
-         auto& tokens = lexer.tokenize();
+         std::unique_ptr<Profile> profile;
+         if (profiling)
+            vm->profiler = (profile = std::make_unique<Profile>()).get();
+         if (trace)
+            trace->clear();
+         vm->trace = trace.get();
+         (streaming ? assemble_streaming : assemble)(catcher, *vm, input);
 
          if (catcher.display()) continue;
+         if (optimizing)
+            optimizations.display();
+
+         execute_program(*vm, engine, threshold, flame_graph, snapshot);
+      }
+
+      // Compiling
+      else if (command == "compile"s && !output.empty())
+      {
+         if (!fs::is_regular_file(input))
+         {
+            catcher.insert("File '"s + input + "' could not be opened or found."s);
+            catcher.display();
+            continue;
+         }
 
-         // Replace labels with memory addresses and handle includes
-         Translator translator (catcher, tokens);
-         translator.translate();
+         auto vm = std::make_unique<VmContext>();
+         vm->cache = &cache;
+         vm->threads = std::thread::hardware_concurrency();
+
+         OptimizerReport optimizations;
+         if (optimizing)
+            vm->optimizer = &optimizations;
+         if ((streaming ? assemble_streaming : assemble)(catcher, *vm, input))
+            write_executable(catcher, *vm, output);
 
          if (catcher.display()) continue;
-         catcher.specify(""s);
+         if (optimizing)
+            optimizations.display();
+         std::cout << "Compiled '"s << input << "' into '"s << output << "'.\n"s;
+      }
 
-         // Parse tokens into instructions and place them in memory
-         Parser parser (catcher, tokens);
-         parser.parse();
+      // Assembling into an object file
+      else if (command == "assemble"s && !output.empty())
+      {
+         if (!fs::is_regular_file(input))
+         {
+            catcher.insert("File '"s + input + "' could not be opened or found."s);
+            catcher.display();
+            continue;
+         }
+
+         ObjectModule module;
+         if (assemble_object(catcher, module, input, &cache, std::thread::hardware_concurrency()))
+            write_object(catcher, module, output);
 
          if (catcher.display()) continue;
+         std::cout << "Assembled '"s << input << "' into '"s << output << "'.\n"s;
+      }
 
-         // Execute instructions one by one
-         Executor executor;
-         executor.execute();
+      // Linking object files into an executable
+      else if (command == "link"s && !output.empty())
+      {
+         std::vector<std::string> files {output};
+         for (std::string file; iss >> file;)
+            files.push_back(file);
 
-         // Temporarily print out 5 registers before traps are added
-         std::cout << reg.at(R_R0) << std::endl;
-         std::cout << reg.at(R_R1) << std::endl;
-         std::cout << reg.at(R_R2) << std::endl;
-         std::cout << reg.at(R_R3) << std::endl;
-         std::cout << reg.at(R_R4) << std::endl;
+         auto start = std::chrono::steady_clock::now();
+         std::vector<ObjectModule> modules (files.size());
+
+         for (std::size_t index = 0; index < files.size(); ++index)
+            if (!load_object(catcher, modules.at(index), files.at(index)))
+               break;
+
+         auto vm = std::make_unique<VmContext>();
+         if (!catcher.any_errors() && link(catcher, *vm, modules))
+            write_executable(catcher, *vm, input);
+         auto elapsed = std::chrono::steady_clock::now() - start;
+
+         if (catcher.display()) continue;
+         std::cout << "Linked "s << modules.size() << " module"s << (modules.size() == 1 ? ""s : "s"s) << " into '"s << input;
+         std::cout << "' in "s << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us.\n"s;
       }
 
-      // Compiling
-      else if (command == "compile"s && !output.empty())
+      // Running a batch of files on multiple threads
+      else if (command == "batch"s)
       {
+         auto count = parse_number(output, maxThreads);
+         if (!output.empty() && !count)
+         {
+            catcher.insert("Invalid thread count: '"s + output + "', expected a positive number up to "s +
+                           std::to_string(maxThreads) + "."s);
+            catcher.display();
+            continue;
+         }
+
+         auto files = read_manifest(catcher, input);
+         if (catcher.display()) continue;
 
+         std::size_t threads = (output.empty() ? std::thread::hardware_concurrency() : *count);
+         run_batch(files, engine, threshold, threads, &cache).display();
       }
 
       // Running an executable
       else if (command == "exec"s && output.empty())
       {
+         auto vm = std::make_unique<VmContext>();
+         auto start = std::chrono::steady_clock::now();
+         load_executable(catcher, *vm, input);
+         auto elapsed = std::chrono::steady_clock::now() - start;
+
+         if (catcher.display()) continue;
+
+         std::cout << "Loaded in "s << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us.\n"s;
+
+         std::unique_ptr<Profile> profile;
+         if (profiling)
+            vm->profiler = (profile = std::make_unique<Profile>()).get();
+         if (trace)
+            trace->clear();
+         vm->trace = trace.get();
+         execute_program(*vm, engine, threshold, flame_graph, snapshot);
+      }
+
+      // Resuming from a snapshot
+      else if (command == "restore"s && output.empty())
+      {
+         auto vm = std::make_unique<VmContext>();
+         auto start = std::chrono::steady_clock::now();
+         load_snapshot(catcher, *vm, input);
+         auto elapsed = std::chrono::steady_clock::now() - start;
+
+         if (catcher.display()) continue;
+
+         std::cout << "Restored in "s << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us.\n"s;
 
+         std::unique_ptr<Profile> profile;
+         if (profiling)
+            vm->profiler = (profile = std::make_unique<Profile>()).get();
+         if (trace)
+            trace->clear();
+         vm->trace = trace.get();
+         execute_program(*vm, engine, threshold, flame_graph, snapshot, true);
       }
 
       // Invalid statement